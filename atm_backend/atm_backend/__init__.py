@@ -1,6 +1,7 @@
 from .provision_tool import ProvisionTool
 from .atm import ATM
-from interface.bank import Bank, DummyBank
+from interface.bank import Bank, BinaryBank, DummyBank
 from interface.hsm import HSM, DummyHSM
 from interface.card import Card, DummyCard
 from interface.psoc import DeviceRemoved
+from interface.serial_capture import SerialRecorder, SerialReplay
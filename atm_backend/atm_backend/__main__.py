@@ -12,9 +12,11 @@ Module structure:
     behavior of each without PSoCs or a bank server, allowing for isolated
     testing of each real component.
 
-    Instead of using pyserial, DummyHSM and DummyBank each use a SerialEmulator
-    from ./interface/serial_emulator, which emulate the behavior of a serial
-    port attached to a PSoC HSM or card.
+    Instead of using pyserial, DummyHSM and DummyCard each use a SerialEmulator
+    from ./interface/serial_emulator, which runs a port of the PSoC HSM or card
+    firmware behind an emulated serial port. The emulators do their crypto with
+    the bank's crypto extension, which the Dockerfile builds into the image
+    from bank_server/wrapper.
 
 
 config.yaml:
@@ -91,17 +93,58 @@ Available XML-RPC functions:
         Returns:
             str: 'success' on success
                  'failure' if HSM failed during provisioning
+
+Provisioning station functions (provision_station: enabled: true):
+    submit_card / submit_atm:
+        Queue a card_blob and pin / hsm_blob and bills for the next free
+        unprovisioned card / HSM plugged into the station
+
+        Returns:
+            str: Job id (the card_id / hsm_id), False on malformed input
+                 or if that job is still running
+
+    job_status:
+        Returns:
+            str: 'queued', 'provisioning', 'registering', 'success',
+                 'failure' or 'unknown'
+
+    station_status:
+        Returns:
+            dict: Per-port device progress, queue lengths and job counts
 """
 
 import os
 import logging
 from logging import handlers
 import sys
-import SimpleXMLRPCServer
 import yaml
 import threading
-from . import ATM, ProvisionTool
-from . import Bank, Card, HSM, DummyBank, DummyCard, DummyHSM
+from . import ATM, ProvisionTool, tracing
+from .provision_station import ProvisionStation
+from . import Bank, BinaryBank, Card, HSM, DummyBank, DummyCard, DummyHSM
+from . import SerialReplay
+from .rpc_server import ThreadedXMLRPCServer
+
+
+def run_provision_station(config, station_config, bank):
+    logging.info('Initializing Provision Station...')
+    station = ProvisionStation(bank, ports=station_config.get('ports'),
+                               verbose=config['verbose'],
+                               batch_size=station_config.get('batch_size', 16),
+                               batch_interval=station_config.get('batch_interval', 1.0),
+                               max_finished=station_config.get('max_finished', 1024))
+    logging.info('Provision Station initialized.')
+
+    server = ThreadedXMLRPCServer((config['devices']['atm']['host'], config['devices']['atm']['port']))
+    server.register_introspection_functions()
+    server.register_function(station.submit_card)
+    server.register_function(station.submit_atm)
+    server.register_function(station.job_status)
+    server.register_function(station.station_status)
+    logging.info('Provision Station listening on %s:%s' % (config['devices']['atm']['host'], str(config['devices']['atm']['port'])))
+
+    station.start()
+    server.serve_forever()
 
 
 def main():
@@ -125,35 +168,69 @@ def main():
         fh.setFormatter(log_format)
         log.addHandler(fh)
 
+    tracing.configure(config.get('tracing'), 'atm_backend')
+
+    # Serial sessions can be recorded from, or replayed in place of, the
+    # real PSoCs. See interface/serial_capture.py
+    capture = config.get('capture', {})
+    capture_path = os.path.dirname(__file__) + capture.get('path', '')
+
     # Create Bank object which creates connection with bank server
     # a dummy counterpart is also available for use
     logging.info('Initializing Bank...')
     if config['devices']['bank']['dummy']:
         bank = DummyBank()
+    elif config['devices']['bank'].get('protocol') == 'binary':
+        bank = BinaryBank(config['devices']['bank']['host'],
+                          config['devices']['bank']['port'],
+                          config['devices']['bank']['binary_port'])
     else:
         bank = Bank(config['devices']['bank']['host'],
                     config['devices']['bank']['port'])
     logging.info('Bank initialized.')
 
+    # Provisioning station mode replaces the single HSM and card with one
+    # worker per attached device. See provision_station.py
+    station_config = config.get('provision_station', {})
+    if station_config.get('enabled'):
+        run_provision_station(config, station_config, bank)
+        return
+
     # Create secmod object which creates connection with secmod psoc
     # a emulated counterpart is also available for use
-    if config['devices']['hsm']['dummy']:
+    hsm_config = config['devices']['hsm']
+    if hsm_config['dummy']:
         logging.info('Initializing DummyHSM ')
         hsm = DummyHSM(verbose=config['verbose'], provision=True)
         logging.info('DummyHSM initialized.')
+    elif hsm_config.get('replay'):
+        logging.info('Initializing HSM from capture %s...' % hsm_config['replay'])
+        hsm = HSM(port=SerialReplay('%s/%s' % (capture_path, hsm_config['replay']),
+                                    realtime=capture.get('realtime', False)),
+                  verbose=config['verbose'])
+        logging.info('HSM initialized.')
     else:
         logging.info('Initializing HSM...')
-        hsm = HSM(verbose=config['verbose'])
+        hsm = HSM(verbose=config['verbose'],
+                  record=capture_path if hsm_config.get('record') else None)
         logging.info('HSM initialized.')
 
     # Create card object which connects and reconnects to inserted cards
-    if config['devices']['card']['dummy']:
+    card_config = config['devices']['card']
+    if card_config['dummy']:
         logging.info('Initializing DummyCard...')
         card = DummyCard(verbose=config['verbose'], provision=True)
         logging.info('DummyCard initialized.')
+    elif card_config.get('replay'):
+        logging.info('Initializing Card from capture %s...' % card_config['replay'])
+        card = Card(port=SerialReplay('%s/%s' % (capture_path, card_config['replay']),
+                                      realtime=capture.get('realtime', False)),
+                    verbose=config['verbose'])
+        logging.info('Card initialized.')
     else:
         logging.info('Initializing Card...')
-        card = Card(verbose=config['verbose'])
+        card = Card(verbose=config['verbose'],
+                    record=capture_path if card_config.get('record') else None)
         logging.info('Card initialized.')
 
     # Create ATM object with bank, hsm, and card instances
@@ -167,7 +244,9 @@ def main():
 
     # Start xmlrpc server on host and port specified in config.yaml
     logging.info('Initializing ATM xmlrpc interface...')
-    server = SimpleXMLRPCServer.SimpleXMLRPCServer((config['devices']['atm']['host'], config['devices']['atm']['port']))
+    # Threaded so status calls are answered while a transaction holds the
+    # devices; transactions are serialized by the device transaction locks
+    server = ThreadedXMLRPCServer((config['devices']['atm']['host'], config['devices']['atm']['port']))
 
     # Register built-in rpc introspections
     server.register_introspection_functions()
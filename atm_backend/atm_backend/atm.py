@@ -1,6 +1,7 @@
 import logging
 import xmlrpclib
-from interface.psoc import DeviceRemoved, NotProvisioned
+from interface.psoc import DeviceRemoved, NotProvisioned, holds
+from . import tracing
 
 class ATM(object):
     """
@@ -29,6 +30,8 @@ class ATM(object):
         return "hello"
 
 
+    @tracing.traced('atm.check_balance')
+    @holds('hsm', 'card')
     def check_balance(self, pin): #secured
         """
         Tries to check the balance of the account associated with the
@@ -98,6 +101,8 @@ class ATM(object):
             logging.info('ATM card has not been provisioned!')
             return False
 
+    @tracing.traced('atm.change_pin')
+    @holds('card')
     def change_pin(self, old_pin, new_pin): #secured
         """
         Tries to change the PIN of the connected ATM card
@@ -151,6 +156,8 @@ class ATM(object):
             logging.info('ATM card has not been provisioned!')
             return False
 
+    @tracing.traced('atm.withdraw')
+    @holds('hsm', 'card')
     def withdraw(self, pin, amount):
         """
         Tries to withdraw money from the account associated with the
@@ -1,6 +1,7 @@
-from .bank import Bank, DummyBank
+from .bank import Bank, BinaryBank, DummyBank
 from .card import Card, DummyCard
 from .hsm import HSM, DummyHSM
 from .psoc import Psoc
+from .serial_capture import SerialRecorder, SerialReplay
 from .psoc import DeviceRemoved, NotProvisioned, AlreadyProvisioned
 import serial_emulator
@@ -5,8 +5,49 @@ import sys
 import socket
 import xmlrpclib
 import base64
+import errno
+import httplib
 import random 
+import re
 import string
+import struct
+import threading
+from .. import tracing
+
+class KeepAliveTransport(tracing.TracingTransport):
+    """
+    xmlrpclib transport that keeps one HTTP/1.1 connection to the bank open
+    per thread, so a transaction's calls skip the TCP handshake and the
+    bank's accept and teardown
+
+    The bank closes connections that go idle or whose worker it needs, and
+    that is only noticed on the next call. xmlrpclib.Transport.request()
+    then closes the connection and retries the call once on a new one, as
+    long as the old one failed before any response arrived.
+
+    Args:
+        timeout (float, optional): Socket timeout in seconds
+    """
+
+    def __init__(self, timeout=30):
+        tracing.TracingTransport.__init__(self)
+        self.timeout = timeout
+        self.local = threading.local()
+
+    def make_connection(self, host):
+        connection = getattr(self.local, 'connection', None)
+        if connection is not None and connection[0] == host:
+            return connection[1]
+        chost, self._extra_headers, x509 = self.get_host_info(host)
+        self.local.connection = (host, httplib.HTTPConnection(chost, timeout=self.timeout))
+        return self.local.connection[1]
+
+    def close(self):
+        connection = getattr(self.local, 'connection', None)
+        if connection is not None:
+            self.local.connection = None
+            connection[1].close()
+
 
 class Bank:
     """
@@ -19,12 +60,14 @@ class Bank:
     
     def __init__(self, address='127.0.0.1', port=1337):
         try:
-            self.bank_rpc = xmlrpclib.ServerProxy('http://' + address + ':' + str(port))
+            self.bank_rpc = xmlrpclib.ServerProxy('http://' + address + ':' + str(port),
+                                                  transport=KeepAliveTransport())
         except socket.error:
             logging.error('Error connecting to bank server')
             sys.exit(1)
         logging.info('Connected to Bank at %s:%s' % (address, str(port)))
     
+    @tracing.traced('bank_rpc.get_nonce', flow_out=True)
     def get_nonce(self,card_id):
         '''
         Asks the bank server to generate a random nonce so that the card can proove itself
@@ -42,6 +85,7 @@ class Bank:
         return nonce
     
 
+    @tracing.traced('bank_rpc.check_balance', flow_out=True)
     def check_balance(self, card_id, nonce, signature, hsm_id, hsm_nonce):
         '''
         Verifies that a nonce has been properly signed. 
@@ -64,6 +108,7 @@ class Bank:
         return encrypted_balance
 
     
+    @tracing.traced('bank_rpc.change_pin', flow_out=True)
     def change_pin(self, card_id, nonce, signature, new_pk):
         '''
         Changes the public key the server is using
@@ -81,6 +126,7 @@ class Bank:
             return None
         return res
 
+    @tracing.traced('bank_rpc.withdraw', flow_out=True)
     def withdraw(self, card_id, nonce, signature, hsm_id, hsm_nonce, amount):
         '''
         Requests server to aproove a withdraw request. 
@@ -100,6 +146,7 @@ class Bank:
             return None
         return res
 
+    @tracing.traced('bank_rpc.set_first_pk', flow_out=True)
     def set_first_pk(self,card_id,pk):
         '''
         Requests server to set a card's first pk (for provisioning)
@@ -112,6 +159,7 @@ class Bank:
         '''
         return self.bank_rpc.set_first_pk(card_id, xmlrpclib.Binary(pk)) 
 
+    @tracing.traced('bank_rpc.set_initial_num_bills', flow_out=True)
     def set_initial_num_bills(self, hsm_id, num_bills):
         '''
         Requests server to set hsm's initial balance (for provisioning)
@@ -124,6 +172,189 @@ class Bank:
         '''
         return self.bank_rpc.set_initial_num_bills(hsm_id, num_bills) 
 
+    @tracing.traced('bank_rpc.set_first_pk_batch', flow_out=True)
+    def set_first_pk_batch(self, items):
+        '''
+        Requests server to set the first pk of many cards in one call
+        Args:
+            items (list of (str, str)): (card_id, pk) pairs
+
+        Returns:
+            list of bool: True for each card that was set, False otherwise
+        '''
+        return self.bank_rpc.set_first_pk_batch([(card_id, xmlrpclib.Binary(pk))
+                                                 for card_id, pk in items])
+
+    @tracing.traced('bank_rpc.set_initial_num_bills_batch', flow_out=True)
+    def set_initial_num_bills_batch(self, items):
+        '''
+        Requests server to set the initial balance of many hsms in one call
+        Args:
+            items (list of (str, int)): (hsm_id, num_bills) pairs
+
+        Returns:
+            list of bool: True for each hsm that was set, False otherwise
+        '''
+        return self.bank_rpc.set_initial_num_bills_batch(list(items))
+
+def field_sizes(layout):
+    """
+    Args:
+        layout (struct.Struct): Request layout
+
+    Returns:
+        list: Exact length of each field of layout, None for the numbers
+    """
+    return [int(count or 1) if code == 's' else None
+            for (count, code) in re.findall(r'(\d*)([a-zA-Z?])', layout.format)]
+
+class StaleConnection(Exception):
+    """The bank closed a kept-open connection before reading a request on it"""
+
+
+class BinaryBank(Bank):
+    """
+    Bank that makes the per-transaction calls (get_nonce, check_balance,
+    withdraw and change_pin) over the bank's compact binary protocol, on one
+    connection kept open between calls. Provisioning calls still go over
+    XML-RPC. See bank_server/binary_rpc.py for the wire format
+
+    Args:
+        address (str): IP address of bank
+        port (int): XML-RPC port to connect to
+        binary_port (int): Binary protocol port to connect to
+        timeout (float, optional): Socket timeout in seconds
+    """
+
+    # must match bank_server/binary_rpc.py
+    HEADER = struct.Struct('>IB')
+    GET_NONCE = 0x01
+    CHECK_BALANCE = 0x02
+    WITHDRAW = 0x03
+    CHANGE_PIN = 0x04
+    OK = 0x00
+    GET_NONCE_REQUEST = struct.Struct('>36s')
+    CHECK_BALANCE_REQUEST = struct.Struct('>36s32s64s36s32s')
+    WITHDRAW_REQUEST = struct.Struct('>36s32s64s36s32sI')
+    CHANGE_PIN_REQUEST = struct.Struct('>36s32s64s32s')
+
+    def __init__(self, address='127.0.0.1', port=1337, binary_port=1339, timeout=30):
+        Bank.__init__(self, address, port)
+        self.binary_address = (address, binary_port)
+        self.timeout = timeout
+        self.sock = None
+        self.lock = threading.Lock()
+
+    def _connect(self):
+        self.sock = socket.create_connection(self.binary_address, self.timeout)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        logging.info('Connected to Bank binary protocol at %s:%d' % self.binary_address)
+
+    def _close(self):
+        if self.sock is not None:
+            self.sock.close()
+            self.sock = None
+
+    def _recv(self, size, data=''):
+        while len(data) < size:
+            chunk = self.sock.recv(size - len(data))
+            if not chunk:
+                raise socket.error('bank closed the connection')
+            data += chunk
+        return data
+
+    def _exchange(self, request):
+        """
+        Sends request and reads the response
+
+        Raises:
+            StaleConnection: The bank had closed the connection, so the
+                request never reached it
+            socket.error: Anything else, including a timeout, after which
+                the bank may or may not have acted on the request
+        """
+        try:
+            self.sock.sendall(request)
+        except socket.error as err:
+            if err.errno in (errno.ECONNRESET, errno.ECONNABORTED, errno.EPIPE):
+                raise StaleConnection(err)
+            raise
+        first = self.sock.recv(1)
+        if not first:
+            raise StaleConnection('bank closed the connection')
+        (length, status) = self.HEADER.unpack(self._recv(self.HEADER.size, first))
+        return (status, self._recv(length - 1))
+
+    def _call(self, name, opcode, layout, *fields):
+        """
+        Sends one request and waits for its response
+
+        A connection the bank has already dropped (idle timeout, restart)
+        is only noticed when it is used. The request is then sent again on a
+        fresh connection, but only if the failure shows the bank never read
+        it: a reset while sending, or the connection closing before any of
+        the response. After a timeout or a failure mid-response the bank may
+        have acted on the request (debited a withdrawal), so it is never
+        resent.
+
+        Returns:
+            str: Result bytes, or None if the bank refused the request, the
+                fields do not fit layout or the bank could not be reached
+        """
+        context = tracing.current_context() or ''
+        try:
+            # pack pads short strings and cuts long ones, which would send
+            # the bank a different id or key than the one given
+            for (i, (field, size)) in enumerate(zip(fields, field_sizes(layout))):
+                if size is not None and len(field) != size:
+                    raise struct.error('field %d is %d bytes, not %d' % (i, len(field), size))
+            request = layout.pack(*fields) + context
+        except (struct.error, TypeError) as err:
+            logging.info('Error in %s: bad arguments: %s' % (name, err))
+            return None
+        request = self.HEADER.pack(len(request) + 1, opcode) + request
+
+        with self.lock:
+            for attempt in (0, 1):
+                reused = self.sock is not None
+                try:
+                    if not reused:
+                        self._connect()
+                    (status, result) = self._exchange(request)
+                    break
+                except StaleConnection as err:
+                    self._close()
+                    if not reused or attempt:
+                        logging.error('Error in %s: %s' % (name, err))
+                        return None
+                except socket.error as err:
+                    self._close()
+                    logging.error('Error in %s: %s' % (name, err))
+                    return None
+        if status != self.OK:
+            logging.info('Error in %s: %s' % (name, result))
+            return None
+        return result
+
+    @tracing.traced('bank_rpc.get_nonce', flow_out=True)
+    def get_nonce(self, card_id):
+        return self._call('get_nonce', self.GET_NONCE, self.GET_NONCE_REQUEST, card_id)
+
+    @tracing.traced('bank_rpc.check_balance', flow_out=True)
+    def check_balance(self, card_id, nonce, signature, hsm_id, hsm_nonce):
+        return self._call('check_balance', self.CHECK_BALANCE, self.CHECK_BALANCE_REQUEST,
+                          card_id, nonce, signature, hsm_id, hsm_nonce)
+
+    @tracing.traced('bank_rpc.change_pin', flow_out=True)
+    def change_pin(self, card_id, nonce, signature, new_pk):
+        return self._call('change_pin', self.CHANGE_PIN, self.CHANGE_PIN_REQUEST,
+                          card_id, nonce, signature, new_pk)
+
+    @tracing.traced('bank_rpc.withdraw', flow_out=True)
+    def withdraw(self, card_id, nonce, signature, hsm_id, hsm_nonce, amount):
+        return self._call('withdraw', self.WITHDRAW, self.WITHDRAW_REQUEST,
+                          card_id, nonce, signature, hsm_id, hsm_nonce, amount)
+
 class DummyBank:
     """Emulated bank for testing"""
 
@@ -1,8 +1,10 @@
 from psoc import Psoc
+from .. import tracing
 from serial_emulator import CardEmulator
 from binascii import hexlify
 import logging
 import struct
+import threading
 
 
 class Card(Psoc):
@@ -13,15 +15,19 @@ class Card(Psoc):
         port (str, optional): Serial port connected to an ATM card
             Default is dynamic card acquisition
         verbose (bool, optional): Whether to print debug messages
+        record (str, optional): Directory to record serial sessions into
     """
 
-    def __init__(self, port=None, verbose=False):
+    def __init__(self, port=None, verbose=False, record=None):
         self.port = port
         self.verbose = verbose
+        self.record = record
+        self.transaction_lock = threading.Lock()
 
     def initialize(self):
-        super(Card, self).__init__('CARD', self.port, self.verbose)
+        super(Card, self).__init__('CARD', self.port, self.verbose, self.record)
 
+    @tracing.traced('card.get_card_id')
     def get_card_id(self):
         """
         Checks the card balance
@@ -38,6 +44,7 @@ class Card(Psoc):
             return None
         return uuid
     
+    @tracing.traced('card.sign_nonce')
     def sign_nonce(self,nonce, pin):
         """
         Signs the random nonce, called when customer tries to perform
@@ -62,6 +69,7 @@ class Card(Psoc):
 
         return signature
 
+    @tracing.traced('card.request_new_public_key')
     def request_new_public_key(self, new_pin):
         """
         Calculates what the public key would be based on the pin sent
@@ -108,15 +116,12 @@ class Card(Psoc):
 
         return True
 
-import string
-import random
-def random_generator(size=32, chars=string.ascii_uppercase + string.digits):                           
-    return ''.join(random.choice(chars) for x in range(size))
-
 class DummyCard(Card):
-
     """Emulated ATM card for testing
 
+    Talks the card's byte protocol to a CardEmulator, which signs with the
+    same libhydrogen keys a provisioned card would derive
+
     Arguments:
         verbose (bool, optional): Whether to print debug messages
         provision (bool, optional): Whether to start the ATM card ready
@@ -125,77 +130,8 @@ class DummyCard(Card):
     def __init__(self, verbose=False, provision=False):
         ser = CardEmulator(verbose=verbose, provision=provision)
         super(DummyCard, self).__init__(ser, verbose)
-    
-    
-    def get_card_id(self,transaction):
-        """Checks the card balance
-
-        Returns:
-            str: UUID of ATM card on success
-        """
-        return "CARD_0001"
-
-    
-    def sign_nonce(self,transaction, nonce, pin):
-        """Signs the random nonce, called when customer tries to perform
-        an actoin of the account associated with the connected ATM card
-
-        Args:
-            nonce (str): Random nonce
-            pin (str): Challenge PIN
-            transaction (int): Transaction ID
-        Returns 
-            str: Signed nonce
-        """
-
-        packed = struct.pack('b32s8s',transaction,nonce,pin)
-        signed_nonce = struct.pack('b32s',0,random_generator()) 
-
-        return struct.unpack('b32s',signed_nonce)[1]
-
-        """Calculates what the public key would be based on the pin sent
-
-        Args:
-            transaction(int): Transaction ID
-            new_pin: theoretical new pin
-        Returns
-            str: New Public Key
-        """
-    def request_new_public_key(self,transaction,new_pin):
-        packed = struct.pack('b8s',transaction,new_pin)
-        public_key = struct.pack('b32s',0,random_generator())
-        return struct.unpack('b32s',public_key)
-
-    def provision(self, uuid, pin):
-        """Attempts to provision a new ATM card
-
-        Args:
-            uuid (str): New UUID for ATM card
-            pin (str): Initial PIN for ATM card
-
-        Returns:
-            bool: True if provisioning succeeded, False otherwise
-        """
-
-        self._sync(True)
-
-        msg = self._pull_msg()
-        if msg != 'P':
-            self._vp('Card alredy provisioned!', logging.error)
-            return False
-        self._vp('Card sent provisioning message')
-
-        self._push_msg('%s\00' % pin)
-        while self._pull_msg() != 'K':
-            self._vp('Card hasn\'t accepted PIN', logging.error)
-        self._vp('Card accepted PIN')
-
-        self._push_msg('%s\00' % uuid)
-        while self._pull_msg() != 'K':
-            self._vp('Card hasn\'t accepted uuid', logging.error)
-        self._vp('Card accepted uuid')
-
-        self._vp('Provisioning complete')
-
-        return True
 
+    def initialize(self):
+        super(DummyCard, self).initialize()
+        # complete the boot sync, as Psoc.open() does for real cards
+        self.identify()
@@ -1,8 +1,10 @@
 from psoc import Psoc
+from .. import tracing
 import struct
 from serial_emulator import HSMEmulator
 import logging
 import time
+import threading
 from binascii import hexlify
 
 class HSM(Psoc):
@@ -12,24 +14,28 @@ class HSM(Psoc):
     Args:
         port (str, optional): Serial port connected to HSM
         verbose (bool, optional): Whether to logging.info( debug messages
+        record (str, optional): Directory to record serial sessions into
 
     Note:
         Calls to get_uuid and withdraw must be alternated to remain in sync
         with the HSM
     """
 
-    def __init__(self, port=None, verbose=False, dummy=False):
+    def __init__(self, port=None, verbose=False, dummy=False, record=None):
         self.port = port
         self.verbose = verbose
         self.dummy = dummy
+        self.record = record
+        self.transaction_lock = threading.Lock()
         
     def initialize(self):
-        super(HSM, self).__init__('HSM', self.port, self.verbose)
+        super(HSM, self).__init__('HSM', self.port, self.verbose, self.record)
         self._vp('Please connect HSM to continue.')
         while not self.connected and not self.dummy:
             time.sleep(2)
         self._vp('Initialized')
 
+    @tracing.traced('hsm.get_nonce')
     def get_nonce(self):   
         '''
         Has the hsm generate a random nonce and store it in the cash.
@@ -50,6 +56,7 @@ class HSM(Psoc):
         return nonce
         
 
+    @tracing.traced('hsm.get_uuid')
     def get_uuid(self):
         """
         Retrieves the UUID from the HSM
@@ -66,6 +73,7 @@ class HSM(Psoc):
             return None
         return uuid
 
+    @tracing.traced('hsm.handle_balance_check')
     def handle_balance_check(self, ciphertext):
         self._sync(False)
         self._push_msg(struct.pack('b', self.REQUEST_BALANCE))
@@ -79,6 +87,7 @@ class HSM(Psoc):
         return balance
 
 
+    @tracing.traced('hsm.handle_withdrawal')
     def handle_withdrawal(self, ciphertext):
         self._sync(False)
 
@@ -91,11 +100,9 @@ class HSM(Psoc):
 
         bill_count = ord(self.read(1))
 
-        bills = []
-        for i in range(bill_count):
-            bills += [self.read(16)]
-
-        return bills
+        # pull every bill in one bulk read instead of one locked read per bill
+        bills = self.read_frame(bill_count, 16)
+        return [bill.tobytes() for bill in bills]
 
 
     def provision(self, hsm_key, rand_key, uuid, bills):
@@ -143,14 +150,12 @@ class HSM(Psoc):
 
 ##############################################################
 
-import string
-import random
-def random_generator(size=32, chars=string.ascii_uppercase + string.digits):
-    return ''.join(random.choice(chars) for x in range(size))
-
 class DummyHSM(HSM):
     """Emulated HSM for testing
 
+    Talks the HSM's byte protocol to an HSMEmulator, which checks the bank's
+    secretbox ciphertexts like a provisioned HSM would
+
     Arguments:
         verbose (bool, optional): Whether to logging.info( debug messages
         provision (bool, optional): Whether to start the HSM ready
@@ -159,58 +164,8 @@ class DummyHSM(HSM):
     def __init__(self, verbose=False, provision=False):
         ser = HSMEmulator(verbose=verbose, provision=provision)
         super(DummyHSM, self).__init__(port=ser, verbose=verbose, dummy=True)
- 
-    '''Has the hsm generate a random nonce and store it in the cash.
-    Server needs to sign this nonce to proove that it is a valid request
-
-    Args:
-    transaction(int): The transaction type. Lets the hsm know what is happening
-
-    Returns:
-    a randomly generated nonce that is encrypted with a shared secret key that corosponds to 
-    the hsm_id
-
-    '''
-    def get_nonce(self):
-        return random_generator()
-        
-
-    def get_uuid(self):
-        """Retrieves the UUID from the HSM
-        Args:
-            transaction(int): The transaction type. Lets the hsm know what is happening
-
-        Returns:
-            str: UUID of HSM
-        """
-        return random_generator(36)
-
-    '''
-    Verifies the nonce was correctly signed and completes the transactions request
-
-    Args:
-        transaction(int): The transaction type. Lets the hsm know what is happening
-        encrypted_data(str): contains the data that the hsm will use for its transaction
-    Returns:
-        var: Can either be an array of bills or a balance.
-    '''
-    def send_action(self, transaction, encrypted_data):
-        packed = (struct.pack('b',transaction)+encrypted_data)
-        responseAction = self.REQUEST_BALANCE if transaction == 0x0A else self.RETURN_WITHDRAWAL
-        if responseAction == self.REQUEST_BALANCE: #handles case depending on byte
-            acceptByte = self.ACCEPTED
-            if acceptByte==self.ACCEPTED:
-                balance = 5000 
-                return balance #reveals acount balance to atm
-            elif acceptByte==self.REJECTED:
-                raise Exception('HSM Rejected request')
-            else:
-                raise ValueError('Unexpected Byte read from hsm (expected ACCEPT or REJECT byte) got: ' + str(acceptByte))
-        elif responseAction == self.RETURN_WITHDRAWAL:
-            numBills = 3 #number of bills to pull
-            bills = ['chets $$$$$$ bill 1', 'chets $$$$$$$ 2', 'chesttess $$$$$$$3' ] #array of bills
-            return bills
-        else:
-            raise ValueError('Unexpected Byte read from hsm (expected Withdrawal or Check Balance byte ) got: ' + str(responseAction))
-
 
+    def initialize(self):
+        super(DummyHSM, self).initialize()
+        # complete the boot sync, as Psoc.open() does for real HSMs
+        self.identify()
@@ -5,8 +5,13 @@ import threading
 import serial
 import sys
 import os
+import functools
 
 from binascii import hexlify
+from contextlib import contextmanager
+from serial_reader import SerialReader, ReadTimeout
+from serial_capture import SerialRecorder
+from .. import tracing
 from serial.tools.list_ports import comports as list_ports
 
 
@@ -22,6 +27,45 @@ class AlreadyProvisioned(Exception):
     pass
 
 
+@contextmanager
+def transaction(*devices):
+    """
+    Holds the transaction locks of devices for the length of a transaction,
+    so at most one transaction drives a device at a time. Status queries do
+    not take these locks and are answered while a transaction runs.
+
+    Args:
+        *devices (Card or HSM): Devices used by the transaction
+    """
+    # a fixed acquisition order keeps transactions over overlapping
+    # device sets from deadlocking
+    locks = [d.transaction_lock for d in sorted(devices, key=id)]
+    for lock in locks:
+        lock.acquire()
+    try:
+        yield
+    finally:
+        for lock in reversed(locks):
+            lock.release()
+
+
+def holds(*names):
+    """
+    Decorator running a method inside transaction() on the named device
+    attributes of self
+
+    Args:
+        *names (str): Attribute names of the devices, e.g. 'hsm', 'card'
+    """
+    def decorator(func):
+        @functools.wraps(func)
+        def wrapper(self, *args, **kwargs):
+            with transaction(*[getattr(self, name) for name in names]):
+                return func(self, *args, **kwargs)
+        return wrapper
+    return decorator
+
+
 class Psoc(object):
     """
     Generic PSoC communication interface
@@ -31,15 +75,21 @@ class Psoc(object):
         ser (serial.Serial or serial emulator): Serial interface for
             communication
         verbose (bool): Controls printing of debug messages
+        record (str, optional): Directory to record serial sessions into
     """
 
-    def __init__(self, name, ser, verbose):
+    def __init__(self, name, ser, verbose, record=None):
         log = sys.stdout if verbose else open(os.devnull, 'w')
         logging.basicConfig(stream=log, level=logging.DEBUG)
+        self.name = name
+        self.record = record
+        if ser:
+            ser = self._capture(ser)
         self.ser = ser
+        self.reader = SerialReader(ser)
+        self.write_delay = getattr(ser, 'write_delay', 0.1)
         self.verbose = verbose
         self.fmt = '%s: %%s' % name
-        self.name = name
         self.lock = threading.Lock()
         self.connected = False
         self.port = ''
@@ -87,6 +137,8 @@ class Psoc(object):
         self.sync_name_p = '%s_P' % name
 
 
+        # Devices handed a fixed port are never reattached to other ports
+        self.dynamic = not ser
         if ser:
             self.connected = True
         else:
@@ -103,6 +155,22 @@ class Psoc(object):
         if self.verbose:
             stream(self.fmt % msg)
 
+    def _capture(self, ser):
+        """
+        Wraps a serial port in a SerialRecorder if recording is enabled
+
+        Args:
+            ser (serial.Serial or serial emulator): Serial interface
+
+        Returns:
+            The serial interface to use for communication
+        """
+        if not self.record:
+            return ser
+        path = '%s/%s-%s.cap' % (self.record, self.name.lower(),
+                                 time.strftime('%Y%m%d-%H%M%S'))
+        return SerialRecorder(ser, path)
+
     def _push_msg(self, msg):
         """
         Sends formatted message to PSoC
@@ -113,15 +181,22 @@ class Psoc(object):
         #pkt = struct.pack("B%ds" % (len(msg)), len(msg), msg)
         pkt = struct.pack("%ds" % len(msg), msg)
         self.write(pkt)
-        time.sleep(0.1)
+        time.sleep(self.write_delay)
 
-    def _sync_once(self,request,accept,wrong_states):
+    def _sync_once(self,request,accept,wrong_states,timeout=None):
         resp = ''
+        deadline = None if timeout is None else time.time() + timeout
 
         while resp not in accept:
             self._push_msg(chr(request))
 
-            resp = self.read(size=1)
+            if deadline is None:
+                resp = self.read(size=1)
+            else:
+                try:
+                    resp = self.read(size=1, timeout=max(deadline - time.time(), 0))
+                except ReadTimeout:
+                    return None
             if resp == "":
                 continue
             resp = ord(resp)
@@ -146,31 +221,44 @@ class Psoc(object):
             NotProvisioned if PSoC is unexpectedly unprovisioned
             AlreadyProvisioned if PSoC is unexpectedly already provisioned
         """
-        if provision:
-            if not self._sync_once(self.SYNC_REQUEST_PROV,
-                [self.SYNC_CONFIRMED_NO_PROV],
-                [self.SYNC_CONFIRMED_PROV,
-                self.SYNC_FAILED_NO_PROV,
-                self.SYNC_FAILED_PROV]):
-
-                self._vp("Already provisioned!", logging.error)
-                raise AlreadyProvisioned
-        else:
-            if not self._sync_once(self.SYNC_REQUEST_NO_PROV,
-                [self.SYNC_CONFIRMED_PROV],
-                [self.SYNC_CONFIRMED_NO_PROV,
-                self.SYNC_FAILED_NO_PROV,
-                self.SYNC_FAILED_PROV]):
-
-                self._vp("Not yet provisioned!", logging.error)
-                raise NotProvisioned
+        with tracing.span('psoc.sync', device=self.name):
+            if provision:
+                if not self._sync_once(self.SYNC_REQUEST_PROV,
+                    [self.SYNC_CONFIRMED_NO_PROV],
+                    [self.SYNC_CONFIRMED_PROV,
+                    self.SYNC_FAILED_NO_PROV,
+                    self.SYNC_FAILED_PROV]):
+
+                    self._vp("Already provisioned!", logging.error)
+                    raise AlreadyProvisioned
+            else:
+                if not self._sync_once(self.SYNC_REQUEST_NO_PROV,
+                    [self.SYNC_CONFIRMED_PROV],
+                    [self.SYNC_CONFIRMED_NO_PROV,
+                    self.SYNC_FAILED_NO_PROV,
+                    self.SYNC_FAILED_PROV]):
+
+                    self._vp("Not yet provisioned!", logging.error)
+                    raise NotProvisioned
 
         #self._push_msg(struct.pack("1s", chr(self.SYNCED)))
 
-    def open(self):
-        time.sleep(.1)
-        self.ser = serial.Serial(self.port, baudrate=self.baudrate, timeout=1)
-        resp = self._sync_once(self.PSOC_DEVICE_REQUEST,[self.SYNC_TYPE_HSM_P, self.SYNC_TYPE_HSM_N, self.SYNC_TYPE_CARD_P, self.SYNC_TYPE_CARD_N],[])
+    def identify(self, timeout=None):
+        """
+        Asks the connected PSoC what kind of device it is
+
+        Args:
+            timeout (float, optional): Seconds to wait for an answer. Default
+                is to wait until the device answers
+
+        Returns:
+            str: 'HSM_P', 'HSM_N', 'CARD_P' or 'CARD_N' (_P while still
+                 unprovisioned), 'Error' otherwise, None if the device did
+                 not answer within timeout
+        """
+        resp = self._sync_once(self.PSOC_DEVICE_REQUEST,[self.SYNC_TYPE_HSM_P, self.SYNC_TYPE_HSM_N, self.SYNC_TYPE_CARD_P, self.SYNC_TYPE_CARD_N],[],timeout)
+        if resp is None:
+            return None
         resp_f = "Error"
         if resp == self.SYNC_TYPE_HSM_P:
             resp_f = "HSM_P"
@@ -180,6 +268,13 @@ class Psoc(object):
             resp_f = "CARD_P"
         elif resp == self.SYNC_TYPE_CARD_N:
             resp_f = "CARD_N"
+        return resp_f
+
+    def open(self):
+        time.sleep(.1)
+        self.ser = self._capture(serial.Serial(self.port, baudrate=self.baudrate, timeout=1))
+        self.reader.attach(self.ser)
+        resp_f = self.identify()
 
         if resp_f == self.sync_name_p or resp_f == self.sync_name_n:
             logging.info('DYNAMIC SERIAL: Connected to %s', resp_f)
@@ -187,7 +282,7 @@ class Psoc(object):
         else:
             logging.info('DYNAMIC SERIAL: Expected %s or %s', self.sync_name_p,
                                                               self.sync_name_n)
-            logging.info('DYNAMIC SERIAL: Disconnecting from %s', resp)
+            logging.info('DYNAMIC SERIAL: Disconnecting from %s', resp_f)
             self.start_connect_watcher()
 
     def device_connect_watch(self):
@@ -228,34 +323,82 @@ class Psoc(object):
         self.lock.release()
         self.start_connect_watcher()
 
-    def read(self, size=1):
+    @contextmanager
+    def _serial_io(self):
+        """
+        Holds the device lock for one read or write and turns serial errors
+        into DeviceRemoved
+
+        Raises:
+            DeviceRemoved: If the Device was removed before or during the I/O
+        """
+        with self.lock:
+            try:
+                yield
+                return
+            except serial.SerialException:
+                self.connected = False
+                self.ser.close()
+        if self.dynamic:
+            self.start_connect_watcher()
+        raise DeviceRemoved
+
+    def read(self, size=1, timeout=None):
         """
         Reads bytes from the connected serial device
 
         Args:
             size (int, optional): The number of bytes to read from the serial
                 device. Defaults to reading one byte.
+            timeout (float, optional): Seconds to wait for them. Default is
+                to wait until they arrive
 
         Returns:
             str: Buffer of bytes read from device
 
         Raises:
             DeviceRemoved: If the Device was removed before or during read
+            ReadTimeout: If timeout passed before size bytes arrived
         """
-        try:
-            self.lock.acquire()
-            res = ""
-            while len(res) != size:
-                res += self.ser.read(size=size - len(res))
-            
-            self.lock.release()
-            return res
-        except serial.SerialException:
-            self.connected = False
-            self.ser.close()
-            self.lock.release()
-            self.start_connect_watcher()
-            raise DeviceRemoved
+        return self.read_exact(size, timeout).tobytes()
+
+    def read_exact(self, size, timeout=None):
+        """
+        Reads exactly size bytes into the read ring without copying them out
+
+        Args:
+            size (int): The number of bytes to read from the serial device
+            timeout (float, optional): Seconds to wait for them. Default is
+                to wait until they arrive
+
+        Returns:
+            memoryview: View of the bytes read, valid until the ring wraps
+
+        Raises:
+            DeviceRemoved: If the Device was removed before or during read
+            ReadTimeout: If timeout passed before size bytes arrived
+        """
+        with tracing.span('psoc.read', device=self.name, size=size):
+            with self._serial_io():
+                return self.reader.read_exact(size, timeout)
+
+    def read_frame(self, count, size):
+        """
+        Reads count frames of size bytes with one bulk read under one lock
+
+        Args:
+            count (int): The number of frames to read
+            size (int): The size of each frame in bytes
+
+        Returns:
+            list of memoryview: One view per frame, valid until the ring wraps
+
+        Raises:
+            DeviceRemoved: If the Device was removed before or during read
+        """
+        with tracing.span('psoc.read', device=self.name, size=count * size):
+            with self._serial_io():
+                return self.reader.read_frame(count, size)
 
     def write(self, data):
         """
@@ -267,18 +410,9 @@ class Psoc(object):
         Raises:
             DeviceRemoved: If the Device was removed before or during write
         """
-        try:
-            self.lock.acquire()
-            res = self.ser.write(data)
-
-            self.lock.release()
-            return res
-        except serial.SerialException:
-            self.connected = False
-            self.ser.close()
-            self.lock.release()
-            self.start_connect_watcher()
-            raise DeviceRemoved
+        with tracing.span('psoc.write', device=self.name, size=len(data)):
+            with self._serial_io():
+                return self.ser.write(data)
 
     def start_connect_watcher(self):
         logging.info("DYNAMIC SERIAL: Closed serial and spun off %s-connect-watcher thread", self.name)
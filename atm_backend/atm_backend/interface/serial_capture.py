@@ -0,0 +1,203 @@
+"""Record and replay of PSoC serial sessions
+
+A capture file holds the byte stream of one device session:
+
+    header:  8B magic 'ATMCAP1\\n' | 8B start time (double, epoch seconds)
+    record:  1B direction ('R' or 'W') | 4B delta (us) | 2B length
+             | length B data
+
+For reads the delta is the time the host spent blocked waiting for the data,
+i.e. device time. For writes it is the time since the previous record.
+
+SerialRecorder wraps a live serial port and appends a record for every read
+and write. SerialReplay stands in for the serial port and feeds the recorded
+reads back, either with the original device delays or with none at all, so
+the ATM and provisioning code can be run and profiled without hardware.
+"""
+
+import struct
+import time
+import logging
+
+MAGIC = 'ATMCAP1\n'
+HEADER = struct.Struct('<8sd')
+RECORD = struct.Struct('<cIH')
+MAX_DELTA_US = 0xFFFFFFFF
+
+
+class SerialRecorder(object):
+    """
+    Serial port wrapper that records every read and write to a capture file
+
+    Args:
+        ser (serial.Serial): Serial port to wrap
+        path (str): Capture file to create
+    """
+
+    def __init__(self, ser, path):
+        self.ser = ser
+        # unbuffered, so a session that crashes or is killed still leaves
+        # every record up to that point on disk
+        self.out = open(path, 'wb', 0)
+        self.last = time.time()
+        self.waited = 0.0
+        self.out.write(HEADER.pack(MAGIC, self.last))
+        logging.info('Recording serial session to %s' % path)
+
+    def _record(self, direction, delta, data):
+        delta = min(int(delta * 1000000), MAX_DELTA_US)
+        # one write per record, so the file never ends between a header and its data
+        self.out.write(RECORD.pack(direction, delta, len(data)) + data)
+
+    def _record_read(self, start, data):
+        # reads that time out empty still count as time spent on the device
+        self.last = time.time()
+        self.waited += self.last - start
+        if data:
+            self._record('R', self.waited, data)
+            self.waited = 0.0
+
+    def read(self, size=1):
+        start = time.time()
+        data = self.ser.read(size)
+        self._record_read(start, data)
+        return data
+
+    def readinto(self, b):
+        start = time.time()
+        n = self.ser.readinto(b)
+        self._record_read(start, b[:n].tobytes())
+        return n
+
+    def write(self, data):
+        res = self.ser.write(data)
+        now = time.time()
+        self._record('W', now - self.last, data)
+        self.last = now
+        return res
+
+    def close(self):
+        self.out.close()
+        self.ser.close()
+
+    def __getattr__(self, name):
+        return getattr(self.ser, name)
+
+
+def load_capture(path):
+    """
+    Reads a capture file
+
+    Args:
+        path (str): Capture file written by SerialRecorder
+
+    Returns:
+        list of (str, float, str): (direction, delay in seconds, data)
+    """
+    with open(path, 'rb') as f:
+        blob = f.read()
+    magic, _ = HEADER.unpack_from(blob, 0)
+    if magic != MAGIC:
+        raise ValueError('%s is not a serial capture' % path)
+
+    records = []
+    pos = HEADER.size
+    while pos + RECORD.size <= len(blob):
+        direction, delta, length = RECORD.unpack_from(blob, pos)
+        pos += RECORD.size
+        if pos + length > len(blob):
+            logging.warning('%s ends in a cut off record' % path)
+            break
+        records.append((direction, delta / 1000000.0, blob[pos:pos + length]))
+        pos += length
+    return records
+
+
+class SerialReplay(object):
+    """
+    Serial port stand-in that plays back a capture file
+
+    Args:
+        path (str): Capture file written by SerialRecorder
+        realtime (bool, optional): Reproduce the recorded device response
+            delays. Default replays at full speed
+        loop (bool, optional): Rewind at the end of the capture so a session
+            can be replayed repeatedly for benchmarking. Otherwise reading
+            past the end of the capture raises EOFError
+
+    Note:
+        Writes are matched against the recorded writes only to stay aligned
+        with the capture; their contents are not checked since nonces and
+        ciphertexts from the bank differ on every run.
+    """
+
+    def __init__(self, path, realtime=False, loop=False):
+        self.path = path
+        self.records = load_capture(path)
+        self.realtime = realtime
+        self.loop = loop
+        self.write_delay = 0.1 if realtime else 0
+        self.device_time = 0.0
+        self.rewind()
+
+    def rewind(self):
+        self.idx = 0
+        self.pending = ''
+
+    def _next_read(self):
+        """Returns the next recorded read, skipping writes the host did not
+        repeat (e.g. extra sync attempts during the recording), or None at
+        the end of the capture"""
+        rewound = False
+        while True:
+            if self.idx == len(self.records):
+                # a capture without reads would otherwise be rewound forever
+                if not self.loop or rewound:
+                    return None
+                # keep the pending output of the read this one continues
+                self.idx = 0
+                rewound = True
+            record = self.records[self.idx]
+            self.idx += 1
+            if record[0] == 'R':
+                return record
+
+    def read(self, size=1):
+        """
+        Returns the next size bytes of recorded device output, or what is
+        left of it at the end of the capture
+
+        Raises:
+            EOFError: If the capture has no output left. A real port would
+                time out and return nothing, and the host would retry forever
+        """
+        while len(self.pending) < size:
+            record = self._next_read()
+            if record is None:
+                if not self.pending and size:
+                    raise EOFError('end of capture %s' % self.path)
+                break
+            _, delay, data = record
+            self.device_time += delay
+            if self.realtime:
+                time.sleep(delay)
+            self.pending += data
+        data, self.pending = self.pending[:size], self.pending[size:]
+        return data
+
+    def readinto(self, b):
+        data = self.read(len(b))
+        b[:len(data)] = data
+        return len(data)
+
+    def write(self, data):
+        # stay aligned with the capture, but never skip unread device output
+        if self.idx < len(self.records) and self.records[self.idx][0] == 'W':
+            self.idx += 1
+        return len(data)
+
+    def isOpen(self):
+        return True
+
+    def close(self):
+        pass
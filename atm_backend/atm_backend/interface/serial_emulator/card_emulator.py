@@ -1,5 +1,5 @@
-from serial_emulator import SerialEmulator
-import logging
+from serial_emulator import SerialEmulator, crypto
+import os
 
 
 class CardEmulator(SerialEmulator):
@@ -9,92 +9,81 @@ class CardEmulator(SerialEmulator):
         provision (bool, optional): Whether to start the ATM card in
             provisioning mode. Default skips provisioning
         verbose (bool, optional): Whether to print debugging information
+        r (str, optional): 32 byte key the card derives its keypair from
+            when already provisioned. Default is random
+        uuid (str, optional): 36 byte card id when already provisioned
+
+    Note:
+        Mirrors CARD.cydsn/main.c. The keypair is rederived from r and the
+        PIN on every request, as generate_keys() does, so every signature
+        costs what it costs on the card.
     """
 
-    def __init__(self, provision=False, verbose=False):
-        super(CardEmulator, self).__init__(provision, verbose)
-
-        self.name = "CARD EMULATOR"
-        self.sync_resp_n = "CARD_N"
-        self.sync_resp_p = "CARD_P"
-        self.prov_dest = self._get_pin
-        self.sync_dest = self._check_pin
-
-        if provision:
-            self.pin = ''
-            self.uuid = ''
-            self._vp('Initialized for provisioning')
-        else:
-            self.pin = '12345678'
-            self.uuid = '0123456789abcdef'
-            self._vp('Initialized for normal operation')
-
-    def _get_pin(self):
-        """Receives and sets the PIN during provisioning
-
-        Returns:
-            str: Packet header of the okay message
-        """
-        self.pin = self._next_msg()
-        self._vp('Received pin \'%s\'' % self.pin)
-        return self._return_message("K", self._get_uuid)
-
-    def _get_uuid(self):
-        """Receives and sets the UUID of the card during provisioning
-
-        Returns:
-            str: Packet header of the okay message
-        """
-        self.uuid = self._next_msg()
-        self._vp('Received UUID \'%s\'' % self.uuid)
-        self.provision = False
-        return self._return_message("K", self._sync)
-
-    def _check_pin(self):
-        """Check sent pin against stored pin
-
-        Returns:
-            str: Packet header of either PIN okay or bad message
-        """
-
-        if not self._sync_complete():
-            return ''
-
-        msg = self._next_msg()
-        if msg != self.pin:
-            self._vp('ERROR: Got bad PIN (wanted \'%s\' got \'%s\''
-                     % (self.pin, msg), logging.error)
-            return self._return_message('BAD', self._sync)
-
-        self._vp('Got correct PIN')
-        return self._return_message('OK', self._get_command)
-
-    def _get_command(self):
-        """Receives the ATM command
-
-        Returns:
-            str: Packet header of the okay message
-        """
-        command = self._next_msg()
+    PIN_LEN = 8
+    R_LEN = 32
 
-        if command == '3':
-            return self._return_message('K', self._change_pin)
-        return self._return_message('K', self._send_uuid)
+    REQUEST_NAME            = 0x00
+    RETURN_NAME             = 0x01
+    REQUEST_CARD_SIGNATURE  = 0x02
+    RETURN_CARD_SIGNATURE   = 0x03
+    REQUEST_NEW_PK          = 0x0C
+    RETURN_NEW_PK           = 0x0D
+    SYNC_TYPE_P             = 0x3D
+    SYNC_TYPE_N             = 0x1D
 
-    def _send_uuid(self):
-        """Send ATM card UUID
+    def __init__(self, provision=False, verbose=False, r=None, uuid=None):
+        super(CardEmulator, self).__init__(provision, verbose)
+        self.name = "CARD EMULATOR"
 
-        Returns:
-            str: Packet header of the UUID message
-        """
-        self._vp('Sending UUID \'%s\'' % self.uuid)
-        return self._return_message(self.uuid, self._sync)
+        self.r = '\x00' * self.R_LEN
+        self.rand_key = '\x00' * self.RAND_KEY_LEN
+        self.uuid = '\x00' * self.UUID_LEN
+        if not provision:
+            self.r = r or os.urandom(self.R_LEN)
+            self.uuid = (uuid or '0123456789abcdef').ljust(self.UUID_LEN, '\x00')
+            self._vp('Initialized for normal operation')
+        else:
+            self._vp('Initialized for provisioning')
+        self.start()
 
-    def _change_pin(self):
-        """Change stored pin to sent pin
+    def generate_keys(self, pin):
+        """Derives the card keypair for pin from r
 
         Returns:
-            str: Packet header of the success message
+            (str, str): Public and secret key
         """
-        self.pin = self._next_msg()
-        return self._return_message("SUCCESS", self._sync)
+        seed = crypto.hash(pin, self.CONTEXT, self.r)
+        return crypto.sign_keygen_deterministic(seed)
+
+    def _provision(self):
+        self._sync(True)
+
+        if self._pull_byte() != self.REQUEST_PROVISION:
+            self._push_byte(self.REJECTED)
+            return
+
+        self.r = self._pull(self.R_LEN)
+        self.rand_key = self._pull(self.RAND_KEY_LEN)
+        self.uuid = self._pull(self.UUID_LEN)
+        self._vp('Received UUID \'%s\'' % self.uuid.rstrip('\x00'))
+
+        self._push_byte(self.ACCEPTED)
+
+    def _handle(self, message_type):
+        if message_type == self.REQUEST_NAME:
+            self._push_byte(self.RETURN_NAME)
+            self._push(self.uuid)
+
+        elif message_type == self.REQUEST_CARD_SIGNATURE:
+            nonce = self._pull(self.NONCE_LEN)
+            pin = self._pull(self.PIN_LEN)
+            sk = self.generate_keys(pin)[1]
+            signature = crypto.sign_create(nonce, self.CONTEXT, sk)
+            self._vp('Signed nonce')
+            self._push_byte(self.RETURN_CARD_SIGNATURE)
+            self._push(signature)
+
+        elif message_type == self.REQUEST_NEW_PK:
+            pin = self._pull(self.PIN_LEN)
+            self._push_byte(self.RETURN_NEW_PK)
+            self._push(self.generate_keys(pin)[0])
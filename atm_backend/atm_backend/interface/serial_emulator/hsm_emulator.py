@@ -1,7 +1,6 @@
+from serial_emulator import SerialEmulator, crypto
+import os
 import struct
-from Queue import Queue
-from serial_emulator import SerialEmulator
-import logging
 
 
 class HSMEmulator(SerialEmulator):
@@ -11,117 +10,141 @@ class HSMEmulator(SerialEmulator):
         provision (bool, optional): Whether to start the HSM in
             provisioning mode. Default skips provisioning
         verbose (bool, optional): Whether to print debugging information
+        hsm_key (str, optional): 32 byte secretbox key shared with the bank
+            when already provisioned. Default is random
+        uuid (str, optional): 36 byte HSM id when already provisioned
+        bills (list of str, optional): Bills loaded when already provisioned
+
+    Note:
+        Mirrors SECURITY_MODULE.cydsn/main.c, including checking the bank's
+        secretbox ciphertexts against the current nonce and refreshing the
+        nonce after every accepted request.
     """
 
-    def __init__(self, provision=False, verbose=False):
+    HSM_KEY_LEN = 32
+    BILL_LEN = 16
+    BALANCE_LEN = 4
+    MAX_BILLS = 128
+    CHECK_BALANCE_CIPHERTEXT_LEN = 73
+    WITHDRAW_CIPHERTEXT_LEN = 70
+
+    NONCE_REQUEST           = 0x04
+    NONCE_RESPONSE          = 0x05
+    UUID_REQUEST            = 0x06
+    UUID_RESPONSE           = 0x07
+    WITHDRAWAL_REQUEST      = 0x08
+    RETURN_WITHDRAWAL       = 0x09
+    REQUEST_BALANCE         = 0x0A
+    RETURN_BALANCE          = 0x0B
+    INITIATE_BILLS_REQUEST  = 0x27
+    BILLS_REQUEST           = 0x28
+    BILL_RECEIVED           = 0x29
+    SYNC_TYPE_P             = 0x3C
+    SYNC_TYPE_N             = 0x1C
+
+    def __init__(self, provision=False, verbose=False, hsm_key=None, uuid=None, bills=None):
         super(HSMEmulator, self).__init__(provision, verbose)
-        self.bills = Queue()
-
         self.name = "HSM EMULATOR"
-        self.sync_resp_n = "HSM_N"
-        self.sync_resp_p = "HSM_P"
-        self.prov_dest = self._get_uuid
-        self.sync_dest = self._send_uuid
-        self.to_dispense = -1
-
-        if provision:
-            self.uuid = ""
-            self.bill_count = 0
-            self._vp('Initialized for provisioning')
-        else:
-            self.uuid = "beefcafebeefcafe"
-            self.bill_count = 128
-            for n in range(128):
-                self.bills.put('Example Bill %d' % n)
-            self._vp('Initialized for normal operation')
-
-    def _get_uuid(self):
-        """Receives and sets the UUID of the HSM during provisioning
-
-        Returns:
-            str: Packet header of the okay message
-        """
-        self.uuid = self._next_msg()
-        self._vp('Received UUID \'%s\'' % self.uuid)
-        return self._return_message('K', self._get_numbills)
-
-    def _get_numbills(self):
-        """Receives and sets the number of bills on the HSM
-
-        Returns:
-            str: Packet header of the okay message
-        """
-        self.bill_count = struct.unpack('B', self._next_msg())[0]
-        self.bills_left = self.bill_count
-        self._vp('Received numbills \'%s\'' % self.bill_count)
-        return self._return_message('K', self._load_bill)
 
-    def _load_bill(self):
-        """Receives and adds a single bill to the HSM
-
-        Returns:
-            str: Packet header of the okay message
-        """
-        bill = self._next_msg()
-        self.bills.put(bill)
-        self._vp('Loaded bill \'%s\'' % bill)
-
-        self.bill_count -= 1
-        if self.bill_count == 0:
-            self.provision = False
-            self._vp('Provisioning done!')
-            return self._return_message('K', self._sync)
+        self.hsm_key = '\x00' * self.HSM_KEY_LEN
+        self.rand_key = '\x00' * self.RAND_KEY_LEN
+        self.uuid = '\x00' * self.UUID_LEN
+        self.nonce = '\x00' * self.NONCE_LEN
+        # bills are dispensed from the end, as MONEY[bills_left - 1] is
+        self.bills = []
+        if not provision:
+            self.hsm_key = hsm_key or os.urandom(self.HSM_KEY_LEN)
+            self.uuid = (uuid or 'beefcafebeefcafe').ljust(self.UUID_LEN, '\x00')
+            if bills is None:
+                bills = ['Example Bill %d' % n for n in range(self.MAX_BILLS)]
+            self.bills = [bill[:self.BILL_LEN].ljust(self.BILL_LEN, '\x00') for bill in reversed(bills)]
+            self._vp('Initialized for normal operation')
+        else:
+            self._vp('Initialized for provisioning')
+        self.start()
 
-        return self._return_message('K', self._load_bill)
+    def _generate_nonce(self):
+        self.nonce = os.urandom(self.NONCE_LEN)
+        return self.nonce
 
-    def _send_uuid(self):
-        """Send HSM UUID
+    def _provision(self):
+        self._sync(True)
 
-        Returns:
-            str: Packet header of the UUID message
-        """
-        if not self._sync_complete():
-            return ''
+        if self._pull_byte() != self.REQUEST_PROVISION:
+            self._push_byte(self.REJECTED)
+            return
 
-        self._vp('Sending UUID %s' % self.uuid)
-        return self._return_message(self.uuid, self._check_uuid)
+        self.hsm_key = self._pull(self.HSM_KEY_LEN)
+        self._push_byte(self.ACCEPTED)
+        self.rand_key = self._pull(self.RAND_KEY_LEN)
+        self._push_byte(self.ACCEPTED)
+        self.uuid = self._pull(self.UUID_LEN)
+        self._vp('Received UUID \'%s\'' % self.uuid.rstrip('\x00'))
 
-    def _check_uuid(self):
-        """Check sent UUID against stored UUID
+        self._push_byte(self.INITIATE_BILLS_REQUEST)
+        if self._pull_byte() != self.BILLS_REQUEST:
+            self._push_byte(self.REJECTED)
+            return
 
-        Returns:
-            str: Packet header of either UUID okay or bad message
-        """
-        hsmid = self._next_msg()
+        num_bills = self._pull_byte()
+        bills = []
+        for _ in range(num_bills):
+            bills.append(self._pull(self.BILL_LEN))
+            self._push_byte(self.BILL_RECEIVED)
+        self.bills = bills[::-1]
+        self._vp('Loaded %d bills' % num_bills)
 
-        if hsmid != self.uuid:
-            self._vp("ERROR: got bad UUID (wanted \'%s\' got \'%s\'"
-                     % (self.uuid, hsmid), logging.error)
-            return self._return_message('BAD', self._sync)
-        return self._return_message('K', self._dispense_bills)
+        self._push_byte(self.ACCEPTED)
 
-    def _dispense_bills(self):
-        """Dispenses one bill from the HSM storage
+    def _open(self, length, opcode):
+        """Pulls a bank ciphertext and checks it, as the REQUEST_BALANCE and
+        WITHDRAWAL_REQUEST cases do
 
         Returns:
-            str: Packet header of a dispensed bill
+            str: Plaintext after the opcode and nonce, None if rejected
         """
-        if self.to_dispense == 0:
-            self.to_dispense = -1
-            self._vp('Done dispensing bills')
-            return self._sync()
-
-        if self.to_dispense == -1:
-            self.to_dispense = struct.unpack("B", self._next_msg())[0]
-            if self.to_dispense > self.bills_left:
-                self.to_dispense = -1
-                return self._return_message("BAD", self._sync)
-
-            self._vp('Ready to dispense %d bills' % self.to_dispense)
-            return self._return_message('K', self._dispense_bills)
-
-        self.bills_left -= 1
-        self.to_dispense -= 1
-        bill = self.bills.get()
-        self._vp('Dispensing bill \'%s\'' % bill)
-        return self._return_message(bill, self._dispense_bills)
+        ciphertext = self._pull(length)
+        try:
+            plaintext = crypto.secretbox_decrypt(ciphertext, 0, self.CONTEXT, self.hsm_key)
+        except ValueError:
+            self._vp('Rejected forged ciphertext')
+            return None
+        if ord(plaintext[0]) != opcode or plaintext[1:1 + self.NONCE_LEN] != self.nonce:
+            self._vp('Rejected stale or mismatched request')
+            return None
+
+        # reset the nonce to prevent replays
+        self._generate_nonce()
+        return plaintext[1 + self.NONCE_LEN:]
+
+    def _handle(self, message_type):
+        if message_type == self.UUID_REQUEST:
+            self._push_byte(self.UUID_RESPONSE)
+            self._push(self.uuid)
+
+        elif message_type == self.NONCE_REQUEST:
+            self._push_byte(self.NONCE_RESPONSE)
+            self._push(self._generate_nonce())
+
+        elif message_type == self.REQUEST_BALANCE:
+            balance = self._open(self.CHECK_BALANCE_CIPHERTEXT_LEN, self.REQUEST_BALANCE)
+            if balance is None:
+                self._push_byte(self.REJECTED)
+                return
+            self._push_byte(self.RETURN_BALANCE)
+            self._push(balance[:self.BALANCE_LEN])
+
+        elif message_type == self.WITHDRAWAL_REQUEST:
+            amount = self._open(self.WITHDRAW_CIPHERTEXT_LEN, self.WITHDRAWAL_REQUEST)
+            if amount is None:
+                self._push_byte(self.REJECTED)
+                return
+            amount = ord(amount[0])
+            if len(self.bills) < amount:
+                self._push_byte(self.REJECTED)
+                return
+            self._push_byte(self.RETURN_WITHDRAWAL)
+            self._push(struct.pack('B', amount))
+            for _ in range(amount):
+                self._push(self.bills.pop())
+            self._vp('Dispensed %d bills' % amount)
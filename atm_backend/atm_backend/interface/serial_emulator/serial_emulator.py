@@ -1,6 +1,15 @@
-from Queue import Queue
 import logging
-import struct
+import threading
+import time
+
+try:
+    import crypto
+except ImportError:
+    crypto = None
+
+
+class EmulatorClosed(Exception):
+    pass
 
 
 class SerialEmulator(object):
@@ -10,103 +19,113 @@ class SerialEmulator(object):
         provision (bool, optional): Whether to start the PSoC in
             provisioning mode. Default skips provisioning
         verbose (bool, optional): Whether to print debugging information
+        timeout (float, optional): Seconds a read waits for data, like
+            serial.Serial's timeout
 
     Note:
-        Serial emulators work by maintaining the next function to call in self.next_state. Processing is lazy, so while
-        writes add the message to the message queue, self.next_state is only called on reads, as the correct response
-        must be calculated.
-
-        To to return a message, return self._return_message, which returns the 1B message header and will return the
-        message body on the next call.
-
-        To design your own serial emulator, write down the steps the PSoC would go through, and mark every time it sends
-        a message back to the ATM. Every group of steps between send messages becomes a single function.
-
-        Example:
-            HSM steps:
-                A, B, C, send1, D, send2, send3, send4, E, F, send5, goto B or E based on conditional
-            Emulator functions:
-                _func1 (A-C, send1) -> _func2 (D, send2) -> _func3 (send3/4) -> _func4 (E-F, send5)
-
-            Example implementation:
-                def _func1():
-                    # do A
-                    return self._func1B
-
-                def _func1B():
-                    # do B-C
-                    return self._return_msg("message 1", self._func2)
-
-                def _func2():
-                    # do D
-                    return self._return_msg("message 2", self._func3)
-
-                def _func3():
-                    if self.first_call:
-                        self.first_call = False
-                        return self._return_msg("message 3", self._func3)
-
-                    self.first_call = True
-                    return self._return_msg("message 4", self._func4)
-
-                def _func4():
-                    # do E-F
-                    if conditional:
-                        return self._return_msg("message 5", self._func1B)
-                    return self._return_msg("message 5", self._func4)
-
-        If the example code message format is kept (i.e. 1B pkt len | pkt ...), then most of this class from write
-        through the _send_msg_body method can likely be reused. Shared functions like the reference _sync can be put
-        in this class, while card-/HSM-specific functions
+        The emulator runs a port of the PSoC's main.c on its own thread and
+        speaks the same raw byte protocol: writes from the ATM land in a
+        receive buffer that the firmware pulls fixed-size messages from
+        (pullMessage), and bytes the firmware pushes (pushMessage) are handed
+        out by read(). Subclasses implement _provision, mirroring provision()
+        in main.c, and _handle, mirroring one pass of main()'s loop after the
+        sync.
+
+        Like the real devices, the firmware syncs once at boot before
+        provisioning or entering its loop. Dynamically attached devices
+        complete that sync when Psoc.open() identifies them, so the Dummy
+        devices call identify() once after initializing.
+
+        Crypto goes through the bank's crypto extension (libhydrogen), so
+        emulated runs pay the same crypto costs as the PSoCs and the bank
+        can verify what they produce. The atm_backend image builds it from
+        bank_server/wrapper; outside the image build it there and put
+        crypto.so on the path.
     """
 
-    def __init__(self, provision=False, verbose=False):
-        self.provision = provision
+    # usbserialprotocol / common.h constants
+    ACCEPTED                = 0x20
+    REJECTED                = 0x21
+    REQUEST_PROVISION       = 0x26
+    SYNC_REQUEST_PROV       = 0x15
+    SYNC_REQUEST_NO_PROV    = 0x16
+    SYNC_CONFIRMED_PROV     = 0x17
+    SYNC_CONFIRMED_NO_PROV  = 0x18
+    SYNCED                  = 0x1B
+    PSOC_DEVICE_REQUEST     = 0x1E
+
+    CONTEXT = '\x00' * 8
+    UUID_LEN = 36
+    NONCE_LEN = 32
+    RAND_KEY_LEN = 32
+
+    # Subclasses set the device type answered to PSOC_DEVICE_REQUEST
+    SYNC_TYPE_P = None
+    SYNC_TYPE_N = None
+
+    # Psoc sleeps this long after every write to pace real PSoCs
+    write_delay = 0
+
+    def __init__(self, provision=False, verbose=False, timeout=1):
+        if crypto is None:
+            raise ImportError('serial emulators need the crypto extension '
+                              'from bank_server/wrapper on the path')
+        self.provisioned = not provision
         self.verbose = verbose
-        self.msg_q = Queue()
-        self.next_state = self._sync
-        self.msg_body = ''
-        self.msg_body_next = self._sync
-        self.close_on_sync = False
+        self.timeout = timeout
         self.name = None
-        self.sync_resp_p = None
-        self.sync_resp_n = None
-        self.prov_dest = None
-        self.sync_dest = None
+        self.rx = bytearray()
+        self.tx = bytearray()
+        self.cond = threading.Condition()
+        self.closed = False
+        self.thread = None
+
+    def start(self):
+        """Boots the emulated firmware on its own thread"""
+        self.thread = threading.Thread(target=self._main, name=self.name)
+        self.thread.daemon = True
+        self.thread.start()
 
     def write(self, msg):
-        """Write a message to the emulator
+        """Writes bytes to the emulated PSoC
 
-               Args:
-                   msg (str): message to be sent to the ATM card in proper message format:
-                                1B            len(pkt) B
-                           | len(pkt) | pkt ...                |
-               """
-        self.msg_q.put(msg)
-        self._vp('Added \'%s\' to the queue' % msg)
+        Args:
+            msg (str): Raw bytes from the ATM
+        """
+        with self.cond:
+            self.rx += msg
+            self.cond.notify_all()
+        return len(msg)
 
-    def read(self, b=1, size=0):
-        """Reads a message from the emulator
+    def read(self, size=1):
+        """Reads bytes the emulated PSoC has sent
 
         Args:
-            b (doesn't matter): Isn't used
+            size (int, optional): Number of bytes to read
 
         Returns:
-            str: Alternates every call between sending the 1B header and the
-                 packet
+            str: Up to size bytes, fewer if the timeout expired first
         """
-        self._vp('Going to next state')
-        return self.next_state()
+        deadline = time.time() + self.timeout
+        with self.cond:
+            while len(self.tx) < size and not self.closed:
+                remaining = deadline - time.time()
+                if remaining <= 0:
+                    break
+                self.cond.wait(remaining)
+            data = str(self.tx[:size])
+            del self.tx[:size]
+        return data
 
     def close(self):
-        """Close the serial port and flush the stored commands"""
-        self._vp('Flushing commands')
-        self.close_on_sync = True
-        self.read()
+        """Closes the port and stops the firmware thread"""
         self._vp('Closing')
+        with self.cond:
+            self.closed = True
+            self.cond.notify_all()
 
     def isOpen(self):
-        return True
+        return not self.closed
 
     def _vp(self, msg, stream=logging.info):
         """Prints message if verbose was set
@@ -118,97 +137,72 @@ class SerialEmulator(object):
         if self.verbose:
             stream("%s: %s" % (self.name, msg))
 
-    def _next_msg(self):
-        """Gets and unformats the next message on the queue
-
-        Returns:
-            str: Next message unformatted
-        """
-        msg = self.msg_q.get()
-        msg = struct.unpack("B%ds" % (len(msg) - 1), msg)[1].strip('\00')
-        self._vp('Got message \'%s\' from the queue' % msg)
-        return msg
-
-    def _return_message(self, msg, next_call):
-        """Sends the header and prepares to send the packet on the next
-        call to read
+    ###########################################################################
+    # firmware side
 
-        Args:
-            msg (str): Raw message to be sent
-            next_call (func): State to return to after sending message body
+    def _pull(self, length):
+        """Blocks until length bytes arrive from the ATM (pullMessage)
 
-        Returns:
-            str: 1B packet header with packet length
+        Raises:
+            EmulatorClosed: If the port was closed while waiting
         """
+        with self.cond:
+            while len(self.rx) < length:
+                if self.closed:
+                    raise EmulatorClosed
+                self.cond.wait()
+            data = str(self.rx[:length])
+            del self.rx[:length]
+        return data
+
+    def _pull_byte(self):
+        return ord(self._pull(1))
+
+    def _push(self, data):
+        """Sends bytes to the ATM (pushMessage)"""
+        with self.cond:
+            self.tx += data
+            self.cond.notify_all()
+
+    def _push_byte(self, b):
+        self._push(chr(b))
+
+    def _sync(self, prov):
+        """Answers sync requests until the ATM sends SYNCED (syncConnection)
 
-        self.next_state = self._send_msg_body
-        self.msg_body_next = next_call
-        self.msg_body = msg
-        self._vp('Returning message header of %d' % len(msg))
-        return struct.pack('B', len(msg))
-
-    def _send_msg_body(self):
-        """Sends the body of the message and goes to the next state
-
-        Returns:
-            str: Packet body
-        """
-
-        self.next_state = self.msg_body_next
-        self._vp('Returning message body \'%s\'' % self.msg_body)
-        return self.msg_body
-
-    def _sync(self):
-        """Synchronize communication with ATM
-
-        Returns:
-            str: Packet header of sync message
-        """
-
-        # don't continue if flushing on close
-        if self.close_on_sync:
-            return
-
-        msg = self._next_msg()
-        if msg != "READY":
-            self._vp('ERROR: Sync did not receive correct message! '
-                     'Wantedd \'READY\' got \'%s\''
-                     % msg)
-            return self._return_message(msg, self._sync)
-
-        self._vp('Sync received correct message')
-        if self.provision:
-            self._vp("Going from sync into provisioning")
-            return self._return_message(self.sync_resp_p, self._provision_msg)
-        self._vp("Going from sync into normal operation")
-        return self._return_message(self.sync_resp_n, self.sync_dest)
-
-    def _sync_complete(self):
-        """Finish synchronization process
-
-        Returns:
-            bool: Whether synchronization was successful
-        """
-
-        msg = self._next_msg()
-        if msg != "GO":
-            self._vp('ERROR: Sync did not receive correct go message! \'%s\''
-                     % msg)
-            self.next_state = self._sync
-            return False
-
-        self._vp('Sync received correct go message')
-        return True
-
-    def _provision_msg(self):
-        """Send provisioning message to ATM
-
-        Returns:
-            str: Packet header of provisioning message
+        Args:
+            prov (bool): Whether the firmware is waiting to be provisioned
         """
-
-        if not self._sync_complete():
-            return ''
-
-        self._vp('Sending provisioning message')
-        return self._return_message("P", self.prov_dest)
+        while True:
+            message = self._pull_byte()
+            if message == self.SYNC_REQUEST_NO_PROV:
+                self._push_byte(self.SYNC_CONFIRMED_PROV)
+            elif message == self.SYNC_REQUEST_PROV:
+                self._push_byte(self.SYNC_CONFIRMED_NO_PROV if prov else self.SYNC_CONFIRMED_PROV)
+            elif message == self.PSOC_DEVICE_REQUEST:
+                self._push_byte(self.SYNC_TYPE_P if prov else self.SYNC_TYPE_N)
+            elif message == self.SYNCED:
+                return
+
+    def _main(self):
+        """Runs the firmware's main()"""
+        try:
+            if not self.provisioned:
+                self._sync(True)
+                self._provision()
+                self.provisioned = True
+                self._vp('Provisioned')
+            else:
+                self._sync(False)
+
+            while True:
+                self._sync(False)
+                self._handle(self._pull_byte())
+        except EmulatorClosed:
+            pass
+
+    def _provision(self):
+        raise NotImplementedError
+
+    def _handle(self, message_type):
+        raise NotImplementedError
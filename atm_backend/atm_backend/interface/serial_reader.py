@@ -0,0 +1,124 @@
+"""Buffered reader for PSoC serial ports
+
+Every read lands in one preallocated bytearray ring instead of building a new
+string out of whatever chunks the serial driver hands back, so a transaction
+no longer allocates per chunk or per 16 byte bill.
+"""
+
+import time
+
+
+class ReadTimeout(Exception):
+    """A read was not filled before its deadline"""
+
+
+class SerialReader(object):
+    """
+    Reads fixed-size frames from a serial port into a preallocated ring
+
+    Args:
+        ser (serial.Serial or serial emulator, optional): Serial interface to
+            read from. Can be attached later with attach()
+        size (int, optional): Capacity of the ring in bytes. Must hold the
+            largest single read (a full HSM of 128 bills is 2048 bytes)
+
+    Note:
+        Views returned by read_exact and read_frame point into the ring and
+        stay valid only until the ring wraps back over them. Copy them with
+        .tobytes() before holding onto them across reads.
+    """
+
+    def __init__(self, ser=None, size=4096):
+        self.ser = ser
+        self.buf = bytearray(size)
+        self.view = memoryview(self.buf)
+        self.pos = 0
+
+    def attach(self, ser):
+        """
+        Points the reader at a (re)opened serial port
+
+        Args:
+            ser (serial.Serial or serial emulator): Serial interface
+        """
+        self.ser = ser
+        self.pos = 0
+
+    def _reserve(self, size):
+        """
+        Hands out the next size bytes of the ring, wrapping to the start when
+        the frame would run past the end
+
+        Args:
+            size (int): Number of bytes to reserve
+
+        Returns:
+            memoryview: Writable view of the reserved bytes
+        """
+        if size > len(self.buf):
+            raise ValueError('read of %d bytes exceeds reader ring of %d bytes'
+                             % (size, len(self.buf)))
+        if self.pos + size > len(self.buf):
+            self.pos = 0
+        start = self.pos
+        self.pos += size
+        return self.view[start:self.pos]
+
+    def _fill(self, dst, deadline=None):
+        """
+        Blocks until dst is completely filled from the serial port
+
+        Args:
+            dst (memoryview): Writable view to fill
+            deadline (float, optional): time.time() to give up at. Checked
+                whenever the port's own read timeout returns short
+
+        Raises:
+            ReadTimeout: If deadline passed before dst was filled
+        """
+        size = len(dst)
+        got = 0
+        readinto = getattr(self.ser, 'readinto', None)
+        while got < size:
+            if readinto is not None:
+                got += readinto(dst[got:]) or 0
+            else:
+                # serial emulators only implement read()
+                chunk = self.ser.read(size=size - got)
+                dst[got:got + len(chunk)] = chunk
+                got += len(chunk)
+            if got < size and deadline is not None and time.time() >= deadline:
+                raise ReadTimeout('read %d of %d bytes before the deadline' % (got, size))
+
+    def read_exact(self, size, timeout=None):
+        """
+        Reads exactly size bytes
+
+        Args:
+            size (int): Number of bytes to read
+            timeout (float, optional): Seconds to wait for them. Default is
+                to wait until they arrive
+
+        Returns:
+            memoryview: View of the bytes read
+
+        Raises:
+            ReadTimeout: If timeout passed before size bytes arrived
+        """
+        dst = self._reserve(size)
+        self._fill(dst, None if timeout is None else time.time() + timeout)
+        return dst
+
+    def read_frame(self, count, size):
+        """
+        Reads count back-to-back frames of size bytes with a single bulk read
+
+        Args:
+            count (int): Number of frames
+            size (int): Size of each frame in bytes
+
+        Returns:
+            list of memoryview: One view per frame
+        """
+        frame = self.read_exact(count * size)
+        return [frame[i * size:(i + 1) * size] for i in range(count)]
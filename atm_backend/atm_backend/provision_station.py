@@ -0,0 +1,349 @@
+"""Provisioning station: provisions many cards and HSMs in parallel
+
+Every serial device plugged into the station gets its own worker thread. The
+worker asks the device what it is, takes the next queued provisioning job
+for that kind of device, flashes it, and hands the result to a batcher
+thread that registers finished devices with the bank in batches
+(set_first_pk_batch / set_initial_num_bills_batch). Throughput therefore
+scales with the number of USB ports instead of being bound to one card and
+one HSM at a time.
+
+Jobs are keyed by the card_id / hsm_id in their provisioning blob and move
+through:
+
+    queued -> provisioning -> registering -> success
+                           \\-> failure    \\-> failure
+
+A job whose device fails is not retried on another device, since the
+device may already hold its ids; resubmit it to retry. A job id cannot be
+resubmitted while its job is still running. The states of the last
+max_finished finished jobs are kept for job_status, older ones are
+forgotten.
+"""
+
+import collections
+import logging
+import socket
+import threading
+import time
+import Queue
+import xmlrpclib
+import serial
+from serial.tools.list_ports import comports as list_ports
+from interface import Card, HSM, Psoc, DeviceRemoved
+from provision_tool import split_card_blob, split_hsm_blob, flash_card, flash_hsm
+
+
+class ProvisionStation(object):
+    """
+    Interface for the provisioning station xmlrpc server
+
+    Args:
+        bank (Bank): Interface to bank, must support the batch calls
+        ports (list of str, optional): Serial ports to provision on. Default
+            is every port that appears after the station starts
+        verbose (bool, optional): Whether to print device debug messages
+        batch_size (int, optional): Registrations to send to the bank at once
+        batch_interval (float, optional): Longest time in seconds a finished
+            device waits for its batch to fill up
+        max_finished (int, optional): Finished jobs to remember the state of
+        probe_timeout (float, optional): Seconds a new device has to say what
+            it is before it is marked failed
+    """
+
+    RUNNING = ('queued', 'provisioning', 'registering')
+
+    def __init__(self, bank, ports=None, verbose=False, batch_size=16, batch_interval=1.0,
+                 max_finished=1024, probe_timeout=5.0):
+        super(ProvisionStation, self).__init__()
+        self.bank = bank
+        self.ports = set(ports or [])
+        self.verbose = verbose
+        self.batch_size = batch_size
+        self.batch_interval = batch_interval
+        self.max_finished = max_finished
+        self.probe_timeout = probe_timeout
+
+        self.card_jobs = Queue.Queue()
+        self.hsm_jobs = Queue.Queue()
+        self.registrations = Queue.Queue()
+
+        self.lock = threading.Lock()
+        self.jobs = {}
+        # finished job ids, oldest first
+        self.finished = collections.OrderedDict()
+        self.devices = {}
+        self.present = set()
+        logging.info('provision station initialized')
+
+    def start(self):
+        """Starts the port watcher and bank batcher threads"""
+        for target, name in ((self._watch_ports, 'station-watcher'),
+                             (self._register_batches, 'station-batcher')):
+            t = threading.Thread(target=target, name=name)
+            t.daemon = True
+            t.start()
+
+    ###########################################################################
+    # xmlrpc interface
+
+    def submit_card(self, card_blob, pin):
+        """
+        Queues an ATM card for provisioning on the next free card
+
+        Args:
+            card_blob (str): Provisioning data for the ATM card
+            pin (str): Initial PIN for the card
+
+        Returns:
+            str: Job id (the card_id) on success, False if the blob is
+                malformed or the card's job is still running
+        """
+        fields = split_card_blob(card_blob)
+        if fields is None:
+            return False
+        card_id = fields[2]
+        if not self._queue_job(card_id):
+            return False
+        self.card_jobs.put((fields, str(pin)))
+        return card_id
+
+    def submit_atm(self, hsm_blob, bills):
+        """
+        Queues an HSM for provisioning on the next free HSM
+
+        Args:
+            hsm_blob (str): Provisioning data for the HSM
+            bills (list of str): List of bills to be stored in the HSM
+
+        Returns:
+            str: Job id (the hsm_id) on success, False if the input is
+                malformed or the HSM's job is still running
+        """
+        fields = split_hsm_blob(hsm_blob)
+        if fields is None or not isinstance(bills, list):
+            return False
+        hsm_id = fields[2]
+        if not self._queue_job(hsm_id):
+            return False
+        self.hsm_jobs.put((fields, bills))
+        return hsm_id
+
+    def job_status(self, job_id):
+        """
+        Returns:
+            str: State of a submitted job, 'unknown' if it was never
+                submitted or finished too long ago
+        """
+        with self.lock:
+            return self.jobs.get(job_id, 'unknown')
+
+    def station_status(self):
+        """
+        Reports the progress of every device and the job queues
+
+        Returns:
+            dict: 'devices' maps port to {'kind', 'state', 'job'},
+                  'queued_cards' and 'queued_hsms' count waiting jobs and
+                  'jobs' counts jobs by state
+        """
+        with self.lock:
+            devices = dict((port, dict(info)) for port, info in self.devices.items())
+            counts = {}
+            for state in self.jobs.values():
+                counts[state] = counts.get(state, 0) + 1
+        return {'devices': devices,
+                'queued_cards': self.card_jobs.qsize(),
+                'queued_hsms': self.hsm_jobs.qsize(),
+                'jobs': counts}
+
+    ###########################################################################
+    # workers
+
+    def _queue_job(self, job_id):
+        """
+        Returns:
+            bool: True if the job was marked queued, False if it is still
+                running
+        """
+        with self.lock:
+            if self.jobs.get(job_id) in self.RUNNING:
+                logging.warning('STATION: job %s is already running', job_id)
+                return False
+            self.finished.pop(job_id, None)
+            self.jobs[job_id] = 'queued'
+            return True
+
+    def _set_job(self, job_id, state):
+        with self.lock:
+            self.jobs[job_id] = state
+            if state in self.RUNNING:
+                return
+            self.finished[job_id] = True
+            while len(self.finished) > self.max_finished:
+                del self.jobs[self.finished.popitem(last=False)[0]]
+
+    def _set_device(self, port, **info):
+        with self.lock:
+            self.devices.setdefault(port, {'kind': '', 'state': '', 'job': ''}).update(info)
+
+    def _watch_ports(self):
+        """Threaded function that starts a worker for every new serial device"""
+        # Configured ports are provisioned even if already plugged in, others
+        # only once they appear
+        old_ports = set()
+        if not self.ports:
+            old_ports = set(port_info.device for port_info in list_ports())
+        while True:
+            ports = set(port_info.device for port_info in list_ports())
+            if self.ports:
+                ports &= self.ports
+            with self.lock:
+                self.present = ports
+            for port in ports - old_ports:
+                logging.info('STATION: found new serial device on %s', port)
+                t = threading.Thread(target=self._run_port, args=(port,),
+                                     name='station-%s' % port)
+                t.daemon = True
+                t.start()
+            old_ports = ports
+            time.sleep(.25)
+
+    def _attached(self, port):
+        with self.lock:
+            return port in self.present
+
+    def _next_job(self, jobs, port):
+        """Waits for a job while the device stays attached"""
+        while self._attached(port):
+            try:
+                return jobs.get(timeout=1)
+            except Queue.Empty:
+                pass
+        return None
+
+    def _run_port(self, port):
+        """Threaded function that provisions the device on one port"""
+        self._set_device(port, kind='', state='probing', job='')
+        ser = None
+        try:
+            try:
+                ser = serial.Serial(port, baudrate=115200, timeout=1)
+                kind = Psoc('PROBE', ser, self.verbose).identify(self.probe_timeout)
+                self._set_device(port, kind=kind or '')
+                if kind is None:
+                    logging.warning('STATION: %s did not answer the probe within %.1fs',
+                                    port, self.probe_timeout)
+                    self._set_device(port, state='failed')
+                elif kind == 'CARD_P':
+                    self._provision_card(port, ser)
+                elif kind == 'HSM_P':
+                    self._provision_hsm(port, ser)
+                elif kind in ('CARD_N', 'HSM_N'):
+                    self._set_device(port, state='already provisioned')
+                else:
+                    self._set_device(port, state='unknown device')
+            except serial.SerialException:
+                self._set_device(port, state='failed to open')
+            except DeviceRemoved:
+                self._set_device(port, state='removed')
+            except Exception:
+                logging.exception('STATION: provisioning on %s failed', port)
+                self._set_device(port, state='failed')
+            self._fail_device_job(port)
+
+            # Hold the port until the device is unplugged so it is not probed
+            # again
+            while self._attached(port):
+                time.sleep(.25)
+        finally:
+            if ser:
+                ser.close()
+            with self.lock:
+                self.devices.pop(port, None)
+            logging.info('STATION: %s disconnected', port)
+
+    def _fail_device_job(self, port):
+        """Marks the job a device was running failed if the device stopped before finishing it"""
+        with self.lock:
+            job_id = self.devices.get(port, {}).get('job')
+        if job_id and self.job_status(job_id) == 'provisioning':
+            self._set_job(job_id, 'failure')
+
+    def _provision_card(self, port, ser):
+        card = Card(port=ser, verbose=self.verbose)
+        card.initialize()
+
+        self._set_device(port, state='waiting for job')
+        job = self._next_job(self.card_jobs, port)
+        if job is None:
+            return
+        (r, rand_key, card_id), pin = job
+
+        self._set_device(port, state='provisioning', job=card_id)
+        self._set_job(card_id, 'provisioning')
+        pk = flash_card(card, r, rand_key, card_id, pin)
+        if pk is None:
+            self._set_device(port, state='failed')
+            self._set_job(card_id, 'failure')
+            return
+
+        self._set_device(port, state='provisioned')
+        self._set_job(card_id, 'registering')
+        self.registrations.put(('card', card_id, pk))
+
+    def _provision_hsm(self, port, ser):
+        hsm = HSM(port=ser, verbose=self.verbose)
+        hsm.initialize()
+
+        self._set_device(port, state='waiting for job')
+        job = self._next_job(self.hsm_jobs, port)
+        if job is None:
+            return
+        (hsm_key, rand_key, hsm_id), bills = job
+
+        self._set_device(port, state='provisioning', job=hsm_id)
+        self._set_job(hsm_id, 'provisioning')
+        if not flash_hsm(hsm, hsm_key, rand_key, hsm_id, bills):
+            self._set_device(port, state='failed')
+            self._set_job(hsm_id, 'failure')
+            return
+
+        self._set_device(port, state='provisioned')
+        self._set_job(hsm_id, 'registering')
+        self.registrations.put(('hsm', hsm_id, len(bills)))
+
+    ###########################################################################
+    # bank batching
+
+    def _register_batches(self):
+        """Threaded function that registers provisioned devices with the bank"""
+        while True:
+            batch = [self.registrations.get()]
+            deadline = time.time() + self.batch_interval
+            while len(batch) < self.batch_size:
+                timeout = deadline - time.time()
+                if timeout <= 0:
+                    break
+                try:
+                    batch.append(self.registrations.get(timeout=timeout))
+                except Queue.Empty:
+                    break
+            self._flush(batch)
+
+    def _flush(self, batch):
+        cards = [(job_id, value) for kind, job_id, value in batch if kind == 'card']
+        hsms = [(job_id, value) for kind, job_id, value in batch if kind == 'hsm']
+        for items, call in ((cards, self.bank.set_first_pk_batch),
+                            (hsms, self.bank.set_initial_num_bills_batch)):
+            if not items:
+                continue
+            try:
+                results = call(items)
+            except (socket.error, xmlrpclib.Error):
+                logging.exception('STATION: bank registration failed')
+                results = [False] * len(items)
+            logging.info('STATION: registered %d/%d devices with the bank',
+                         sum(1 for ok in results if ok), len(items))
+            for (job_id, _), ok in zip(items, results):
+                self._set_job(job_id, 'success' if ok else 'failure')
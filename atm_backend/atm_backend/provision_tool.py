@@ -1,7 +1,93 @@
 import logging
-from interface.psoc import DeviceRemoved, AlreadyProvisioned
+from interface.psoc import DeviceRemoved, AlreadyProvisioned, holds
 import xmlrpclib
 
+
+def split_card_blob(card_blob):
+    """Splits card provisioning data into (r, rand_key, card_id)
+
+    Returns:
+        tuple of str, or None if the blob is malformed
+    """
+    card_blob = str(card_blob)
+
+    #if it doesn't contain a random PRF key for rng and a uuid
+    if len(card_blob) != 32 + 32 + 36:
+        return None
+
+    return (card_blob[:32], card_blob[32:64], card_blob[64:])
+
+
+def split_hsm_blob(hsm_blob):
+    """Splits HSM provisioning data into (hsm_key, rand_key, hsm_id)
+
+    Returns:
+        tuple of str, or None if the blob is malformed
+    """
+    hsm_blob = str(hsm_blob)
+
+    #if it doesn't contain a 32 byte encryption key + a 32 byte rand key for rng + a uuid
+    if len(hsm_blob) != 32 + 32 + 36:
+        return None
+
+    return (hsm_blob[:32], hsm_blob[32:64], hsm_blob[64:])
+
+
+def flash_card(card, r, rand_key, card_id, pin):
+    """Provisions a connected ATM card without registering it with the bank
+
+    Args:
+        card (Card): Card to provision
+        r, rand_key, card_id (str): Fields from split_card_blob
+        pin (str): Initial PIN for the card
+
+    Returns:
+        str: Public key for the initial PIN on Success, None on Failure
+    """
+    try:
+        logging.info('provision_card: sending info to card')
+        if not card.provision(r, rand_key, card_id):
+            return None
+
+        logging.info('provision_card: requesting pk from card')
+        return card.request_new_public_key(pin)
+
+    except DeviceRemoved:
+        logging.error('provision_card: card was removed!')
+        return None
+    except AlreadyProvisioned:
+        logging.error('provision_card: card was already provisioned!')
+        return None
+
+
+def flash_hsm(hsm, hsm_key, rand_key, hsm_id, bills):
+    """Provisions a connected HSM without registering it with the bank
+
+    Args:
+        hsm (HSM): HSM to provision
+        hsm_key, rand_key, hsm_id (str): Fields from split_hsm_blob
+        bills (list of str): List of bills to be stored in the HSM
+
+    Returns:
+        bool: True on Success, False on Failure
+    """
+    try:
+        logging.info('provision_atm: provisioning hsm with inputted bills')
+        if not hsm.provision(hsm_key, rand_key, hsm_id, bills):
+            logging.error('provision_atm: provision failed!')
+            return False
+
+        logging.info('provision_atm: provisioned hsm with inputted bills')
+        return True
+
+    except DeviceRemoved:
+        logging.error('provision_atm: HSM was removed!')
+        return False
+    except AlreadyProvisioned:
+        logging.error('provision_atm: HSM was already provisioned!')
+        return False
+
+
 class ProvisionTool(object):
     """Interface for the provisioning xmlrpc server
 
@@ -29,6 +115,7 @@ class ProvisionTool(object):
     def card_connected(self):
         return self.card.connected
 
+    @holds('card')
     def provision_card(self, card_blob, pin):
         """Attempts to provision an ATM card
 
@@ -39,43 +126,27 @@ class ProvisionTool(object):
         Returns:
             bool: True on Success, False on Failure
         """
-        card_blob = str(card_blob)
-        pin = str(pin)
-
-        #if it doesn't contain a random PRF key for rng and a uuid
-        if len(card_blob) != 32 + 32 + 36:
+        fields = split_card_blob(card_blob)
+        if fields is None:
             return False
-
-        r = card_blob[:32]
-        rand_key = card_blob[32:64]
-        card_id = card_blob[64:]
+        r, rand_key, card_id = fields
 
         self.card.wait_for_insert()
         if not self.card.inserted():
             logging.error('provision_card: no card was inserted!')
             return False
 
-        try:
-            logging.info('provision_card: sending info to card')
-            if not self.card.provision(r, rand_key, card_id):
-                return False
-
-            logging.info('provision_card: requesting pk from card')
-            pk = self.card.request_new_public_key(pin)
-
-            logging.info('provision_card: setting pin on server side')
-            if not self.bank.set_first_pk(card_id, pk):
-                logging.error('provision_card: provisioning failed on the server')
-                return False
-            return True
-
-        except DeviceRemoved:
-            logging.error('provision_card: card was removed!')
+        pk = flash_card(self.card, r, rand_key, card_id, str(pin))
+        if pk is None:
             return False
-        except AlreadyProvisioned:
-            logging.error('provision_card: card was already provisioned!')
+
+        logging.info('provision_card: setting pin on server side')
+        if not self.bank.set_first_pk(card_id, pk):
+            logging.error('provision_card: provisioning failed on the server')
             return False
+        return True
 
+    @holds('hsm')
     def provision_atm(self, hsm_blob, bills):
         """Attempts to provision an HSM
 
@@ -86,16 +157,10 @@ class ProvisionTool(object):
         Returns:
             bool: True on Success, False on Failure
         """
-
-        hsm_blob = str(hsm_blob)
-
-        #if it doesn't contain a 32 byte encryption key + a 32 byte rand key for rng + a uuid
-        if len(hsm_blob) != 32 + 32 + 36:
-                return False
-
-        hsm_key = hsm_blob[:32]
-        rand_key = hsm_blob[32:64]
-        hsm_id = hsm_blob[64:]
+        fields = split_hsm_blob(hsm_blob)
+        if fields is None:
+            return False
+        hsm_key, rand_key, hsm_id = fields
 
         if not isinstance(bills, list):
             logging.error('provision_atm: bills input must be array')
@@ -106,23 +171,11 @@ class ProvisionTool(object):
             logging.error('provision_hsm: no hsm was inserted!')
             return False
 
-        try:
-            logging.info('provision_atm: provisioning hsm with inputted bills')
-            if not self.hsm.provision(hsm_key, rand_key, hsm_id, bills):
-                logging.error('provision_atm: provision failed!')
-                return False
-                
-            logging.info('provision_atm: provisioned hsm with inputted bills')
-
-            logging.info('provision_atm: setting num_bills on server side')
-            if not self.bank.set_initial_num_bills(hsm_id, len(bills)):
-                logging.error('provision_atm: provisioning failed on the server')
-                return False
-            return True
-
-        except DeviceRemoved:
-            logging.error('provision_atm: HSM was removed!')
+        if not flash_hsm(self.hsm, hsm_key, rand_key, hsm_id, bills):
             return False
-        except AlreadyProvisioned:
-            logging.error('provision_atm: HSM was already provisioned!')
+
+        logging.info('provision_atm: setting num_bills on server side')
+        if not self.bank.set_initial_num_bills(hsm_id, len(bills)):
+            logging.error('provision_atm: provisioning failed on the server')
             return False
+        return True
@@ -0,0 +1,116 @@
+"""Benchmarks the ATM backend against recorded card and HSM sessions
+
+Usage:
+    python -m atm_backend.replay_bench CARD_CAPTURE HSM_CAPTURE
+        [--op withdraw|check_balance|provision_card|provision_atm]
+        [--count N] [--realtime] [--profile]
+
+Captures are recorded by setting record: true for a device in config.yaml.
+The replayed devices answer with their recorded bytes whatever they are
+sent, so the bank is replaced by ReplayBank, which returns well-formed but
+meaningless responses. Each capture should hold one session of the chosen
+operation; it is looped for every iteration.
+
+Without --realtime the devices answer instantly and the measured time is
+pure host overhead. The device time recorded in the captures is reported
+alongside it.
+"""
+
+import argparse
+import cProfile
+import logging
+import pstats
+import sys
+import time
+from .atm import ATM
+from .provision_tool import ProvisionTool
+from .interface import Card, HSM, SerialReplay
+
+
+class ReplayBank(object):
+    """Bank stand-in for replayed sessions"""
+
+    def get_nonce(self, card_id):
+        return '\x00' * 32
+
+    def check_balance(self, card_id, nonce, signature, hsm_id, hsm_nonce):
+        return '\x00' * 73
+
+    def withdraw(self, card_id, nonce, signature, hsm_id, hsm_nonce, amount):
+        return '\x00' * 70
+
+    def change_pin(self, card_id, nonce, signature, new_pk):
+        return 'OKAY'
+
+    def set_first_pk(self, card_id, pk):
+        return True
+
+    def set_initial_num_bills(self, hsm_id, num_bills):
+        return True
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Replay captured serial sessions through the ATM')
+    parser.add_argument('card_capture')
+    parser.add_argument('hsm_capture')
+    parser.add_argument('--op', default='withdraw',
+                        choices=['withdraw', 'check_balance', 'provision_card', 'provision_atm'])
+    parser.add_argument('--count', type=int, default=100)
+    parser.add_argument('--pin', default='12345678')
+    parser.add_argument('--amount', type=int, default=1)
+    parser.add_argument('--realtime', action='store_true',
+                        help='reproduce the recorded device delays')
+    parser.add_argument('--profile', action='store_true',
+                        help='print a cProfile summary of the host side')
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.WARNING)
+
+    card_ser = SerialReplay(args.card_capture, realtime=args.realtime, loop=True)
+    hsm_ser = SerialReplay(args.hsm_capture, realtime=args.realtime, loop=True)
+    card = Card(port=card_ser)
+    hsm = HSM(port=hsm_ser)
+    card.initialize()
+    hsm.initialize()
+    bank = ReplayBank()
+    atm = ATM(bank, hsm, card)
+    provision_tool = ProvisionTool(bank, hsm, card)
+
+    ops = {
+        'withdraw': lambda: atm.withdraw(args.pin, args.amount),
+        'check_balance': lambda: atm.check_balance(args.pin),
+        'provision_card': lambda: provision_tool.provision_card('\x00' * 64 + '0' * 36, args.pin),
+        'provision_atm': lambda: provision_tool.provision_atm('\x00' * 64 + '0' * 36,
+                                                              ['0' * 16] * args.amount),
+    }
+    op = ops[args.op]
+
+    profiler = cProfile.Profile() if args.profile else None
+    start = time.time()
+    if profiler:
+        profiler.enable()
+    done = 0
+    try:
+        while done < args.count:
+            op()
+            done += 1
+    except EOFError as err:
+        # only a capture holding no device output at all runs out when looped
+        print '%s after %d transactions' % (err, done)
+    if profiler:
+        profiler.disable()
+    elapsed = time.time() - start
+    if not done:
+        return 1
+
+    device = card_ser.device_time + hsm_ser.device_time
+    print '%s x %d (%s)' % (args.op, done, 'realtime' if args.realtime else 'full speed')
+    print '  wall time per transaction:       %8.3f ms' % (elapsed * 1000 / done)
+    print '  recorded device time per txn:    %8.3f ms' % (device * 1000 / done)
+    if args.realtime:
+        print '  host overhead per transaction:   %8.3f ms' % ((elapsed - device) * 1000 / done)
+    if profiler:
+        pstats.Stats(profiler).sort_stats('cumulative').print_stats(25)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
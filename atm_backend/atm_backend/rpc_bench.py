@@ -0,0 +1,175 @@
+"""Compares the bank's XML-RPC and binary protocols
+
+Usage:
+    python -m atm_backend.rpc_bench [--host HOST] [--port PORT]
+        [--binary-port PORT] [--count N]
+
+Needs a running bank with the binary protocol enabled. Each protocol makes
+the same get_nonce and check_balance calls through a local proxy that
+counts the bytes on the wire, and the per-call latency and wire size are
+printed side by side.
+
+The calls name cards that don't exist and nonces the bank never issued,
+so the bank turns them away after the same cheap lookup whichever protocol
+carries them, and the benchmark can run against a provisioned bank without
+touching any account. The sizes of successful exchanges, which carry a
+ciphertext back, are printed too, computed from the message encodings.
+"""
+
+import argparse
+import logging
+import os
+import socket
+import threading
+import time
+import uuid
+import xmlrpclib
+from .interface import Bank, BinaryBank
+
+
+class CountingProxy(object):
+    """
+    Forwards local connections to upstream, counting bytes each way
+
+    Args:
+        upstream (tuple): (host, port) to forward to
+    """
+
+    def __init__(self, upstream):
+        self.upstream = upstream
+        self.sent = 0
+        self.received = 0
+        self.connections = 0
+        self.lock = threading.Lock()
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.bind(('127.0.0.1', 0))
+        self.listener.listen(16)
+        self.port = self.listener.getsockname()[1]
+        thread = threading.Thread(target=self._accept)
+        thread.daemon = True
+        thread.start()
+
+    def _accept(self):
+        while True:
+            client = self.listener.accept()[0]
+            server = socket.create_connection(self.upstream)
+            for sock in (client, server):
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            with self.lock:
+                self.connections += 1
+            for (src, dst, counter) in ((client, server, 'sent'), (server, client, 'received')):
+                thread = threading.Thread(target=self._pump, args=(src, dst, counter))
+                thread.daemon = True
+                thread.start()
+
+    def _pump(self, src, dst, counter):
+        try:
+            while True:
+                data = src.recv(65536)
+                if not data:
+                    break
+                with self.lock:
+                    setattr(self, counter, getattr(self, counter) + len(data))
+                dst.sendall(data)
+        except socket.error:
+            pass
+        finally:
+            try:
+                dst.shutdown(socket.SHUT_WR)
+            except socket.error:
+                pass
+
+    def take(self):
+        """Returns and resets (bytes sent, bytes received, connections opened)"""
+        with self.lock:
+            counts = (self.sent, self.received, self.connections)
+            self.sent = self.received = self.connections = 0
+        return counts
+
+
+def run(call, count, proxy):
+    """Makes count calls, returning sorted latencies in ms and the proxy's counts"""
+    # the bank's answers reach the proxy's counters just after the caller
+    # sees them, so let the last pump catch up before reading them
+    call()
+    time.sleep(0.1)
+    proxy.take()
+    latencies = []
+    for _ in range(count):
+        start = time.time()
+        call()
+        latencies.append((time.time() - start) * 1000)
+    time.sleep(0.1)
+    return sorted(latencies), proxy.take()
+
+
+def report(name, latencies, counts, count):
+    (sent, received, connections) = counts
+    print '  %-22s %8.3f %8.3f %8.3f %9d %9d %6d' % (
+        name, sum(latencies) / count, latencies[count // 2],
+        latencies[min(count - 1, int(count * 0.99))],
+        sent // count, received // count, connections)
+
+
+def xmlrpc_size(method, params, result):
+    """Returns (request, response) XML-RPC body sizes, HTTP headers excluded"""
+    request = xmlrpclib.dumps(params, method)
+    response = xmlrpclib.dumps((result,), methodresponse=True)
+    return (len(request), len(response))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare the bank's XML-RPC and binary protocols")
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=1337)
+    parser.add_argument('--binary-port', type=int, default=1339)
+    parser.add_argument('--count', type=int, default=1000)
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.WARNING)
+
+    xml_proxy = CountingProxy((args.host, args.port))
+    binary_proxy = CountingProxy((args.host, args.binary_port))
+    xml_bank = Bank('127.0.0.1', xml_proxy.port)
+    binary_bank = BinaryBank('127.0.0.1', xml_proxy.port, binary_proxy.port)
+
+    card_id = str(uuid.uuid4())
+    hsm_id = str(uuid.uuid4())
+    nonce, signature, hsm_nonce = os.urandom(32), os.urandom(64), os.urandom(32)
+
+    print 'per call over %d calls' % args.count
+    print '  %-22s %8s %8s %8s %9s %9s %6s' % ('', 'mean ms', 'p50 ms', 'p99 ms',
+                                              'bytes out', 'bytes in', 'conns')
+    for (label, call) in [
+            ('get_nonce', lambda bank: bank.get_nonce(card_id)),
+            ('check_balance', lambda bank: bank.check_balance(card_id, nonce, signature,
+                                                              hsm_id, hsm_nonce))]:
+        for (protocol, bank, proxy) in [('xmlrpc', xml_bank, xml_proxy),
+                                        ('binary', binary_bank, binary_proxy)]:
+            (latencies, counts) = run(lambda: call(bank), args.count, proxy)
+            report('%s %s' % (label, protocol), latencies, counts, args.count)
+
+    # successful exchanges: the responses carry a 32 byte nonce or the
+    # ciphertext the HSM decrypts (73 bytes for a balance, 70 for a
+    # withdrawal)
+    B = xmlrpclib.Binary
+    successes = [
+        ('get_nonce', (card_id,), B(nonce), BinaryBank.GET_NONCE_REQUEST.size, 32),
+        ('check_balance', (card_id, B(nonce), B(signature), hsm_id, B(hsm_nonce)),
+         B('\x00' * 73), BinaryBank.CHECK_BALANCE_REQUEST.size, 73),
+        ('withdraw', (card_id, B(nonce), B(signature), hsm_id, B(hsm_nonce), 20),
+         B('\x00' * 70), BinaryBank.WITHDRAW_REQUEST.size, 70),
+        ('change_pin', (card_id, B(nonce), B(signature), B(os.urandom(32))), 'OKAY',
+         BinaryBank.CHANGE_PIN_REQUEST.size, 4),
+    ]
+    header = BinaryBank.HEADER.size
+    print
+    print 'successful call message bodies (HTTP headers and trace context excluded)'
+    print '  %-22s %15s %15s' % ('', 'xmlrpc out/in', 'binary out/in')
+    for (method, params, result, binary_out, binary_in) in successes:
+        (xml_out, xml_in) = xmlrpc_size(method, params, result)
+        print '  %-22s %7d/%-7d %7d/%-7d' % (method, xml_out, xml_in,
+                                             header + binary_out, header + binary_in)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,19 @@
+"""Threaded XML-RPC front end for the ATM
+
+SimpleXMLRPCServer answers one request at a time, so a withdraw blocked on
+serial I/O held up the kiosk UI's hello, hsm_connected and card_connected
+calls. Every request now runs on its own thread. Device transactions are
+kept to one at a time by the per-device transaction locks instead (see
+interface/psoc.py), which status calls never take.
+"""
+
+import SocketServer
+import SimpleXMLRPCServer
+
+
+class ThreadedXMLRPCServer(SocketServer.ThreadingMixIn,
+                           SimpleXMLRPCServer.SimpleXMLRPCServer):
+    """SimpleXMLRPCServer that handles each request on its own thread"""
+
+    daemon_threads = True
+    allow_reuse_address = True
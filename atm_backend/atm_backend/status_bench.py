@@ -0,0 +1,130 @@
+"""Measures status call latency while device transactions are running
+
+Usage:
+    python -m atm_backend.status_bench [--selftest] [--calls N]
+
+Against a running atm_backend (ports from tests/test_config.yaml), a background
+thread keeps issuing withdraw/check_balance transactions while the main
+thread times hello, hsm_connected and card_connected and reports latency
+percentiles.
+
+--selftest runs the same measurement against an in-process
+ThreadedXMLRPCServer whose transactions hold the device locks and sleep
+for --hold seconds, standing in for serial I/O, so it runs without
+hardware or a bank.
+"""
+
+import argparse
+import os
+import threading
+import time
+import yaml
+import xmlrpclib
+from .tests.atm_connection import ATMConnection
+from .rpc_server import ThreadedXMLRPCServer
+from .interface.psoc import holds
+
+
+class _Device(object):
+    def __init__(self):
+        self.transaction_lock = threading.Lock()
+
+
+class _SlowATM(object):
+    """ATM stand-in whose transactions block on the devices"""
+
+    def __init__(self, hold):
+        self.hsm = _Device()
+        self.card = _Device()
+        self.hold = hold
+
+    def hello(self):
+        return 'hello'
+
+    def hsm_connected(self):
+        return True
+
+    def card_connected(self):
+        return True
+
+    @holds('hsm', 'card')
+    def withdraw(self, pin, amount):
+        time.sleep(self.hold)
+        return False
+
+    @holds('hsm', 'card')
+    def check_balance(self, pin):
+        time.sleep(self.hold)
+        return False
+
+
+def _selftest_server(hold):
+    server = ThreadedXMLRPCServer(('127.0.0.1', 0), logRequests=False)
+    atm = _SlowATM(hold)
+    for func in (atm.hello, atm.hsm_connected, atm.card_connected,
+                 atm.withdraw, atm.check_balance):
+        server.register_function(func)
+    t = threading.Thread(target=server.serve_forever)
+    t.daemon = True
+    t.start()
+    return 'http://127.0.0.1:%d' % server.server_address[1]
+
+
+def percentile(samples, p):
+    ordered = sorted(samples)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p / 100.0))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Status call latency under transaction load')
+    parser.add_argument('--selftest', action='store_true')
+    parser.add_argument('--hold', type=float, default=2.0,
+                        help='seconds each selftest transaction holds the devices')
+    parser.add_argument('--calls', type=int, default=300)
+    parser.add_argument('--workers', type=int, default=2,
+                        help='threads issuing transactions concurrently')
+    parser.add_argument('--pin', default='12345678')
+    args = parser.parse_args()
+
+    if args.selftest:
+        url = _selftest_server(args.hold)
+        connect = lambda: xmlrpclib.ServerProxy(url)
+    else:
+        config_path = os.path.join(os.path.dirname(__file__), 'tests', 'test_config.yaml')
+        with open(config_path, 'r') as ymlfile:
+            config = yaml.load(ymlfile)
+        connect = lambda: ATMConnection(config)
+
+    done = threading.Event()
+    transactions = [0]
+
+    def load():
+        atm = connect()
+        while not done.is_set():
+            atm.withdraw(args.pin, 1)
+            atm.check_balance(args.pin)
+            transactions[0] += 2
+
+    for _ in range(args.workers):
+        t = threading.Thread(target=load)
+        t.daemon = True
+        t.start()
+    time.sleep(0.5)
+
+    atm = connect()
+    samples = []
+    calls = [atm.hello, atm.hsm_connected, atm.card_connected]
+    for i in range(args.calls):
+        start = time.time()
+        calls[i % len(calls)]()
+        samples.append((time.time() - start) * 1000)
+    done.set()
+
+    print 'status calls: %d, transactions completed meanwhile: %d' % (len(samples), transactions[0])
+    for p in (50, 90, 99):
+        print '  p%d: %8.2f ms' % (p, percentile(samples, p))
+    print '  max: %7.2f ms' % max(samples)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,28 @@
+"""Transaction tracing, atm_backend side
+
+Spans and the trace file are shared with the bank_server in
+ectf_common.tracing. This module adds the xmlrpclib transport that sends
+the trace context to the bank, and resolves the configured trace path
+against the atm_backend package.
+"""
+
+import os
+import xmlrpclib
+from ectf_common import tracing as common_tracing
+from ectf_common.tracing import TRACE_HEADER, current_context, enabled, span, traced
+
+
+def configure(config, process_name):
+    """Enables tracing from the tracing section of config.yaml, see
+    ectf_common.tracing.configure()"""
+    common_tracing.configure(config, process_name, os.path.dirname(__file__))
+
+
+class TracingTransport(xmlrpclib.Transport):
+    """xmlrpclib transport that forwards the current trace context"""
+
+    def send_user_agent(self, connection):
+        xmlrpclib.Transport.send_user_agent(self, connection)
+        context = current_context()
+        if context is not None:
+            connection.putheader(TRACE_HEADER, context)
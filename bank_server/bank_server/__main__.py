@@ -9,7 +9,9 @@ import threading
 import logging
 from logging import handlers
 import yaml
-from . import Bank, AdminBackend
+from . import Bank, AdminBackend, DB, tracing
+from .cache import KeyCaches
+from .journal import Journal
 
 
 def main():
@@ -17,9 +19,10 @@ def main():
         main:
             - load configuration yaml
             - initialize logging
-            - create database mutex
+            - create database mutex, key caches and journal
             - start admin interface daemon thread
             - start bank interface
+            - on shutdown, flush the journal
     """
     # Load configuartion from yaml
     config_path = os.path.join(os.path.dirname(__file__), 'config.yaml')
@@ -43,14 +46,30 @@ def main():
 
     logging.info('Config loaded and logging initialized')
 
+    tracing.configure(config.get('tracing'), 'bank_server')
+
     # Create db mutex for use by admin and bank backends
     db_mutex = threading.Lock()
     ready_event = threading.Event()
-    thread_obj = threading.Thread(target=AdminBackend, args=(config, db_mutex, ready_event))
+    # shared so admin writes can invalidate keys the bank has cached
+    keys = KeyCaches(config)
+    # shared so both group their balance and pk writes into the same batches
+    journal = None
+    journal_config = config.get('journal', {})
+    if journal_config.get('enabled'):
+        db = DB(db_mutex=db_mutex, db_init=config['database']['db_init'],
+                db_path=config['database']['db_path'])
+        journal = Journal(os.getcwd() + journal_config['path'], db,
+                          max_batch=int(journal_config.get('max_batch', 256)),
+                          max_bytes=int(journal_config.get('max_bytes', 4 * 1024 * 1024)))
+    thread_obj = threading.Thread(target=AdminBackend, args=(config, db_mutex, ready_event, keys, journal))
     thread_obj.daemon = True
     thread_obj.start()
 
-    Bank(config, db_mutex, ready_event)
+    Bank(config, db_mutex, ready_event, keys, journal)
+    if journal is not None:
+        journal.close()
+        logging.info('journal closed: %s' % journal.stats())
 
 
 if __name__ == "__main__":
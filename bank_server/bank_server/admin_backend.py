@@ -63,6 +63,16 @@ running in your Bank Server.
             xmlrpclib base64:: ATM provisioning material on Success.
             bool: False otherwise.
         ------------------------------------------------------------------------
+        function:
+            cache_stats - monitoring for the bank's key caches
+
+        args:
+            None
+
+        returns:
+            dict: hits, misses, invalidations, size and capacity of the
+                verifiers and secretboxes caches
+        ------------------------------------------------------------------------
 """
 
 import uuid
@@ -83,13 +93,17 @@ class AdminBackend(object):
     also expose to ease service discovery on the client-side.
 
     """
-    def __init__(self, config, db_mutex, ready_event):
+    def __init__(self, config, db_mutex, ready_event, keys=None, journal=None):
         """ __init__ reads config object and registers interface to xmlrpc
 
         Args:
             config (dict): dictionary with xmlrpc host and port information
                             as well as database filepath
             db_mutex (object): mutex for accessing database
+            keys (KeyCaches, optional): the bank's key caches, invalidated
+                            when admin writes change a key
+            journal (Journal, optional): the bank's journal, which balance
+                            updates are committed through
         """
         super(AdminBackend, self).__init__()
         self.admin_host = config['admin']['host']
@@ -97,8 +111,9 @@ class AdminBackend(object):
         self.db_path = config['database']['db_path']
         self.db_mutex = db_mutex
         self.ready_event = ready_event
+        self.keys = keys
 
-        self.db_obj = DB(db_path=self.db_path)
+        self.db_obj = DB(db_mutex=self.db_mutex, db_path=self.db_path, journal=journal)
         server = SimpleXMLRPCServer((self.admin_host, self.admin_port))
         server.register_introspection_functions()
         server.register_function(self.create_account)
@@ -106,12 +121,18 @@ class AdminBackend(object):
         server.register_function(self.check_balance)
         server.register_function(self.create_atm)
         server.register_function(self.ready_for_atm)
+        server.register_function(self.cache_stats)
         logging.info('admin interface listening on ' + self.admin_host + ':' + str(self.admin_port))
         server.serve_forever()
 
     def ready_for_atm(self):
         return self.ready_event.isSet()
 
+    def cache_stats(self):
+        if self.keys is None:
+            return {}
+        return self.keys.stats()
+
     def create_account(self, account_name, amount):
         """Create account with account_name starting amount
 
@@ -190,6 +211,8 @@ class AdminBackend(object):
 
 
         if self.db_obj.admin_create_atm(hsm_id, hsm_key):
+            if self.keys is not None:
+                self.keys.secretboxes.invalidate(hsm_id)
             logging.info('admin create_atm success')
             return xmlrpclib.Binary(hsm_key + rand_key + hsm_id)
         logging.info('admin create_atm failure')
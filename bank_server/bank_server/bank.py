@@ -58,10 +58,15 @@ import os
 import struct
 import datetime
 import base64
+import threading
 import xmlrpclib
 
-from SimpleXMLRPCServer import SimpleXMLRPCServer
 from bank_server import DB
+from bank_server import tracing
+from bank_server.cache import KeyCaches
+from bank_server.nonce_store import NonceStore
+from bank_server.server import PooledXMLRPCServer, KeepAliveRequestHandler
+from bank_server.binary_rpc import BinaryRPCServer
 import crypto
 
 class Bank(object):
@@ -80,15 +85,31 @@ class Bank(object):
     "ERROR\n"
     """
 
-    def __init__(self, config, db_mutex, ready_event):
+    def __init__(self, config, db_mutex, ready_event, keys=None, journal=None):
         super(Bank, self).__init__()
         self.bank_host = config['bank']['host']
         self.bank_port = int(config['bank']['port'])
         self.db_init = config['database']['db_init']
         self.db_path = config['database']['db_path']
         self.db_mutex = db_mutex
-        self.db_obj = DB(db_mutex=self.db_mutex, db_init=self.db_init, db_path=self.db_path)
-        self.server = SimpleXMLRPCServer((self.bank_host, self.bank_port))
+        self.db_obj = DB(db_mutex=self.db_mutex, db_init=self.db_init, db_path=self.db_path,
+                         journal=journal)
+        # verifiers and secretboxes for card and HSM keys
+        self.keys = keys or KeyCaches(config)
+        self.verifiers = self.keys.verifiers
+        if self.keys.warmup:
+            self.keys.warm(self.db_obj)
+        # card_id -> the card's outstanding nonce
+        self.nonces = NonceStore(config.get('nonce', {}).get('lifetime', 5))
+        server_config = config.get('server', {})
+        idle_timeout = server_config.get('idle_timeout')
+        self.server = PooledXMLRPCServer((self.bank_host, self.bank_port),
+                                         workers=int(server_config.get('workers', 8)),
+                                         queue_depth=int(server_config.get('queue_depth', 64)),
+                                         request_timeout=server_config.get('request_timeout'),
+                                         idle_timeout=idle_timeout,
+                                         requestHandler=(KeepAliveRequestHandler if idle_timeout
+                                                         else tracing.TracingRequestHandler))
 
 
         # Enum values for transaction opcodes
@@ -102,17 +123,44 @@ class Bank(object):
         self.server.register_function(self.change_pin)
         self.server.register_function(self.set_first_pk)
         self.server.register_function(self.set_initial_num_bills)
+        self.server.register_function(self.set_first_pk_batch)
+        self.server.register_function(self.set_initial_num_bills_batch)
+
+        # The ATM's per-transaction calls are also served over the compact
+        # binary protocol on its own port. See binary_rpc.py
+        self.binary_server = None
+        binary_config = config.get('binary', {})
+        if binary_config.get('enabled'):
+            self.binary_server = BinaryRPCServer((self.bank_host, int(binary_config['port'])),
+                                                 workers=int(server_config.get('workers', 8)),
+                                                 queue_depth=int(server_config.get('queue_depth', 64)),
+                                                 request_timeout=server_config.get('request_timeout'),
+                                                 idle_timeout=binary_config.get('idle_timeout', 10))
+            self.binary_server.register_function(self.get_nonce)
+            self.binary_server.register_function(self.withdraw)
+            self.binary_server.register_function(self.check_balance)
+            self.binary_server.register_function(self.change_pin)
+            binary_thread = threading.Thread(target=self.binary_server.serve_forever)
+            binary_thread.daemon = True
+            binary_thread.start()
 
 
         # Bank is initialized. Tell AdminBackend to report that ready_for_atm
         # is True.
         ready_event.set()
+        if threading.current_thread().name == 'MainThread':
+            self.server.stop_on_signals()
         self.server.serve_forever()
+        if self.binary_server is not None:
+            self.binary_server.shutdown()
+            self.binary_server.server_close()
+        self.server.server_close()
 
 
 
 ###############################################################################
 
+    @tracing.traced('bank.get_nonce')
     def get_nonce(self, card_id):
         """
         Generates a random nonce so that the card can prove itself.
@@ -128,11 +176,12 @@ class Bank(object):
 
         nonce = os.urandom(32)
 
-        if not self.db_obj.check_expired_and_update_nonce(card_id, nonce):
+        if not self.nonces.issue(card_id, nonce):
             return "ERROR you already have an unexpired nonce"
 
         return xmlrpclib.Binary(nonce)
 
+    @tracing.traced('bank.change_pin')
     def change_pin(self, card_id, nonce, signature, new_pk):
         """
         Changes the PIN for the given card.
@@ -166,9 +215,11 @@ class Bank(object):
 
         if not self.db_obj.update_pk(card_id, new_pk):
             return "ERROR something went wrong"
+        self.verifiers.invalidate(card_id)
 
         return "OKAY"
 
+    @tracing.traced('bank.check_balance')
     def check_balance(self, card_id, nonce, signature, hsm_id, hsm_nonce):
         """
         Checks the balance for a given card_id.
@@ -201,18 +252,18 @@ class Bank(object):
         except ValueError as err:
             return err.message
 
-        key = self.db_obj.get_hsm_key(hsm_id)
-        if key == None:
+        box = self.get_secretbox(hsm_id)
+        if box == None:
             return "ERROR incorrect HSM id"
 
         balance = self.db_obj.get_balance(card_id)
 
         message = struct.pack("<1s32sI", chr(self.REQUEST_BALANCE), hsm_nonce, balance)
-        ctext = self.encrypt(key, message)
-        print len(ctext)
+        ctext = self.encrypt(box, message)
 
         return xmlrpclib.Binary(ctext)
 
+    @tracing.traced('bank.withdraw')
     def withdraw(self, card_id, nonce, signature, hsm_id, hsm_nonce, amount):
         """
         Withdraws a certain amount from the user account and hsm,
@@ -245,22 +296,27 @@ class Bank(object):
             return "ERROR your inputs are not right long"
 
         try:
-            self.check_nonce_and_set_used(card_id, nonce, signature)
+            self.authenticate(card_id, nonce, signature)
         except ValueError as err:
             return err.message
 
-        key = self.db_obj.get_hsm_key(hsm_id)
-        if key == None:
+        box = self.get_secretbox(hsm_id)
+        if box == None:
             return "ERROR incorrect HSM id"
 
+        # used up even if the withdrawal fails, like any other signed request
+        if not self.nonces.consume(card_id, nonce):
+            return "ERROR nonce is already used or is invalid :'("
+
         if not self.db_obj.do_withdrawal(card_id, hsm_id, amount):
             return "ERROR something went wrong with withdrawal"
 
         message = struct.pack("s32sB", chr(self.WITHDRAWAL_REQUEST), hsm_nonce, amount)
-        ctext = self.encrypt(key, message)
+        ctext = self.encrypt(box, message)
 
         return xmlrpclib.Binary(ctext)
 
+    @tracing.traced('bank.set_first_pk')
     def set_first_pk(self, card_id, pk):
         """
         Sets the first pk for a card (at provision time).
@@ -287,8 +343,12 @@ class Bank(object):
             print "ERROR ur card_id is not real"
             return False
 
-        return self.db_obj.set_first_pk(card_id, pk)
+        if not self.db_obj.set_first_pk(card_id, pk):
+            return False
+        self.verifiers.invalidate(card_id)
+        return True
 
+    @tracing.traced('bank.set_initial_num_bills')
     def set_initial_num_bills(self, hsm_id, num_bills):
         """
         Sets the intial bill count of an atm (at provision time).
@@ -313,49 +373,129 @@ class Bank(object):
 
         return self.db_obj.set_initial_num_bills(hsm_id, num_bills)
 
+    @tracing.traced('bank.set_first_pk_batch')
+    def set_first_pk_batch(self, items):
+        """
+        Sets the first pk for many cards in one database commit (used by the
+        provisioning station).
+
+        Args:
+            items (list of [card_id, pk])
+
+        Return:
+            list of bool: True for each card that was set, False otherwise
+        """
+        results = [False] * len(items)
+        valid = []
+        for i, item in enumerate(items):
+            try:
+                card_id, pk = str(item[0]), str(item[1])
+            except (ValueError, TypeError, IndexError):
+                continue
+            if len(card_id) == 36 and len(pk) == 32:
+                valid.append((i, card_id, pk))
+
+        done = self.db_obj.set_first_pk_batch([(card_id, pk) for _, card_id, pk in valid])
+        for (i, card_id, _), ok in zip(valid, done):
+            results[i] = ok
+            if ok:
+                self.verifiers.invalidate(card_id)
+        return results
+
+    @tracing.traced('bank.set_initial_num_bills_batch')
+    def set_initial_num_bills_batch(self, items):
+        """
+        Sets the initial bill count of many atms in one database commit (used
+        by the provisioning station).
+
+        Args:
+            items (list of [hsm_id, num_bills])
+
+        Return:
+            list of bool: True for each atm that was set, False otherwise
+        """
+        results = [False] * len(items)
+        valid = []
+        for i, item in enumerate(items):
+            try:
+                hsm_id, num_bills = str(item[0]), int(item[1])
+            except (ValueError, TypeError, IndexError):
+                continue
+            if len(hsm_id) == 36 and 0 <= num_bills <= 128:
+                valid.append((i, hsm_id, num_bills))
+
+        done = self.db_obj.set_initial_num_bills_batch([(hsm_id, n) for _, hsm_id, n in valid])
+        for (i, _, _), ok in zip(valid, done):
+            results[i] = ok
+        return results
+
 #################################################################
 #Helper functions
 
-    def check_nonce_and_set_used(self,card_id, nonce, signature):
+    @tracing.traced('bank.check_nonce_and_set_used')
+    def check_nonce_and_set_used(self, card_id, nonce, signature):
+        """
+        Authenticates the card with authenticate(), then uses up the nonce
+
+        Throws an exception if authenticate() does, or if the nonce is used
+        before this function uses it (in case of race conditions)
         """
-        Checks that a nonce is valid (is the currently stored nonce, is used, isn't expired, has a correct signature),
-        then updates the used flag
+        self.authenticate(card_id, nonce, signature)
+
+        if not self.nonces.consume(card_id, nonce):
+            raise ValueError("ERROR nonce is already used or is invalid :'(")
+
+        return True
+
+    @tracing.traced('bank.authenticate')
+    def authenticate(self, card_id, nonce, signature):
+        """
+        Checks that a nonce is valid (is the card's outstanding nonce, isn't expired, has a correct signature)
+        without using it up. Callers then consume the nonce, which only one of several concurrent
+        requests carrying the same nonce can do.
+
+        A stale nonce is rejected before paying for the signature check, and the card's pk is only
+        read from the database when its Verifier isn't cached.
 
         Throws an exception if:
-            the card_id doesn't exist
-            the nonce isn't the stored once
+            the nonce isn't the card's outstanding nonce (or the card doesn't exist)
             the nonce is already used
             the nonce has expired
+            the card has no pk
             the nonce signature is invalid
-            the nonce is set used before this function sets it used (in case of race conditions)
         """
-        if not self.db_obj.card_exists(card_id):
-            raise ValueError("ERROR ur card_id is not real")
+        if not self.nonces.check(card_id, nonce):
+            raise ValueError("ERROR nonce is already used or is invalid :'(")
 
-        pk = self.db_obj.get_pk(card_id)
-        if pk is None:
+        verifier = self.verifiers.get(card_id, self.db_obj.get_pk)
+        if verifier is None:
             raise ValueError("ERROR no pk????")
 
-        if not self.check_nonce_sig(nonce, signature, pk):
+        if not self.check_nonce_sig(nonce, signature, verifier):
             raise ValueError("ERROR u have bad sig")
 
-        if not self.db_obj.read_set_nonce_used(card_id, nonce):
-            raise ValueError("ERROR nonce is already used or is invalid :'(")
-
         return True
 
 ###########################################################################
 #Crypto helper functions
 
-    def check_nonce_sig(self, nonce, sig, pk):
+    @tracing.traced('crypto.sign_verify')
+    def check_nonce_sig(self, nonce, sig, verifier):
         """
-        Verifies nonce signature
+        Verifies nonce signature with the card's crypto.Verifier
         """
-        try:
-            crypto.sign_verify(sig, nonce, "\0"*8, pk)
-            return True
-        except ValueError:
-            return False
+        return verifier.verify(sig, nonce)
+
+    def get_secretbox(self, hsm_id):
+        """
+        Returns the SecretBox for an HSM's key, loading it from the database
+        on first use
+
+        Returns:
+            crypto.SecretBox, or None if the hsm_id is unknown
+        """
+        return self.keys.secretboxes.get(hsm_id, self.db_obj.get_hsm_key)
 
-    def encrypt(self, key, message):
-        return crypto.secretbox_encrypt(message, 0, "\0"*8, key)
+    @tracing.traced('crypto.secretbox_encrypt')
+    def encrypt(self, box, message):
+        return box.encrypt(message)
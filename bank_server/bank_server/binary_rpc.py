@@ -0,0 +1,136 @@
+""" Binary RPC
+Compact alternative to XML-RPC for the four calls an ATM makes on every
+transaction. Fields travel as raw bytes in fixed layouts instead of base64
+inside XML, and an ATM keeps its connection open between calls.
+
+Every frame, in either direction, is a 4 byte big-endian length of the rest
+of the frame, a type byte, then the body:
+
+    request:  length | opcode | fixed-layout fields | trace context (optional)
+    response: length | OK or ERROR | result bytes, or the error message
+
+Request layouts (card_id and hsm_id are 36 byte UUID strings):
+
+    GET_NONCE      card_id
+    CHECK_BALANCE  card_id, nonce (32), signature (64), hsm_id, hsm_nonce (32)
+    WITHDRAW       card_id, nonce, signature, hsm_id, hsm_nonce, amount (uint32)
+    CHANGE_PIN     card_id, nonce, signature, new_pk (32)
+
+Any bytes after the fixed fields are the caller's trace context, as sent in
+the X-Trace-Context header over XML-RPC. The ATM side of this protocol is
+in atm_backend/interface/bank.py and must match it.
+"""
+
+import logging
+import socket
+import struct
+import xmlrpclib
+
+from SocketServer import TCPServer, StreamRequestHandler
+from bank_server import tracing
+from bank_server.server import WorkerPoolMixIn
+
+HEADER = struct.Struct('>IB')
+MAX_FRAME = 4096
+
+GET_NONCE = 0x01
+CHECK_BALANCE = 0x02
+WITHDRAW = 0x03
+CHANGE_PIN = 0x04
+
+OK = 0x00
+ERROR = 0x01
+
+# opcode -> (bank function name, request layout)
+REQUESTS = {
+    GET_NONCE: ('get_nonce', struct.Struct('>36s')),
+    CHECK_BALANCE: ('check_balance', struct.Struct('>36s32s64s36s32s')),
+    WITHDRAW: ('withdraw', struct.Struct('>36s32s64s36s32sI')),
+    CHANGE_PIN: ('change_pin', struct.Struct('>36s32s64s32s')),
+}
+
+
+def frame(kind, body):
+    """Returns body framed with its length and type byte"""
+    return HEADER.pack(len(body) + 1, kind) + body
+
+
+class BinaryRPCHandler(StreamRequestHandler):
+    """
+    Serves request frames on one connection until the ATM closes it, or
+    WorkerPoolMixIn.wait_for_request() gives it up
+    """
+
+    # see WorkerPoolMixIn.wait_for_request()
+    rbufsize = 0
+
+    def handle(self):
+        while True:
+            try:
+                header = self.rfile.read(HEADER.size)
+                if len(header) < HEADER.size:
+                    return
+                (length, opcode) = HEADER.unpack(header)
+                if length < 1 or length > MAX_FRAME:
+                    logging.info('binary rpc: bad frame length %d, dropping connection' % length)
+                    return
+                body = self.rfile.read(length - 1)
+                if len(body) < length - 1:
+                    return
+            except socket.timeout:
+                logging.info('binary rpc: request from %s:%d timed out' % self.client_address)
+                return
+            (kind, result) = self.server.dispatch(opcode, body)
+            self.wfile.write(frame(kind, result))
+            self.wfile.flush()
+            if not self.server.wait_for_request(self.connection):
+                return
+
+
+class BinaryRPCServer(WorkerPoolMixIn, TCPServer):
+    """
+    Serves the binary protocol on a bounded worker pool
+
+    Args:
+        addr (tuple): (host, port) to listen on
+        workers, queue_depth, request_timeout, idle_timeout: See
+            WorkerPoolMixIn.start_workers()
+    """
+
+    name = 'binary rpc server'
+    allow_reuse_address = True
+    busy_response = frame(ERROR, 'ERROR bank busy')
+
+    def __init__(self, addr, workers, queue_depth, request_timeout=None, idle_timeout=10):
+        self.request_queue_size = max(queue_depth, 5)
+        TCPServer.__init__(self, addr, BinaryRPCHandler)
+        self.start_workers(workers, queue_depth, request_timeout, idle_timeout)
+        self.funcs = {}
+
+    def register_function(self, function):
+        self.funcs[function.__name__] = function
+
+    def dispatch(self, opcode, body):
+        """
+        Unpacks one request and calls the bank function it names
+
+        Returns:
+            (int, str): OK and the result bytes, or ERROR and a message
+        """
+        if opcode not in REQUESTS:
+            return (ERROR, 'ERROR unknown opcode %d' % opcode)
+        (name, layout) = REQUESTS[opcode]
+        if len(body) < layout.size:
+            return (ERROR, 'ERROR %s request too short' % name)
+        tracing.set_remote_context(body[layout.size:] or None)
+        try:
+            result = self.funcs[name](*layout.unpack_from(body))
+        except Exception as err:
+            logging.exception('binary rpc: %s failed' % name)
+            return (ERROR, 'ERROR %s' % err)
+        if isinstance(result, xmlrpclib.Binary):
+            return (OK, result.data)
+        result = str(result)
+        if result.startswith('ERROR'):
+            return (ERROR, result)
+        return (OK, result)
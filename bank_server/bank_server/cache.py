@@ -0,0 +1,161 @@
+""" Cache
+Bounded LRU cache for per-card objects the bank would otherwise rebuild from
+the database on every request (e.g. crypto.Verifier for a card's pk), and
+the read-through key caches the bank and admin interface share."""
+
+import threading
+from collections import OrderedDict
+
+import crypto
+
+
+class LRUCache(object):
+    """
+    Thread-safe LRU cache holding at most capacity entries
+
+    Loads that race with an invalidation must not put a stale value back,
+    so loaders read generation() before going to the database and pass it
+    to put(), which drops the value if anything was invalidated meanwhile.
+
+    Args:
+        capacity (int): Maximum number of entries
+    """
+
+    def __init__(self, capacity):
+        super(LRUCache, self).__init__()
+        self.capacity = capacity
+        self.entries = OrderedDict()
+        self.lock = threading.Lock()
+        self.invalidations = 0
+
+    def __len__(self):
+        return len(self.entries)
+
+    def generation(self):
+        """Returns a token to pass to put() for a value about to be loaded"""
+        return self.invalidations
+
+    def get(self, key):
+        """Returns the cached value for key and marks it recently used, None if absent"""
+        with self.lock:
+            value = self.entries.pop(key, None)
+            if value is not None:
+                self.entries[key] = value
+            return value
+
+    def put(self, key, value, generation=None):
+        """
+        Caches value for key, evicting the least recently used entry if full
+
+        Args:
+            generation (int, optional): generation() from before value was
+                loaded. The value is dropped if an invalidation happened since
+        """
+        with self.lock:
+            if generation is not None and generation != self.invalidations:
+                return
+            self.entries.pop(key, None)
+            self.entries[key] = value
+            if len(self.entries) > self.capacity:
+                self.entries.popitem(last=False)
+
+    def invalidate(self, key):
+        """Drops key, e.g. after the value it was built from changed"""
+        with self.lock:
+            self.invalidations += 1
+            self.entries.pop(key, None)
+
+
+class KeyCache(object):
+    """
+    Read-through cache of crypto objects built from keys stored in the database
+
+    Args:
+        capacity (int): Maximum number of entries
+        build (callable): Turns a key read from the database into the
+            object to cache
+    """
+
+    def __init__(self, capacity, build):
+        super(KeyCache, self).__init__()
+        self.entries = LRUCache(capacity)
+        self.build = build
+        self.lock = threading.Lock()
+        self.hits = 0
+        self.misses = 0
+
+    def get(self, key, load):
+        """
+        Returns the object for key, loading and building it on a miss
+
+        Args:
+            load (callable): Reads key's value from the database, None if absent
+
+        Returns:
+            The cached object, or None if load found nothing
+        """
+        value = self.entries.get(key)
+        with self.lock:
+            if value is not None:
+                self.hits += 1
+                return value
+            self.misses += 1
+
+        generation = self.entries.generation()
+        raw = load(key)
+        if raw is None:
+            return None
+        value = self.build(raw)
+        self.entries.put(key, value, generation)
+        return value
+
+    def invalidate(self, key):
+        """Drops key after the value stored for it changed"""
+        self.entries.invalidate(key)
+
+    def warm(self, items):
+        """Fills the cache from (key, value) pairs read from the database"""
+        for key, raw in items:
+            self.entries.put(key, self.build(raw))
+
+    def stats(self):
+        """
+        Returns:
+            dict: hits, misses, invalidations, entries held and capacity
+        """
+        with self.lock:
+            return {'hits': self.hits, 'misses': self.misses,
+                    'invalidations': self.entries.invalidations,
+                    'size': len(self.entries), 'capacity': self.entries.capacity}
+
+
+class KeyCaches(object):
+    """
+    The bank's caches of card and HSM keys. One instance is shared by Bank
+    and AdminBackend so admin writes can invalidate what the bank cached
+
+    Args:
+        config (dict): Loaded config.yaml; sizes come from its cache section
+    """
+
+    CONTEXT = "\0" * 8
+
+    def __init__(self, config):
+        super(KeyCaches, self).__init__()
+        cache_config = config.get('cache', {})
+        # card_id -> crypto.Verifier for the card's current pk
+        self.verifiers = KeyCache(cache_config.get('verifiers', 4096),
+                                  lambda pk: crypto.Verifier(pk, self.CONTEXT))
+        # hsm_id -> crypto.SecretBox holding that HSM's key
+        self.secretboxes = KeyCache(cache_config.get('secretboxes', 1024),
+                                    lambda key: crypto.SecretBox(key, self.CONTEXT))
+        self.warmup = cache_config.get('warmup', False)
+
+    def warm(self, db):
+        """Preloads as many card and HSM keys from db as the caches hold"""
+        self.verifiers.warm(db.get_pks(self.verifiers.entries.capacity))
+        self.secretboxes.warm(db.get_hsm_keys(self.secretboxes.entries.capacity))
+
+    def stats(self):
+        return {'verifiers': self.verifiers.stats(),
+                'secretboxes': self.secretboxes.stats()}
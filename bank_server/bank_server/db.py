@@ -1,28 +1,85 @@
 """ DB
 This module implements an interface to the bank_server database.
-It uses a mutex because both the bank_interface and admin_interface
-need access to database. (sqlite3 does not gurantee concurrent operations)"""
+The database runs in WAL mode and every thread gets its own connection, so
+reads never wait for a lock or a commit. Writes are serialized by a mutex
+shared by the bank_interface and admin_interface, since sqlite3 allows only
+one writer at a time. Balance and pk mutations can instead go through a
+group-commit Journal, see journal.py"""
 
 import sqlite3
 import os
-from datetime import timedelta, datetime
-from binascii import hexlify
+import logging
+import threading
+
+from bank_server.migrations import migrate, LATEST
 
 
 class DB(object):
-    """Implements a Database interface for the bank server and admin interface"""
-    def __init__(self, db_mutex=None, db_init=None, db_path=None):
+    """Implements a Database interface for the bank server and admin interface
+
+    Args:
+        db_mutex (threading.Lock, optional): Writer lock, shared by every DB
+            object writing to the same file
+        db_init (str, optional): SQL script creating schema version 0, run
+            if the database does not exist yet. Migrations then bring any
+            existing database up to date
+        db_path (str): Database file, relative to the working directory
+        journal (Journal, optional): Journal that journaled methods submit
+            to, shared by every DB object writing to the same file
+    """
+    def __init__(self, db_mutex=None, db_init=None, db_path=None, journal=None):
         super(DB, self).__init__()
-        self.db_conn = sqlite3.connect(os.getcwd() + db_path, detect_types=sqlite3.PARSE_DECLTYPES)
+        self.db_path = os.getcwd() + db_path
         self.db_mutex = db_mutex
-        self.cur = self.db_conn.cursor()
-        if db_init and not os.path.isfile(os.getcwd() + db_path):
+        self.journal = journal
+        self.local = threading.local()
+        self.connections = []
+        self.connections_lock = threading.Lock()
+        if db_init and not os.path.isfile(self.db_path):
             self.init_db(os.getcwd() + db_init)
+        # Leave a missing file alone for the DB object that will initialize it
+        if os.path.isfile(self.db_path):
+            version = migrate(self.db_path)
+            if version != LATEST:
+                logging.info('migrated database from schema version %d to %d' % (version, LATEST))
+            # WAL is a property of the file, so this sticks for every connection
+            self.db_conn.execute('PRAGMA journal_mode=WAL;')
+
+    def _thread_state(self):
+        """Returns the calling thread's connection state, connecting on first use"""
+        state = self.local
+        if getattr(state, 'conn', None) is None:
+            # timeout waits out a writer from another process instead of
+            # failing with "database is locked". Transactions are begun
+            # explicitly by lock_db and the journal, since sqlite3's implicit
+            # ones would be committed by the SAVEPOINTs in journaled methods
+            state.conn = sqlite3.connect(self.db_path, timeout=10, detect_types=sqlite3.PARSE_DECLTYPES,
+                                         check_same_thread=False, isolation_level=None)
+            # WAL only needs syncing at checkpoints to stay consistent
+            state.conn.execute('PRAGMA synchronous=NORMAL;')
+            state.cur = state.conn.cursor()
+            with self.connections_lock:
+                self.connections.append(state.conn)
+        return state
+
+    @property
+    def db_conn(self):
+        """Connection owned by the calling thread"""
+        return self._thread_state().conn
+
+    @property
+    def cur(self):
+        """Cursor on the calling thread's connection"""
+        return self._thread_state().cur
 
     def close(self):
-        """close the database connection"""
-        self.db_conn.commit()
-        self.db_conn.close()
+        """close every thread's database connection"""
+        with self.connections_lock:
+            for conn in self.connections:
+                conn.commit()
+                conn.close()
+            self.connections = []
+        self.local = threading.local()
 
     def init_db(self, filepath):
         """initialize database with file at filepath"""
@@ -32,18 +89,82 @@ class DB(object):
         self.db_conn.commit()
 
     def lock_db(func):
-        """function wrapper for functions that require db access"""
+        """function wrapper for functions that write to the db
+
+        The whole call is one transaction. BEGIN IMMEDIATE takes sqlite's
+        write lock before the first read, so what the function reads cannot
+        change under it before it commits
+        """
         def func_wrap(self, *args):
-            """acquire and release dbMuted if available"""
+            """hold the writer lock if available and commit on success"""
             if self.db_mutex:
                 self.db_mutex.acquire()
-            result = func(self, *args)
-            self.db_conn.commit()
-            if self.db_mutex:
-                self.db_mutex.release()
+            try:
+                self.db_conn.execute('BEGIN IMMEDIATE;')
+                result = func(self, *args)
+                self.db_conn.commit()
+                return result
+            except:
+                self.db_conn.rollback()
+                raise
+            finally:
+                if self.db_mutex:
+                    self.db_mutex.release()
+        return func_wrap
+
+    # names in a class body aren't visible to functions defined in it, so
+    # lock_db is bound as a default
+    def journaled(func, lock_db=lock_db):
+        """function wrapper for the balance and pk mutations
+
+        With a journal the call is handed to its committer thread, and
+        returns once the batch it was committed in is durable. Without one
+        it is a lock_db transaction of its own. Either way a False result
+        undoes whatever the function wrote
+        """
+        def applied(self, *args):
+            """run func in a savepoint, for apply()"""
+            self.cur.execute('SAVEPOINT mutation;')
+            try:
+                result = func(self, *args)
+            except:
+                self.cur.execute('ROLLBACK TO mutation;')
+                self.cur.execute('RELEASE mutation;')
+                raise
+            if not result:
+                self.cur.execute('ROLLBACK TO mutation;')
+            self.cur.execute('RELEASE mutation;')
             return result
+
+        locked = lock_db(applied)
+
+        def func_wrap(self, *args):
+            """submit to the journal if there is one"""
+            if self.journal is None:
+                return locked(self, *args)
+            return self.journal.submit(func.__name__, args)
+        func_wrap.__name__ = func.__name__
+        func_wrap.applied = applied
         return func_wrap
 
+    def apply(self, op, args):
+        """
+        Runs journaled method op in the current transaction, for the
+        journal's committer
+
+        Returns:
+            The method's result. Its writes are undone if that is False
+        """
+        return getattr(type(self), op).applied(self, *args)
+
+    def read_db(func):
+        """function wrapper for functions that only read from the db
+
+        Reads run outside of any transaction on the thread's own connection,
+        so they see the last committed state without taking the writer lock
+        """
+        return func
+
     def modify(self, statement, param):
         """reduce duplicate code"""
         try:
@@ -56,7 +177,7 @@ class DB(object):
     # BANK INTERFACE FUNCTIONS #
     ############################
 
-    @lock_db
+    @read_db
     def user_exists(self, name):
         """
         Returns true iff the name exists in the db
@@ -69,7 +190,7 @@ class DB(object):
 
         return True
 
-    @lock_db
+    @read_db
     def card_exists(self, card_id):
         """
         Returns true iff the card_id exists in the db
@@ -82,25 +203,12 @@ class DB(object):
 
         return True
 
-    @lock_db
-    def check_expired_and_update_nonce(self, card_id, nonce):
-        res = self.get_nonce_data(card_id)
-        if res is not None: #If this isnt' the first nocne
-            (_, timestamp, used) = res
-
-            #if card has unused nonce that hasn't expired, return error
-            if not used and self.check_timestamp_valid(timestamp):
-                return False
-
-        return self.modify("UPDATE cards SET nonce=(?), used=0, timestamp=DATETIME('now','localtime') WHERE card_id=(?);", 
-                        (sqlite3.Binary(nonce), card_id,))
-
-    @lock_db
+    @journaled
     def update_pk(self, card_id, new_pk):
         return self.modify("UPDATE cards SET pk=(?) WHERE card_id=(?);", 
             (sqlite3.Binary(new_pk), card_id,))
 
-    @lock_db
+    @read_db
     def get_hsm_key(self, hsm_id):
         self.cur.execute('SELECT hsm_key FROM atms WHERE hsm_id = (?);', (hsm_id,))
         
@@ -110,61 +218,26 @@ class DB(object):
 
         return result[0]
 
-    @lock_db
+    @journaled
     def do_withdrawal(self, card_id, hsm_id, amount):
-        self.cur.execute('SELECT balance FROM cards WHERE card_id = (?);', (card_id,))
-        balance = self.cur.fetchone()
-        if balance == None:
-            return False
-        balance = balance[0]
-
-        self.cur.execute('SELECT num_bills FROM atms WHERE hsm_id = (?);', (hsm_id,))
-        hsm_balance = self.cur.fetchone()
-        if hsm_balance == None:
-            return False
-        hsm_balance = hsm_balance[0]
-
-        if amount > balance:
-            return False
-
-        if amount > hsm_balance:
-            return False
-
-        balance -= amount
-        hsm_balance -= amount
-
-        if not self.modify("UPDATE cards SET balance=(?) WHERE card_id=(?)", (balance, card_id,)):
+        """
+        Takes amount from the card's balance and the atm's bills. Each UPDATE
+        checks its own row, so no other writer can slip in between a check
+        and a write
+        """
+        self.cur.execute('UPDATE cards SET balance = balance - (?) WHERE card_id = (?) AND balance >= (?);',
+                         (amount, card_id, amount))
+        if self.cur.rowcount != 1:
             return False
 
-        if not self.modify("UPDATE atms SET num_bills=(?) WHERE hsm_id=(?)", (hsm_balance, hsm_id,)):
+        self.cur.execute('UPDATE atms SET num_bills = num_bills - (?) WHERE hsm_id = (?) AND num_bills >= (?);',
+                         (amount, hsm_id, amount))
+        if self.cur.rowcount != 1:
             return False
 
         return True
 
-    @lock_db
-    def read_set_nonce_used(self, card_id, nonce):
-        res = self.get_nonce_data(card_id)
-        if res is None:
-            print "res was none"
-            return False
-        (db_nonce, timestamp, used) = res
-
-        if used:
-            print "nonce was already used"
-            return False
-
-        if str(db_nonce) != str(nonce):
-            print "nonce was wrong nonce"
-            print hexlify(nonce), hexlify(db_nonce)
-            return False
-
-        if not self.check_timestamp_valid(timestamp):
-            print "timestamp is expired"
-            return False
-
-        return self.modify("UPDATE cards SET used=1 WHERE card_id=(?);", (card_id,))
-
-    @lock_db
+    @read_db
     def get_pk(self, card_id):
         self.cur.execute('SELECT pk FROM cards WHERE card_id = (?);', (card_id,))
         
@@ -174,8 +247,19 @@ class DB(object):
 
         return result[0]
 
-    @lock_db
-    def set_first_pk(self, card_id, pk):
+    @read_db
+    def get_pks(self, limit):
+        """(card_id, pk) for up to limit cards that have a pk, to warm caches"""
+        self.cur.execute('SELECT card_id, pk FROM cards WHERE pk IS NOT NULL LIMIT (?);', (limit,))
+        return self.cur.fetchall()
+
+    @read_db
+    def get_hsm_keys(self, limit):
+        """(hsm_id, hsm_key) for up to limit atms, to warm caches"""
+        self.cur.execute('SELECT hsm_id, hsm_key FROM atms LIMIT (?);', (limit,))
+        return self.cur.fetchall()
+
+    def _set_first_pk(self, card_id, pk):
         #check that card exists and has null pk
         self.cur.execute('SELECT EXISTS(SELECT 1 FROM cards WHERE card_id = (?) AND pk IS NULL LIMIT 1);', (card_id,))
         
@@ -187,7 +271,15 @@ class DB(object):
             (sqlite3.Binary(pk), card_id,))
 
     @lock_db
-    def set_initial_num_bills(self, hsm_id, num_bills):
+    def set_first_pk(self, card_id, pk):
+        return self._set_first_pk(card_id, pk)
+
+    @lock_db
+    def set_first_pk_batch(self, items):
+        """set first pks for a list of (card_id, pk) in one commit"""
+        return [self._set_first_pk(card_id, pk) for card_id, pk in items]
+
+    def _set_initial_num_bills(self, hsm_id, num_bills):
         #check that card exists and has null pk
         self.cur.execute('SELECT EXISTS(SELECT 1 FROM atms WHERE hsm_id = (?) AND num_bills IS NULL LIMIT 1);', (hsm_id,))
         
@@ -200,6 +292,15 @@ class DB(object):
             (num_bills, hsm_id,))
 
     @lock_db
+    def set_initial_num_bills(self, hsm_id, num_bills):
+        return self._set_initial_num_bills(hsm_id, num_bills)
+
+    @lock_db
+    def set_initial_num_bills_batch(self, items):
+        """set initial bill counts for a list of (hsm_id, num_bills) in one commit"""
+        return [self._set_initial_num_bills(hsm_id, num_bills) for hsm_id, num_bills in items]
+
+    @read_db
     def get_balance(self, card_id):
         self.cur.execute('SELECT balance FROM cards WHERE card_id = (?);', (card_id,))
         
@@ -209,29 +310,6 @@ class DB(object):
 
         return result[0]
 
-
-##########
-
-    def get_nonce_data(self, card_id):
-        self.cur.execute('SELECT nonce, timestamp, used FROM cards WHERE card_id = (?);', (card_id,))
-        (nonce, timestamp, used) = self.cur.fetchone()
-
-        if nonce == None or timestamp == None or used == None:
-            return None
-
-        return (nonce, timestamp, used)
-
-    def check_timestamp_valid(self, timestamp):
-        """
-        Check if the timestamp is more than 4 seconds old (expired)
-        """
-        if timestamp + timedelta(seconds=5) < datetime.now():
-            print "timestamp not valid"
-            return False
-        else:
-            print "timestamp valid"
-            return True
-
 ###############################################################
     #############################
     # ADMIN INTERFACE FUNCTIONS #
@@ -258,7 +336,7 @@ class DB(object):
 
         return self.modify('INSERT INTO atms(hsm_id, hsm_key) values (?,?);', (hsm_id, sqlite3.Binary(hsm_key),))
 
-    @lock_db
+    @read_db
     def admin_get_balance(self, account_name):
         """get balance of account: card_id
 
@@ -271,7 +349,7 @@ class DB(object):
             return None
         return result[0]
 
-    @lock_db
+    @journaled
     def admin_set_balance(self, account_name, balance):
         """set balance of account: card_id
 
@@ -1,3 +1,4 @@
+/* Schema version 0. migrations.py brings it up to date when the bank starts */
 DROP TABLE IF EXISTS cards;
 DROP TABLE IF EXISTS atms;
 
@@ -0,0 +1,299 @@
+""" Journal
+Append-only, group-committed log of the bank's balance and pk mutations.
+Request threads hand their mutation to a committer thread and wait. The
+committer applies every mutation waiting at that moment to sqlite in one
+transaction, appends the ones that took effect to the journal, fsyncs the
+journal once for the whole batch and only then commits and answers the
+requests. A mutation is acknowledged only once it is durable, and fsyncs
+are paid per batch instead of per request.
+
+sqlite itself is not synced on commit (see DB), so after a crash it may be
+missing the last batches. Every batch also records its last sequence number
+in the journal_state table, and on startup the journal records past it are
+applied again. The journal is emptied whenever a checkpoint has made
+everything in it durable in the database file.
+
+Each record is a header (payload length, crc32, sequence number) followed
+by a JSON payload [op, args]. str args are base64 encoded, and unicode
+args (account names from XML-RPC) are left as JSON strings, so each comes
+back as the type it went in as. A record cut
+short by a crash fails its length or crc check and ends the journal."""
+
+import base64
+import binascii
+import json
+import logging
+import os
+import struct
+import threading
+import Queue
+
+RECORD_HEADER = struct.Struct('>IIQ')
+
+
+def encode_record(seq, op, args):
+    """Returns the journal record for mutation op(*args)"""
+    payload = json.dumps([op, [{'b64': base64.b64encode(arg)} if isinstance(arg, str) else arg
+                               for arg in args]])
+    crc = binascii.crc32(struct.pack('>Q', seq) + payload) & 0xffffffff
+    return RECORD_HEADER.pack(len(payload), crc, seq) + payload
+
+
+def read_records(data):
+    """
+    Parses journal records
+
+    Returns:
+        (list, int): (seq, op, args) for each intact record, and the length
+            of data they take up. Anything after that is a torn write
+    """
+    records = []
+    offset = 0
+    while offset + RECORD_HEADER.size <= len(data):
+        (length, crc, seq) = RECORD_HEADER.unpack_from(data, offset)
+        payload = data[offset + RECORD_HEADER.size:offset + RECORD_HEADER.size + length]
+        if len(payload) < length or binascii.crc32(struct.pack('>Q', seq) + payload) & 0xffffffff != crc:
+            break
+        (op, args) = json.loads(payload)
+        op = str(op)
+        args = [base64.b64decode(arg['b64']) if isinstance(arg, dict) else arg for arg in args]
+        records.append((seq, op, args))
+        offset += RECORD_HEADER.size + length
+    return (records, offset)
+
+
+class Mutation(object):
+    """A submitted mutation and, once its batch is done, its result"""
+
+    def __init__(self, op, args):
+        super(Mutation, self).__init__()
+        self.op = op
+        self.args = args
+        self.result = False
+        self.error = None
+        self.done = threading.Event()
+
+
+class Journal(object):
+    """
+    Group-commit journal in front of a DB
+
+    Replays any records sqlite is missing and starts the committer thread.
+    DB objects created with journal=this submit their journaled methods
+    here.
+
+    Args:
+        path (str): Journal file
+        db (DB): Database the journal applies mutations to. Its db_mutex is
+            held while a batch is applied, so writers outside the journal
+            never interleave with one
+        max_batch (int, optional): Most mutations committed in one batch
+        max_bytes (int, optional): Journal size that triggers a checkpoint
+    """
+
+    def __init__(self, path, db, max_batch=256, max_bytes=4 * 1024 * 1024):
+        super(Journal, self).__init__()
+        self.path = path
+        self.db = db
+        self.max_batch = max_batch
+        self.max_bytes = max_bytes
+        self.mutations = Queue.Queue()
+        # closed is set and the stop sentinel queued under this lock, so no
+        # mutation can queue up behind the sentinel and wait forever
+        self.closed = False
+        self.close_lock = threading.Lock()
+        self.counters = {'batches': 0, 'mutations': 0, 'max_batch': 0, 'checkpoints': 0}
+        self.stats_lock = threading.Lock()
+        self.seq = self._recover()
+        self.file = open(self.path, 'ab')
+        self.committer = threading.Thread(target=self._run, name='journal committer')
+        self.committer.daemon = True
+        self.committer.start()
+
+    def _size(self):
+        return os.fstat(self.file.fileno()).st_size
+
+    def _lock(self):
+        if self.db.db_mutex:
+            self.db.db_mutex.acquire()
+
+    def _unlock(self):
+        if self.db.db_mutex:
+            self.db.db_mutex.release()
+
+    def _applied_seq(self):
+        return self.db.db_conn.execute('SELECT seq FROM journal_state;').fetchone()[0]
+
+    def _recover(self):
+        """
+        Applies the journal records sqlite is missing, then checkpoints
+
+        Returns:
+            int: Last sequence number used
+        """
+        data = ''
+        if os.path.isfile(self.path):
+            with open(self.path, 'rb') as journal_file:
+                data = journal_file.read()
+        (records, length) = read_records(data)
+        if length < len(data):
+            logging.warning('journal: dropping %d bytes of torn record at the end of %s'
+                            % (len(data) - length, self.path))
+        self._lock()
+        try:
+            applied = self._applied_seq()
+            missing = [record for record in records if record[0] > applied]
+            if missing:
+                conn = self.db.db_conn
+                conn.execute('BEGIN IMMEDIATE;')
+                try:
+                    for (seq, op, args) in missing:
+                        if not self.db.apply(op, args):
+                            logging.error('journal: replaying record %d (%s) had no effect' % (seq, op))
+                    conn.execute('UPDATE journal_state SET seq = (?);', (missing[-1][0],))
+                    conn.commit()
+                except:
+                    conn.rollback()
+                    raise
+                logging.info('journal: replayed %d records up to %d' % (len(missing), missing[-1][0]))
+            seq = max([applied] + [record[0] for record in records])
+        finally:
+            self._unlock()
+        # the replayed records, and any torn tail, can go once sqlite has them durably
+        if not self._checkpoint() and length < len(data):
+            with open(self.path, 'r+b') as journal_file:
+                journal_file.truncate(length)
+                os.fsync(journal_file.fileno())
+        return seq
+
+    def submit(self, op, args):
+        """
+        Queues mutation op(*args) for the next batch and waits until that
+        batch is durable
+
+        Returns:
+            The mutation's result, False if its batch failed to commit
+
+        Raises:
+            RuntimeError: The journal has been closed
+        """
+        mutation = Mutation(op, args)
+        with self.close_lock:
+            if self.closed:
+                raise RuntimeError('journal: %s submitted after close' % op)
+            self.mutations.put(mutation)
+        mutation.done.wait()
+        if mutation.error is not None:
+            raise mutation.error
+        return mutation.result
+
+    def stats(self):
+        """
+        Returns:
+            dict: batches committed, mutations in them, the largest batch
+                and checkpoints taken
+        """
+        with self.stats_lock:
+            return dict(self.counters)
+
+    def _run(self):
+        """Committer loop: commits whatever is queued as one batch, until it pulls None"""
+        while True:
+            batch = [self.mutations.get()]
+            # everything that queued up during the last fsync joins this batch
+            while batch[-1] is not None and len(batch) < self.max_batch:
+                try:
+                    batch.append(self.mutations.get_nowait())
+                except Queue.Empty:
+                    break
+            stop = batch[-1] is None
+            if stop:
+                batch.pop()
+            if batch:
+                self._commit(batch)
+            if stop:
+                return
+
+    def _commit(self, batch):
+        """Applies, journals and commits a batch, then wakes its submitters"""
+        seq = self.seq
+        offset = self._size()
+        self._lock()
+        conn = self.db.db_conn
+        try:
+            conn.execute('BEGIN IMMEDIATE;')
+            records = []
+            for mutation in batch:
+                try:
+                    mutation.result = self.db.apply(mutation.op, mutation.args)
+                except Exception as err:
+                    # apply() has already undone whatever the mutation wrote
+                    mutation.error = err
+                    continue
+                if mutation.result:
+                    seq += 1
+                    records.append(encode_record(seq, mutation.op, mutation.args))
+            if records:
+                self.file.write(''.join(records))
+                self.file.flush()
+                os.fsync(self.file.fileno())
+                conn.execute('UPDATE journal_state SET seq = (?);', (seq,))
+            conn.commit()
+            self.seq = seq
+        except Exception:
+            logging.exception('journal: batch of %d failed to commit' % len(batch))
+            conn.rollback()
+            # the records were never acknowledged, so drop them from the journal
+            self.file.truncate(offset)
+            for mutation in batch:
+                mutation.result = False
+                mutation.error = None
+        finally:
+            self._unlock()
+            with self.stats_lock:
+                self.counters['batches'] += 1
+                self.counters['mutations'] += len(batch)
+                self.counters['max_batch'] = max(self.counters['max_batch'], len(batch))
+            for mutation in batch:
+                mutation.done.set()
+        # a failed checkpoint leaves the journal for the next one to empty,
+        # and must not take the committer down with it
+        try:
+            if self._size() >= self.max_bytes:
+                self._checkpoint()
+        except Exception:
+            logging.exception('journal: checkpoint after batch failed')
+
+    def _checkpoint(self):
+        """
+        Writes the WAL back into the database file, which sqlite then fsyncs,
+        and empties the journal. Passive, so a reader holding an old snapshot
+        leaves the journal for a later checkpoint instead of stalling writers
+
+        Returns:
+            bool: True if the journal was emptied
+        """
+        self._lock()
+        try:
+            (busy, log, checkpointed) = self.db.db_conn.execute('PRAGMA wal_checkpoint(PASSIVE);').fetchone()
+            if busy or log != checkpointed:
+                return False
+            # appends go to the end of the file wherever that is, so
+            # self.file can carry on writing after this
+            with open(self.path, 'ab') as journal_file:
+                journal_file.truncate(0)
+                os.fsync(journal_file.fileno())
+        finally:
+            self._unlock()
+        with self.stats_lock:
+            self.counters['checkpoints'] += 1
+        return True
+
+    def close(self):
+        """Commits everything already submitted, stops the committer and checkpoints"""
+        with self.close_lock:
+            self.closed = True
+            self.mutations.put(None)
+        self.committer.join()
+        self._checkpoint()
+        self.file.close()
@@ -0,0 +1,80 @@
+""" Migrations
+Ordered schema migrations for the bank database. ectf_db.sql creates
+schema version 0 and MIGRATIONS[i] takes the schema from version i to
+version i + 1. The current version is kept in the schema_version table, and
+DB applies whatever is missing when it starts up."""
+
+import sqlite3
+
+MIGRATIONS = [
+    # 1: card_id gets a unique index for the WHERE card_id = ? lookups on
+    # every request (the primary key starts with account_name, so it can't
+    # serve them), pk becomes a blob column, and the nonce, used and
+    # timestamp columns go since nonces are kept in NonceStore
+    [
+        '''CREATE TABLE cards_v1 (
+            account_name    text        NOT NULL CHECK (LENGTH(account_name) <= 1024),
+            card_id         text        NOT NULL CHECK (LENGTH(card_id) == 36),
+            balance         integer     NOT NULL DEFAULT (0) CHECK (balance >= 0),
+
+            pk              blob        DEFAULT NULL CHECK (LENGTH(pk) == 32),
+
+            primary key (account_name, card_id)
+        );''',
+        'INSERT INTO cards_v1 (account_name, card_id, balance, pk) '
+        'SELECT account_name, card_id, balance, pk FROM cards;',
+        'DROP TABLE cards;',
+        'ALTER TABLE cards_v1 RENAME TO cards;',
+        'CREATE UNIQUE INDEX cards_card_id ON cards (card_id);',
+    ],
+    # 2: sequence number of the last journal record applied, see journal.py
+    [
+        'CREATE TABLE journal_state (seq integer NOT NULL);',
+        'INSERT INTO journal_state (seq) VALUES (0);',
+    ],
+]
+
+LATEST = len(MIGRATIONS)
+
+
+def schema_version(conn):
+    """Returns the schema version of the database conn is connected to"""
+    try:
+        row = conn.execute('SELECT version FROM schema_version;').fetchone()
+    except sqlite3.OperationalError:
+        return 0
+    return row[0] if row else 0
+
+
+def migrate(path):
+    """
+    Brings the database at path up to the latest schema version
+
+    All pending migrations run in one BEGIN IMMEDIATE transaction, so a
+    failed migration leaves the database untouched and two processes
+    starting at once cannot both apply the same one.
+
+    Returns:
+        int: Schema version the database had before migrating
+    """
+    # sqlite3 in Python 2 commits before DDL statements on its own, so manage
+    # the transaction by hand in autocommit mode
+    conn = sqlite3.connect(path, timeout=10, isolation_level=None)
+    try:
+        conn.execute('BEGIN IMMEDIATE;')
+        try:
+            version = schema_version(conn)
+            for statements in MIGRATIONS[version:]:
+                for statement in statements:
+                    conn.execute(statement)
+            if version < LATEST:
+                conn.execute('CREATE TABLE IF NOT EXISTS schema_version (version integer NOT NULL);')
+                conn.execute('DELETE FROM schema_version;')
+                conn.execute('INSERT INTO schema_version (version) VALUES (?);', (LATEST,))
+            conn.execute('COMMIT;')
+        except:
+            conn.execute('ROLLBACK;')
+            raise
+    finally:
+        conn.close()
+    return version
@@ -0,0 +1,129 @@
+""" Nonce Store
+In-memory table of the nonces the bank has handed out. Nonces live for a few
+seconds and mean nothing after a restart (the ATM just asks for a new one),
+so keeping them out of sqlite saves a write and a commit per transaction."""
+
+import ctypes
+import ctypes.util
+import os
+import threading
+import time
+
+
+def _monotonic_clock():
+    """Returns a function reading a clock that wall clock changes don't move"""
+    if hasattr(time, 'monotonic'):
+        return time.monotonic
+
+    class timespec(ctypes.Structure):
+        _fields_ = [('tv_sec', ctypes.c_long), ('tv_nsec', ctypes.c_long)]
+
+    CLOCK_MONOTONIC = 1
+    libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+    clock_gettime = libc.clock_gettime
+    clock_gettime.argtypes = [ctypes.c_int, ctypes.POINTER(timespec)]
+
+    def monotonic():
+        ts = timespec()
+        if clock_gettime(CLOCK_MONOTONIC, ctypes.byref(ts)) != 0:
+            errno = ctypes.get_errno()
+            raise OSError(errno, os.strerror(errno))
+        return ts.tv_sec + ts.tv_nsec * 1e-9
+    return monotonic
+
+monotonic = _monotonic_clock()
+
+
+class NonceStore(object):
+    """
+    Thread-safe table of at most one outstanding nonce per card
+
+    Expired entries are evicted by a hashed timer wheel: slots buckets of
+    tick seconds each, with an entry filed under the bucket its expiry falls
+    in. Every call first sweeps the buckets whose time has passed, so
+    eviction costs a little per call rather than a scan of the table or a
+    background thread.
+
+    Args:
+        lifetime (float, optional): Seconds a nonce stays valid
+        slots (int, optional): Buckets in the timer wheel
+        clock (callable, optional): Returns monotonic seconds, for tests
+    """
+
+    def __init__(self, lifetime=5, slots=64, clock=monotonic):
+        super(NonceStore, self).__init__()
+        self.lifetime = float(lifetime)
+        self.clock = clock
+        # one turn of the wheel spans a lifetime, so most buckets hold
+        # entries due this turn and a sweep rarely meets later ones
+        self.tick = self.lifetime / slots
+        self.wheel = [set() for _ in range(slots)]
+        self.entries = {}
+        self.lock = threading.Lock()
+        self.swept = self._tick_of(self.clock())
+
+    def __len__(self):
+        return len(self.entries)
+
+    def _tick_of(self, t):
+        return int(t / self.tick)
+
+    def _sweep(self, now):
+        """Evicts expired entries from the buckets whose ticks have passed"""
+        # entries are filed under the tick they expire in, so a bucket is
+        # only fully due once that tick is over. After a long idle spell one
+        # turn of the wheel still visits every bucket
+        last = self._tick_of(now) - 1
+        for t in range(max(self.swept + 1, last - len(self.wheel) + 1), last + 1):
+            bucket = self.wheel[t % len(self.wheel)]
+            for card_id in [c for c in bucket if self.entries[c][1] <= now]:
+                bucket.discard(card_id)
+                del self.entries[card_id]
+        self.swept = max(self.swept, last)
+
+    def _drop(self, card_id):
+        (_, expiry) = self.entries.pop(card_id)
+        self.wheel[self._tick_of(expiry) % len(self.wheel)].discard(card_id)
+
+    def issue(self, card_id, nonce):
+        """
+        Records nonce as the card's outstanding nonce
+
+        Returns:
+            bool: False if the card already has an unexpired nonce
+        """
+        with self.lock:
+            now = self.clock()
+            self._sweep(now)
+            entry = self.entries.get(card_id)
+            if entry is not None:
+                if entry[1] > now:
+                    return False
+                self._drop(card_id)
+            expiry = now + self.lifetime
+            self.entries[card_id] = (nonce, expiry)
+            self.wheel[self._tick_of(expiry) % len(self.wheel)].add(card_id)
+            return True
+
+    def check(self, card_id, nonce):
+        """Returns whether nonce is the card's unexpired outstanding nonce, without using it up"""
+        with self.lock:
+            entry = self.entries.get(card_id)
+            return entry is not None and entry[0] == nonce and entry[1] > self.clock()
+
+    def consume(self, card_id, nonce):
+        """
+        Uses up the card's outstanding nonce if it matches and hasn't expired.
+        Of any number of concurrent calls with the same nonce, one succeeds
+
+        Returns:
+            bool: True if nonce was valid and is now used
+        """
+        with self.lock:
+            now = self.clock()
+            self._sweep(now)
+            entry = self.entries.get(card_id)
+            if entry is None or entry[0] != nonce or entry[1] <= now:
+                return False
+            self._drop(card_id)
+            return True
@@ -0,0 +1,220 @@
+""" Server
+Servers that hand accepted connections to a fixed pool of worker threads,
+so one slow request (a signature check, a sqlite commit) no longer holds up
+every other ATM. Connections that arrive while the pool's queue is full are
+refused instead of piling up. A connection may stay open for further
+requests, but hands its worker back as soon as other connections are
+waiting for one."""
+
+import logging
+import select
+import signal
+import socket
+import threading
+import Queue
+
+from SocketServer import TCPServer
+from SimpleXMLRPCServer import SimpleXMLRPCServer
+from bank_server import tracing
+from bank_server.nonce_store import monotonic
+
+
+class WorkerPoolMixIn:
+    """
+    Mix-in for a TCPServer that serves connections on a bounded worker pool
+
+    serve_forever() only accepts connections; workers run the handlers.
+    shutdown() stops accepting, and server_close() then lets the workers
+    finish every connection already queued before it returns. Subclasses
+    call start_workers() from __init__ and set busy_response, the bytes
+    sent to a connection refused because the queue is full.
+    """
+
+    busy_response = ''
+    # how often an idle kept-alive connection checks for waiting connections
+    idle_poll = 0.05
+
+    def start_workers(self, workers, queue_depth, request_timeout=None, idle_timeout=None):
+        """
+        Args:
+            workers (int): Number of worker threads
+            queue_depth (int): Accepted connections that may wait for a worker
+            request_timeout (float, optional): Socket timeout in seconds for a
+                connection, so a stalled client cannot hold a worker forever
+            idle_timeout (float, optional): Seconds a connection may be kept
+                open waiting for its next request. See wait_for_request()
+        """
+        self.request_timeout = request_timeout
+        self.idle_timeout = idle_timeout or 0
+        # bounded by counting in-flight connections rather than by the queue
+        # itself, which can look full before idle workers have woken up
+        self.capacity = workers + queue_depth
+        self.requests = Queue.Queue()
+        self.stats_lock = threading.Lock()
+        self.counters = {'accepted': 0, 'rejected': 0, 'completed': 0, 'failed': 0,
+                         'reused': 0, 'active': 0, 'in_flight': 0, 'max_in_flight': 0}
+        self.workers = []
+        for i in range(workers):
+            worker = threading.Thread(target=self._work, name='%s-worker-%d' % (self.name, i))
+            worker.daemon = True
+            worker.start()
+            self.workers.append(worker)
+
+    def _count(self, name, delta=1):
+        with self.stats_lock:
+            self.counters[name] += delta
+
+    def stats(self):
+        """
+        Returns connection counters
+
+        Returns:
+            dict: accepted, rejected (queue full), completed and failed
+                connections, requests served on reused connections, plus
+                active workers, connections in flight (active or queued) and
+                the most ever in flight
+        """
+        with self.stats_lock:
+            return dict(self.counters)
+
+    def process_request(self, request, client_address):
+        """Queues an accepted connection for the pool, or refuses it if full"""
+        if self.request_timeout is not None:
+            request.settimeout(self.request_timeout)
+        with self.stats_lock:
+            full = self.counters['in_flight'] >= self.capacity
+            if full:
+                self.counters['rejected'] += 1
+            else:
+                self.counters['accepted'] += 1
+                self.counters['in_flight'] += 1
+                self.counters['max_in_flight'] = max(self.counters['max_in_flight'],
+                                                     self.counters['in_flight'])
+        if full:
+            logging.warning('%s busy, refusing %s:%d' % ((self.name,) + client_address))
+            try:
+                request.sendall(self.busy_response)
+            except socket.error:
+                pass
+            self.shutdown_request(request)
+            return
+        self.requests.put((request, client_address))
+
+    def wait_for_request(self, request):
+        """
+        Waits for the next request on a connection kept open after serving one
+
+        An idle connection holds its worker, so it is given up as soon as
+        another connection is queued for a worker, as well as after
+        idle_timeout seconds. The client then reconnects for its next request.
+
+        Waits with select() on the socket, so the handler's rfile must be
+        unbuffered (rbufsize = 0): bytes of a request already read into a
+        buffer would not wake it.
+
+        Args:
+            request (socket): The connection
+
+        Returns:
+            bool: True if a request has arrived, False to close the connection
+        """
+        ready = False
+        deadline = monotonic() + self.idle_timeout
+        while not ready and self.requests.empty():
+            remaining = deadline - monotonic()
+            if remaining <= 0:
+                break
+            ready = bool(select.select([request], [], [], min(remaining, self.idle_poll))[0])
+        if ready:
+            self._count('reused')
+        return ready
+
+    def _work(self):
+        """Worker loop: serves queued connections until it pulls None"""
+        while True:
+            item = self.requests.get()
+            if item is None:
+                return
+            request, client_address = item
+            self._count('active')
+            try:
+                self.finish_request(request, client_address)
+                self._count('completed')
+            except Exception:
+                self._count('failed')
+                self.handle_error(request, client_address)
+            finally:
+                self.shutdown_request(request)
+                with self.stats_lock:
+                    self.counters['active'] -= 1
+                    self.counters['in_flight'] -= 1
+
+    def server_close(self, timeout=None):
+        """
+        Closes the listening socket and waits for the workers to drain the queue
+
+        Args:
+            timeout (float, optional): Seconds to wait for each worker
+        """
+        TCPServer.server_close(self)
+        for _ in self.workers:
+            self.requests.put(None)
+        for worker in self.workers:
+            worker.join(timeout)
+        logging.info('%s stopped: %s' % (self.name, self.stats()))
+
+    def stop_on_signals(self, signums=(signal.SIGTERM, signal.SIGINT)):
+        """
+        Makes the given signals stop serve_forever() instead of killing the
+        process mid-request. Must be called from the main thread
+        """
+        def handler(signum, frame):
+            logging.info('signal %d received, shutting down %s' % (signum, self.name))
+            # shutdown() blocks until serve_forever() returns, and that runs
+            # on the thread this handler interrupted
+            threading.Thread(target=self.shutdown).start()
+
+        for signum in signums:
+            signal.signal(signum, handler)
+
+
+class KeepAliveRequestHandler(tracing.TracingRequestHandler):
+    """
+    XML-RPC request handler that answers in HTTP/1.1 and keeps the
+    connection open for the client's next request, for as long as
+    WorkerPoolMixIn.wait_for_request() allows
+    """
+
+    protocol_version = 'HTTP/1.1'
+    # see WorkerPoolMixIn.wait_for_request()
+    rbufsize = 0
+
+    def handle(self):
+        self.close_connection = 1
+        self.handle_one_request()
+        while not self.close_connection and self.server.wait_for_request(self.connection):
+            self.handle_one_request()
+
+
+class PooledXMLRPCServer(WorkerPoolMixIn, SimpleXMLRPCServer):
+    """
+    SimpleXMLRPCServer serving requests on a bounded worker pool
+
+    Connections are only kept open between requests when requestHandler is
+    a KeepAliveRequestHandler and idle_timeout is set
+
+    Args:
+        addr (tuple): (host, port) to listen on
+        workers, queue_depth, request_timeout, idle_timeout: See start_workers()
+    """
+
+    name = 'bank server'
+    busy_response = ('HTTP/1.0 503 Service Unavailable\r\n'
+                     'Content-Length: 0\r\n'
+                     'Connection: close\r\n\r\n')
+
+    def __init__(self, addr, workers, queue_depth, request_timeout=None, idle_timeout=None, **kwargs):
+        # let the kernel hold as many pending connects as we queue
+        self.request_queue_size = max(queue_depth, 5)
+        SimpleXMLRPCServer.__init__(self, addr, **kwargs)
+        self.start_workers(workers, queue_depth, request_timeout, idle_timeout)
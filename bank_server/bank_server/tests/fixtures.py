@@ -0,0 +1,23 @@
+from unittest import TestCase
+import os, shutil, tempfile
+
+SCHEMA = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'ectf_db.sql')
+
+CARD_ID = '50000000-0000-0000-0000-000000000000'
+HSM_ID = '40000000-0000-0000-0000-000000000000'
+
+
+class DBTestCase(TestCase):
+    """Base for tests that create a bank database, as /bank.db from /init.sql"""
+
+    # DB paths are relative to the working directory, so run each test in a
+    # fresh one
+    def setUp(self):
+        self.cwd = os.getcwd()
+        self.tmp = tempfile.mkdtemp()
+        shutil.copy(SCHEMA, os.path.join(self.tmp, 'init.sql'))
+        os.chdir(self.tmp)
+
+    def tearDown(self):
+        os.chdir(self.cwd)
+        shutil.rmtree(self.tmp)
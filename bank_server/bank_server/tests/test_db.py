@@ -0,0 +1,96 @@
+from bank_server import DB
+from bank_server.migrations import LATEST, schema_version
+from bank_server.tests.fixtures import DBTestCase, CARD_ID, HSM_ID
+import os, sqlite3
+
+
+class TestDB(DBTestCase):
+    def make_db(self):
+        db = DB(db_init='/init.sql', db_path='/bank.db')
+        self.assertTrue(db.admin_create_account('test1', CARD_ID, 10))
+        self.assertTrue(db.admin_create_atm(HSM_ID, 'k' * 32))
+        return db
+
+    def plan(self, db, query, params):
+        rows = db.db_conn.execute('EXPLAIN QUERY PLAN ' + query, params).fetchall()
+        return ' | '.join(str(row[-1]) for row in rows)
+
+    def assertUsesIndex(self, db, query, params, index):
+        plan = self.plan(db, query, params)
+        self.assertIn(index, plan)
+        # sqlite before 3.36 says "SCAN TABLE cards"
+        self.assertNotRegexpMatches(plan, r'SCAN (TABLE )?(cards|atms)')
+
+    def test_fresh_db_is_migrated(self):
+        db = self.make_db()
+        self.assertEqual(schema_version(db.db_conn), LATEST)
+        columns = [row[1] for row in db.db_conn.execute('PRAGMA table_info(cards);')]
+        self.assertEqual(columns, ['account_name', 'card_id', 'balance', 'pk'])
+
+    def test_card_id_lookups_use_index(self):
+        db = self.make_db()
+        for query, params in [
+                ('SELECT EXISTS(SELECT 1 FROM cards WHERE card_id = (?) LIMIT 1);', (CARD_ID,)),
+                ('SELECT pk FROM cards WHERE card_id = (?);', (CARD_ID,)),
+                ('SELECT balance FROM cards WHERE card_id = (?);', (CARD_ID,)),
+                ('UPDATE cards SET pk=(?) WHERE card_id=(?);', (sqlite3.Binary('p' * 32), CARD_ID)),
+                ('UPDATE cards SET balance = balance - (?) WHERE card_id = (?) AND balance >= (?);', (1, CARD_ID, 1))]:
+            self.assertUsesIndex(db, query, params, 'cards_card_id')
+
+    def test_account_name_lookups_use_primary_key(self):
+        db = self.make_db()
+        self.assertUsesIndex(db, 'SELECT balance FROM cards WHERE account_name = (?);', ('test1',),
+                             'sqlite_autoindex_cards_1')
+
+    def test_hsm_id_lookups_use_primary_key(self):
+        db = self.make_db()
+        self.assertUsesIndex(db, 'SELECT hsm_key FROM atms WHERE hsm_id = (?);', (HSM_ID,),
+                             'sqlite_autoindex_atms_1')
+        self.assertUsesIndex(db, 'UPDATE atms SET num_bills = num_bills - (?) WHERE hsm_id = (?) AND num_bills >= (?);',
+                             (1, HSM_ID, 1), 'sqlite_autoindex_atms_1')
+
+    def test_existing_db_keeps_its_data(self):
+        conn = sqlite3.connect(os.path.join(self.tmp, 'bank.db'))
+        conn.executescript(open('init.sql').read())
+        conn.execute("INSERT INTO cards (account_name, card_id, balance, nonce, used, pk) VALUES (?, ?, ?, ?, 0, ?);",
+                     ('test1', CARD_ID, 10, sqlite3.Binary('n' * 32), sqlite3.Binary('p' * 32)))
+        conn.commit()
+        conn.close()
+
+        db = DB(db_path='/bank.db')
+        self.assertEqual(schema_version(db.db_conn), LATEST)
+        self.assertEqual(db.get_balance(CARD_ID), 10)
+        self.assertEqual(str(db.get_pk(CARD_ID)), 'p' * 32)
+        self.assertFalse(db.admin_create_account('test2', CARD_ID, 5))
+
+    def test_migrating_twice_changes_nothing(self):
+        self.make_db().close()
+        db = DB(db_init='/init.sql', db_path='/bank.db')
+        self.assertEqual(schema_version(db.db_conn), LATEST)
+        self.assertEqual(db.get_balance(CARD_ID), 10)
+
+    def test_set_first_pk_batch(self):
+        db = self.make_db()
+        other = '50000000-0000-0000-0000-000000000001'
+        self.assertTrue(db.admin_create_account('test2', other, 5))
+        unknown = '50000000-0000-0000-0000-0000000000ff'
+        # the second pk for CARD_ID is refused once the first is set
+        results = db.set_first_pk_batch([(CARD_ID, 'a' * 32), (unknown, 'b' * 32),
+                                         (other, 'c' * 32), (CARD_ID, 'd' * 32)])
+        self.assertEqual(results, [True, False, True, False])
+        self.assertEqual(str(db.get_pk(CARD_ID)), 'a' * 32)
+        self.assertEqual(str(db.get_pk(other)), 'c' * 32)
+        self.assertEqual(db.set_first_pk_batch([]), [])
+
+    def test_set_initial_num_bills_batch(self):
+        db = self.make_db()
+        other = '40000000-0000-0000-0000-000000000001'
+        self.assertTrue(db.admin_create_atm(other, 'l' * 32))
+        unknown = '40000000-0000-0000-0000-0000000000ff'
+        # more than 128 bills breaks the CHECK constraint
+        results = db.set_initial_num_bills_batch([(HSM_ID, 128), (unknown, 10),
+                                                  (other, 129), (HSM_ID, 5)])
+        self.assertEqual(results, [True, False, False, False])
+        num_bills = dict(db.db_conn.execute('SELECT hsm_id, num_bills FROM atms;').fetchall())
+        self.assertEqual(num_bills, {HSM_ID: 128, other: None})
+        self.assertEqual(db.set_initial_num_bills_batch([(other, 64)]), [True])
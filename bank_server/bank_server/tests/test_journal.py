@@ -0,0 +1,115 @@
+from bank_server import DB
+from bank_server.journal import Journal, encode_record, read_records
+from bank_server.tests.fixtures import DBTestCase, CARD_ID, HSM_ID
+import os, threading
+
+
+class TestJournal(DBTestCase):
+    def setUp(self):
+        DBTestCase.setUp(self)
+        self.mutex = threading.Lock()
+        db = DB(db_mutex=self.mutex, db_init='/init.sql', db_path='/bank.db')
+        self.assertTrue(db.admin_create_account('test1', CARD_ID, 100))
+        self.assertTrue(db.admin_create_atm(HSM_ID, 'k' * 32))
+        self.assertTrue(db.set_initial_num_bills(HSM_ID, 50))
+        self.journal_path = os.path.join(self.tmp, 'bank.journal')
+
+    def open(self, **kwargs):
+        journal = Journal(self.journal_path, DB(db_mutex=self.mutex, db_path='/bank.db'), **kwargs)
+        return (journal, DB(db_mutex=self.mutex, db_path='/bank.db', journal=journal))
+
+    def test_mutations_go_through_journal(self):
+        (journal, db) = self.open()
+        self.assertTrue(db.do_withdrawal(CARD_ID, HSM_ID, 10))
+        self.assertFalse(db.do_withdrawal(CARD_ID, HSM_ID, 1000))
+        self.assertTrue(db.update_pk(CARD_ID, '\xff' * 32))
+        self.assertTrue(db.admin_set_balance('test1', 70))
+        self.assertFalse(db.admin_set_balance('nobody', 70))
+        self.assertEqual(db.get_balance(CARD_ID), 70)
+        self.assertEqual(str(db.get_pk(CARD_ID)), '\xff' * 32)
+        self.assertEqual(journal.seq, 3)
+        self.assertEqual(journal.stats()['mutations'], 5)
+
+    def test_failed_withdrawal_changes_nothing(self):
+        (journal, db) = self.open()
+        # the card can pay but the atm can't, so the card's update is undone
+        self.assertFalse(db.do_withdrawal(CARD_ID, HSM_ID, 60))
+        self.assertEqual(db.get_balance(CARD_ID), 100)
+
+    def test_concurrent_withdrawals_are_batched(self):
+        (journal, db) = self.open()
+        results = []
+        threads = [threading.Thread(target=lambda: results.append(db.do_withdrawal(CARD_ID, HSM_ID, 1)))
+                   for _ in range(40)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(results.count(True), 40)
+        self.assertEqual(db.get_balance(CARD_ID), 60)
+        self.assertEqual(journal.seq, 40)
+        self.assertLess(journal.stats()['batches'], 40)
+
+    def test_records_missing_from_sqlite_are_replayed(self):
+        (journal, db) = self.open()
+        for _ in range(3):
+            self.assertTrue(db.do_withdrawal(CARD_ID, HSM_ID, 5))
+        # lose the last two commits, as a power cut could, and tear a record
+        db.db_conn.execute('BEGIN IMMEDIATE;')
+        db.db_conn.execute('UPDATE cards SET balance = 95;')
+        db.db_conn.execute('UPDATE atms SET num_bills = 45;')
+        db.db_conn.execute('UPDATE journal_state SET seq = 1;')
+        db.db_conn.commit()
+        with open(self.journal_path, 'ab') as journal_file:
+            journal_file.write('\x00\x00\x00\x30torn')
+
+        (journal, db) = self.open()
+        self.assertEqual(db.get_balance(CARD_ID), 85)
+        self.assertEqual(journal.seq, 3)
+        self.assertEqual(os.path.getsize(self.journal_path), 0)
+        self.assertTrue(db.do_withdrawal(CARD_ID, HSM_ID, 5))
+        self.assertEqual(journal.seq, 4)
+
+    def test_checkpoint_empties_journal(self):
+        (journal, db) = self.open(max_bytes=1)
+        self.assertTrue(db.do_withdrawal(CARD_ID, HSM_ID, 5))
+        # close() waits for the committer, which checkpoints after the batch
+        journal.close()
+        self.assertEqual(os.path.getsize(self.journal_path), 0)
+        # at startup, after the batch and at close
+        self.assertEqual(journal.stats()['checkpoints'], 3)
+        self.assertEqual(DB(db_path='/bank.db').get_balance(CARD_ID), 95)
+
+    def test_failed_checkpoint_keeps_committer_running(self):
+        (journal, db) = self.open(max_bytes=1)
+
+        def fail():
+            raise IOError('disk gone')
+        journal._checkpoint = fail
+        self.assertTrue(db.do_withdrawal(CARD_ID, HSM_ID, 5))
+        self.assertTrue(db.do_withdrawal(CARD_ID, HSM_ID, 5))
+        self.assertEqual(journal.seq, 2)
+
+    def test_submit_after_close_raises(self):
+        (journal, db) = self.open()
+        journal.close()
+        self.assertRaises(RuntimeError, db.do_withdrawal, CARD_ID, HSM_ID, 5)
+        self.assertEqual(DB(db_path='/bank.db').get_balance(CARD_ID), 100)
+
+    def test_records_keep_arg_types(self):
+        args = ['\xff' * 32, u'caf\xe9', 5]
+        (records, length) = read_records(encode_record(7, 'update_pk', args))
+        self.assertEqual(records, [(7, 'update_pk', args)])
+        self.assertEqual([type(arg) for arg in records[0][2]], [str, unicode, int])
+
+    def test_non_ascii_account_is_replayed(self):
+        (journal, db) = self.open()
+        self.assertTrue(db.admin_create_account(u'caf\xe9', '6' * 36, 10))
+        self.assertTrue(db.admin_set_balance(u'caf\xe9', 20))
+        journal.close()
+        # lose the commit, as a power cut could, with the record still journaled
+        with open(self.journal_path, 'ab') as journal_file:
+            journal_file.write(encode_record(2, 'admin_set_balance', [u'caf\xe9', 30]))
+
+        (journal, db) = self.open()
+        self.assertEqual(db.admin_get_balance(u'caf\xe9'), 30)
@@ -0,0 +1,88 @@
+from unittest import TestCase
+from bank_server.nonce_store import NonceStore
+import threading
+
+
+class FakeClock(object):
+    def __init__(self):
+        self.now = 1000.0
+
+    def __call__(self):
+        return self.now
+
+
+class TestNonceStore(TestCase):
+    def setUp(self):
+        self.clock = FakeClock()
+        # 8 buckets of 0.5 seconds, one turn of the wheel every 4 seconds
+        self.store = NonceStore(lifetime=4, slots=8, clock=self.clock)
+
+    def test_nonce_expires(self):
+        self.assertTrue(self.store.issue('card', 'n1'))
+        self.clock.now += 3.9
+        self.assertTrue(self.store.check('card', 'n1'))
+        self.clock.now += 0.2
+        self.assertFalse(self.store.check('card', 'n1'))
+        self.assertFalse(self.store.consume('card', 'n1'))
+
+    def test_reissue_only_after_expiry(self):
+        self.assertTrue(self.store.issue('card', 'n1'))
+        self.assertFalse(self.store.issue('card', 'n2'))
+        self.clock.now += 4.1
+        self.assertTrue(self.store.issue('card', 'n2'))
+        self.assertFalse(self.store.consume('card', 'n1'))
+        self.assertTrue(self.store.consume('card', 'n2'))
+
+    def test_consume_once(self):
+        self.assertTrue(self.store.issue('card', 'n1'))
+        self.assertFalse(self.store.consume('card', 'wrong'))
+        self.assertTrue(self.store.consume('card', 'n1'))
+        self.assertFalse(self.store.consume('card', 'n1'))
+        self.assertFalse(self.store.check('card', 'n1'))
+        # and a new nonce can be issued straight away
+        self.assertTrue(self.store.issue('card', 'n2'))
+
+    def test_concurrent_consume_succeeds_once(self):
+        self.assertTrue(self.store.issue('card', 'n1'))
+        results = []
+        threads = [threading.Thread(target=lambda: results.append(self.store.consume('card', 'n1')))
+                   for _ in range(20)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(results.count(True), 1)
+
+    def test_len_shrinks_as_nonces_expire(self):
+        for i in range(4):
+            self.assertTrue(self.store.issue('card%d' % i, 'n'))
+            self.clock.now += 1
+        self.assertEqual(len(self.store), 4)
+        # card0 and card1 expired; issuing sweeps them
+        self.clock.now += 1.6
+        self.assertTrue(self.store.issue('card9', 'n'))
+        self.assertEqual(len(self.store), 3)
+        self.assertTrue(self.store.consume('card9', 'n'))
+        self.assertEqual(len(self.store), 2)
+
+    def test_sweep_after_idle_longer_than_a_turn(self):
+        self.assertTrue(self.store.issue('old', 'n'))
+        # many turns of the wheel pass without a call
+        self.clock.now += 100
+        self.assertTrue(self.store.issue('new', 'n'))
+        self.assertEqual(len(self.store), 1)
+        self.assertTrue(self.store.check('new', 'n'))
+
+    def test_bucket_shared_a_turn_apart(self):
+        # entries expiring exactly one turn apart land in the same bucket;
+        # sweeping the earlier one must leave the later one alone
+        self.assertTrue(self.store.issue('first', 'n'))
+        self.clock.now += 4
+        self.assertTrue(self.store.issue('second', 'n'))
+        self.clock.now += 0.6
+        self.assertTrue(self.store.issue('other', 'n'))
+        self.assertEqual(len(self.store), 2)
+        self.assertTrue(self.store.check('second', 'n'))
+        # still valid until its own expiry
+        self.clock.now += 3.3
+        self.assertTrue(self.store.consume('second', 'n'))
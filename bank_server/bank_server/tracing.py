@@ -0,0 +1,26 @@
+"""Transaction tracing, bank_server side
+
+Spans and the trace file are shared with the atm_backend in
+ectf_common.tracing. This module adds the XML-RPC request handler that
+picks up the caller's trace context, and resolves the configured trace
+path against the bank_server package.
+"""
+
+import os
+from SimpleXMLRPCServer import SimpleXMLRPCRequestHandler
+from ectf_common import tracing as common_tracing
+from ectf_common.tracing import TRACE_HEADER, enabled, set_remote_context, span, traced
+
+
+def configure(config, process_name):
+    """Enables tracing from the tracing section of config.yaml, see
+    ectf_common.tracing.configure()"""
+    common_tracing.configure(config, process_name, os.path.dirname(__file__))
+
+
+class TracingRequestHandler(SimpleXMLRPCRequestHandler):
+    """XML-RPC request handler that picks up the caller's trace context"""
+
+    def decode_request_content(self, data):
+        set_remote_context(self.headers.get(TRACE_HEADER))
+        return SimpleXMLRPCRequestHandler.decode_request_content(self, data)
@@ -0,0 +1,190 @@
+"""Benchmark and regression suite for the crypto extension
+
+Measures throughput and per-call latency of the extension's hot calls across
+payload sizes, thread counts and batch sizes, and writes the results as JSON.
+A saved run can be used as a baseline for later runs:
+
+    python cryptobench.py --output baseline.json
+    (change the wrapper, rebuild)
+    python cryptobench.py --compare baseline.json
+
+--compare exits with status 1 if any case lost more than --threshold of its
+throughput or grew its p99 latency by more than --threshold. Compare runs
+from the same machine only, ideally idle.
+"""
+
+import argparse
+import json
+import multiprocessing
+import platform
+import sys
+import threading
+import timeit
+from binascii import unhexlify
+
+import crypto
+
+ctx = "\x00" * 8
+key = "\x00" * 32
+#signatures need not be valid: hydro_sign_verify does the same work either way
+pk = unhexlify("b14ed7aa48d41efc873dcddb33c97a0d5f059b0592597b64278d6b305b889351")
+sig = unhexlify("3a77616ed36fdedbe63e26b9d366a5264b9c61022e8f65ddd6bf4d33ecd87f21"
+                "e4799ee520f49dc140720b914ec25eafb0fb9e3da1a4327bdd9ad2954feb870b")
+
+sk = crypto.sign_keygen_deterministic(crypto.hash("12345678", ctx, key))[1]
+
+SIZES = [8, 64, 1024, 16384]
+BATCHES = [1, 16, 64, 256]
+clock = timeit.default_timer
+
+
+def percentile(samples, p):
+    """Returns the p-th percentile of sorted samples (nearest rank)"""
+    index = int(round(p / 100.0 * (len(samples) - 1)))
+    return samples[index]
+
+
+def run_case(op, threads, duration, ops_per_call=1):
+    """
+    Calls op from threads threads for duration seconds
+
+    Args:
+        op (callable): Does one call into the extension
+        threads (int): Number of threads calling op concurrently
+        duration (float): Seconds to run for
+        ops_per_call (int, optional): Operations one call performs, e.g. the
+            batch size, so ops_per_sec counts items rather than calls
+
+    Returns:
+        dict: ops_per_sec and p50/p90/p99 latency of one call in microseconds
+    """
+    op()  # warm up caches and lazily initialized state
+    latencies = [[] for _ in range(threads)]
+    start_barrier = threading.Event()
+
+    def worker(out):
+        start_barrier.wait()
+        deadline = clock() + duration
+        now = clock()
+        while now < deadline:
+            op()
+            end = clock()
+            out.append(end - now)
+            now = end
+
+    workers = [threading.Thread(target=worker, args=(l,)) for l in latencies]
+    for t in workers:
+        t.start()
+    start = clock()
+    start_barrier.set()
+    for t in workers:
+        t.join()
+    elapsed = clock() - start
+
+    samples = sorted(s for l in latencies for s in l)
+    return {'ops_per_sec': len(samples) * ops_per_call / elapsed,
+            'p50_us': percentile(samples, 50) * 1e6,
+            'p90_us': percentile(samples, 90) * 1e6,
+            'p99_us': percentile(samples, 99) * 1e6,
+            'calls': len(samples)}
+
+
+def verify_op(m):
+    def op():
+        try:
+            crypto.sign_verify(sig, m, ctx, pk)
+        except ValueError:
+            pass
+    return op
+
+
+def cases(thread_counts):
+    """Yields (name, op, threads, ops_per_call) for every benchmark case"""
+    for size in SIZES:
+        m = "\x00" * size
+        c = crypto.secretbox_encrypt(m, 0, ctx, key)
+        box = crypto.SecretBox(key, ctx)
+        verifier = crypto.Verifier(pk, ctx)
+        for n in thread_counts:
+            suffix = "size=%d/threads=%d" % (size, n)
+            yield ("sign_verify/" + suffix, verify_op(m), n, 1)
+            yield ("Verifier.verify/" + suffix, lambda m=m, v=verifier: v.verify(sig, m), n, 1)
+            yield ("sign_create/" + suffix, lambda m=m: crypto.sign_create(m, ctx, sk), n, 1)
+            yield ("secretbox_encrypt/" + suffix, lambda m=m: crypto.secretbox_encrypt(m, 0, ctx, key), n, 1)
+            yield ("secretbox_decrypt/" + suffix, lambda c=c: crypto.secretbox_decrypt(c, 0, ctx, key), n, 1)
+            yield ("SecretBox.encrypt/" + suffix, lambda m=m, b=box: b.encrypt(m), n, 1)
+
+    m = "\x00" * 64
+    for batch in BATCHES:
+        items = [(sig, m, pk)] * batch
+        for n in thread_counts:
+            yield ("sign_verify_batch/batch=%d/threads=%d" % (batch, n),
+                   lambda items=items, n=n: crypto.sign_verify_batch(items, ctx, n), 1, batch)
+
+
+def compare(baseline, results, threshold):
+    """
+    Compares results against a baseline run
+
+    Returns:
+        list of str: One line per case that regressed beyond threshold
+    """
+    regressions = []
+    for name in sorted(results):
+        old = baseline.get(name)
+        if old is None:
+            continue
+        new = results[name]
+        ops = new['ops_per_sec'] / old['ops_per_sec'] - 1
+        p99 = new['p99_us'] / old['p99_us'] - 1
+        if ops < -threshold or p99 > threshold:
+            regressions.append("%-45s ops/sec %+6.1f%%  p99 %+6.1f%%" % (name, ops * 100, p99 * 100))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the crypto extension")
+    parser.add_argument("--duration", type=float, default=0.5, help="seconds per case")
+    parser.add_argument("--threads", type=int, nargs="+",
+                        help="thread counts to run (default 1, 2, 4 and the core count)")
+    parser.add_argument("--filter", default="", help="only run cases whose name contains this")
+    parser.add_argument("--output", help="write results as JSON to this file")
+    parser.add_argument("--compare", help="JSON baseline from an earlier --output to compare against")
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="fraction of throughput lost or p99 gained that counts as a regression")
+    args = parser.parse_args()
+
+    cores = multiprocessing.cpu_count()
+    thread_counts = args.threads or sorted(set([1, 2, 4, cores]))
+
+    results = {}
+    print "%-45s %12s %10s %10s %10s" % ("case", "ops/sec", "p50 us", "p90 us", "p99 us")
+    for name, op, threads, ops_per_call in cases(thread_counts):
+        if args.filter not in name:
+            continue
+        r = run_case(op, threads, args.duration, ops_per_call)
+        results[name] = r
+        print "%-45s %12.0f %10.1f %10.1f %10.1f" % (name, r['ops_per_sec'], r['p50_us'], r['p90_us'], r['p99_us'])
+        sys.stdout.flush()
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump({'machine': {'platform': platform.platform(),
+                                   'python': platform.python_version(),
+                                   'cores': cores},
+                       'results': results}, f, indent=2, sort_keys=True)
+
+    if args.compare:
+        with open(args.compare) as f:
+            baseline = json.load(f)['results']
+        regressions = compare(baseline, results, args.threshold)
+        if regressions:
+            print "\n%d regressions beyond %.0f%%:" % (len(regressions), args.threshold * 100)
+            for line in regressions:
+                print "  " + line
+            sys.exit(1)
+        print "\nno regressions beyond %.0f%%" % (args.threshold * 100)
+
+
+if __name__ == "__main__":
+    main()
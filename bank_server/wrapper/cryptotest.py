@@ -31,4 +31,33 @@ pk = "b14ed7aa48d41efc873dcddb33c97a0d5f059b0592597b64278d6b305b889351"
 pk = unhexlify(pk)
 print(len(pk))
 
-crypto.sign_verify(sig, m1, ctx, pk)
+try:
+    crypto.sign_verify(sig, m1, ctx, pk)
+    print "sign_verify: verified"
+except ValueError as e:
+    print "sign_verify:", e
+
+#Verifier keeps a card's pk and context for repeated checks, returning a bool
+verifier = crypto.Verifier(pk, ctx)
+print "Verifier:", verifier.verify(sig, m1)
+
+#any buffer works as input, and the _into variants write into a caller's buffer
+out = bytearray(64)
+n = crypto.secretbox_encrypt_into(out, memoryview("message3"), 0, ctx, '\x00'*32)
+plain = bytearray(n - 36)
+crypto.secretbox_decrypt_into(plain, memoryview(out)[:n], 0, bytearray(ctx), '\x00'*32)
+print(plain)
+
+#SecretBox keeps a validated key and context for repeated use
+box = crypto.SecretBox('\x00'*32, ctx)
+print box.decrypt(box.encrypt("message4")), "key locked:", box.locked
+print(crypto.secretbox_decrypt(box.encrypt("message5"), 0, ctx, '\x00'*32))
+
+#derive a card's keys the way generate_keys() in CARD.cydsn/main.c does, and sign a nonce with them
+r = '\x01'*32
+seed = crypto.hash("12345678", ctx, r)
+card_pk, card_sk = crypto.sign_keygen_deterministic(seed)
+card_sig = crypto.sign_create('\x02'*32, ctx, card_sk)
+print "card signature verifies:", crypto.Verifier(card_pk, ctx).verify(card_sig, '\x02'*32)
+
+#timing lives in cryptobench.py
@@ -1,122 +1,1314 @@
 #define PY_SSIZE_T_CLEAN
 
 #include <Python.h>
+#include <pythread.h>
+#include <structmember.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "./libhydrogen/hydrogen.h"
+#include "gimli_batch.h"
+#include "hydro_batch.h"
 #include <string.h>
 
-static PyObject* crypto_secretbox_encrypt(PyObject* self, PyObject* args){
-	char* m;
+/*
+ * The module builds for Python 2 and 3. On 3.7+ the hot functions use
+ * METH_FASTCALL and get their arguments as a C array with no tuple. On
+ * older versions CRYPTO_FASTCALL wraps them in a METH_VARARGS function that
+ * passes the argument tuple's item array along, so the body is the same.
+ * Either way the arguments are checked by hand instead of interpreting a
+ * PyArg_ParseTuple format string on every call.
+ */
+#if PY_VERSION_HEX >= 0x03070000
+#define CRYPTO_METH_FASTCALL METH_FASTCALL
+#define CRYPTO_FASTCALL(name, self_type) \
+	static PyObject* name(self_type* self, PyObject* const* args, Py_ssize_t nargs)
+#else
+#define CRYPTO_METH_FASTCALL METH_VARARGS
+#define CRYPTO_FASTCALL(name, self_type) \
+	static PyObject* name##_fast(self_type* self, PyObject* const* args, Py_ssize_t nargs); \
+	static PyObject* name(self_type* self, PyObject* tuple){ \
+		return name##_fast(self, &PyTuple_GET_ITEM(tuple, 0), PyTuple_GET_SIZE(tuple)); \
+	} \
+	static PyObject* name##_fast(self_type* self, PyObject* const* args, Py_ssize_t nargs)
+#endif
+
+#define CRYPTO_FUNC(f) ((PyCFunction) (void (*)(void)) (f))
+
+#if PY_MAJOR_VERSION >= 3
+#define PyInt_Check PyLong_Check
+#define PyInt_AsLong PyLong_AsLong
+#define PyInt_AsUnsignedLongLongMask PyLong_AsUnsignedLongLongMask
+#define PyInt_FromSsize_t PyLong_FromSsize_t
+#define PyString_Check PyUnicode_Check
+#define PyString_AsString PyUnicode_AsUTF8
+#define PyString_FromString PyUnicode_FromString
+#endif
+
+static int check_nargs(const char* name, Py_ssize_t nargs, Py_ssize_t min, Py_ssize_t max){
+	if (nargs >= min && nargs <= max)
+		return 1;
+	if (min == max)
+		PyErr_Format(PyExc_TypeError, "%s() takes exactly %zd arguments (%zd given)", name, min, nargs);
+	else
+		PyErr_Format(PyExc_TypeError, "%s() takes from %zd to %zd arguments (%zd given)", name, min, max, nargs);
+	return 0;
+}
+
+/*
+ * Exports o's buffer into view, which must start out with view->obj NULL.
+ * view->obj stays NULL on failure, so callers can release every view they
+ * declared whether or not it was filled
+ */
+static int get_buffer(PyObject* o, Py_buffer* view, int writable){
+	if (PyObject_GetBuffer(o, view, writable ? PyBUF_WRITABLE : PyBUF_SIMPLE) < 0){
+		//read-only buffers raise BufferError here, PyArg_ParseTuple's w* raised TypeError
+		if (writable && PyErr_ExceptionMatches(PyExc_BufferError)){
+			PyErr_Clear();
+			PyErr_Format(PyExc_TypeError, "output must be a writable buffer, not %.50s", Py_TYPE(o)->tp_name);
+		}
+		view->obj = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+static int get_msg_id(PyObject* o, unsigned long long* msg_id){
+	if (!PyInt_Check(o) && !PyLong_Check(o)){
+		PyErr_Format(PyExc_TypeError, "msg_id must be an integer, not %.50s", Py_TYPE(o)->tp_name);
+		return 0;
+	}
+	//wraps like PyArg_ParseTuple's K
+	*msg_id = PyInt_AsUnsignedLongLongMask(o);
+	return !(*msg_id == (unsigned long long) -1 && PyErr_Occurred());
+}
+
+#define EMPTY_BUFFER {NULL, NULL}
+
+/*
+ * Every primitive runs its hydro_* call with the GIL released, so
+ * verification and encryption from different RPC threads run in parallel.
+ *
+ * Arguments are taken as Py_buffer (s* / w*), so str, bytearray and
+ * memoryview all work and are used in place without a copy. Holding the
+ * buffer export pins the memory: a bytearray cannot be resized or freed
+ * while we use it without the GIL.
+ *
+ * libhydrogen keeps its random state in a global, so the calls that draw
+ * randomness (the secretbox and signature nonces) are serialized on
+ * random_lock.
+ */
+static PyThread_type_lock random_lock;
+
+static int check_secretbox_args(const Py_buffer* ctx, const Py_buffer* key){
+	if(ctx->len != hydro_secretbox_CONTEXTBYTES){
+		PyErr_Format(PyExc_ValueError, "Context not of correct size: Received %zd bytes", ctx->len);
+		return 0;
+	}
+
+	if(key->len != hydro_secretbox_KEYBYTES){
+		PyErr_Format(PyExc_ValueError, "Key not of correct size: Received %zd bytes", key->len);
+		return 0;
+	}
+	return 1;
+}
+
+static int check_ciphertext(const Py_buffer* c){
+	if(c->len < hydro_secretbox_HEADERBYTES){
+		PyErr_Format(PyExc_ValueError, "Ciphertext too short: Received %zd bytes", c->len);
+		return 0;
+	}
+	return 1;
+}
+
+/* Checks an output buffer can hold outlen bytes and does not overlap the input */
+static int check_output(const Py_buffer* out, Py_ssize_t outlen, const Py_buffer* in){
+	if(out->len < outlen){
+		PyErr_Format(PyExc_ValueError, "Output buffer too small: Need %zd bytes, received %zd", outlen, out->len);
+		return 0;
+	}
+
+	const char* o = out->buf;
+	const char* i = in->buf;
+	if(o < i + in->len && i < o + out->len){
+		PyErr_SetString(PyExc_ValueError, "Output buffer overlaps the input");
+		return 0;
+	}
+	return 1;
+}
+
+/* Encrypts m into c, which holds m->len + hydro_secretbox_HEADERBYTES bytes */
+static void secretbox_encrypt_nogil(uint8_t* c, const Py_buffer* m, uint64_t msg_id, const char* ctx, const uint8_t* key){
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(random_lock, WAIT_LOCK);
+	hydro_secretbox_encrypt(c, m->buf, m->len, msg_id, ctx, key);
+	PyThread_release_lock(random_lock);
+	Py_END_ALLOW_THREADS
+}
+
+/* Decrypts c into m, which holds c->len - hydro_secretbox_HEADERBYTES bytes. Sets ValueError on forgery */
+static int secretbox_decrypt_nogil(uint8_t* m, const Py_buffer* c, uint64_t msg_id, const char* ctx, const uint8_t* key){
+	int res;
+	Py_BEGIN_ALLOW_THREADS
+	res = hydro_secretbox_decrypt(m, c->buf, c->len, msg_id, ctx, key);
+	Py_END_ALLOW_THREADS
+	if (res != 0){
+		PyErr_Format(PyExc_ValueError, "Message forged, did not decrypt successfully\n");
+		return 0;
+	}
+	return 1;
+}
+
+CRYPTO_FASTCALL(crypto_secretbox_encrypt, PyObject){
+	Py_buffer m = EMPTY_BUFFER, ctx = EMPTY_BUFFER, key = EMPTY_BUFFER;
+	unsigned long long msg_id;
+
+	PyObject *ret = NULL;
+	if (check_nargs("secretbox_encrypt", nargs, 4, 4) && get_buffer(args[0], &m, 0) && get_msg_id(args[1], &msg_id)
+			&& get_buffer(args[2], &ctx, 0) && get_buffer(args[3], &key, 0) && check_secretbox_args(&ctx, &key)){
+		//the result string is not shared with anything yet, so it is safe to fill without the GIL
+		ret = PyBytes_FromStringAndSize(NULL, hydro_secretbox_HEADERBYTES + m.len);
+		if (ret != NULL)
+			secretbox_encrypt_nogil((uint8_t*) PyBytes_AS_STRING(ret), &m, msg_id, ctx.buf, key.buf);
+	}
+
+	PyBuffer_Release(&m);
+	PyBuffer_Release(&ctx);
+	PyBuffer_Release(&key);
+	return ret;
+}
+
+CRYPTO_FASTCALL(crypto_secretbox_encrypt_into, PyObject){
+	Py_buffer out = EMPTY_BUFFER, m = EMPTY_BUFFER, ctx = EMPTY_BUFFER, key = EMPTY_BUFFER;
+	unsigned long long msg_id;
+
+	PyObject *ret = NULL;
+	Py_ssize_t clen;
+	if (check_nargs("secretbox_encrypt_into", nargs, 5, 5) && get_buffer(args[0], &out, 1) && get_buffer(args[1], &m, 0)
+			&& get_msg_id(args[2], &msg_id) && get_buffer(args[3], &ctx, 0) && get_buffer(args[4], &key, 0)
+			&& check_secretbox_args(&ctx, &key)
+			&& check_output(&out, clen = hydro_secretbox_HEADERBYTES + m.len, &m)){
+		secretbox_encrypt_nogil(out.buf, &m, msg_id, ctx.buf, key.buf);
+		ret = PyInt_FromSsize_t(clen);
+	}
+
+	PyBuffer_Release(&out);
+	PyBuffer_Release(&m);
+	PyBuffer_Release(&ctx);
+	PyBuffer_Release(&key);
+	return ret;
+}
+
+CRYPTO_FASTCALL(crypto_secretbox_decrypt, PyObject){
+	Py_buffer c = EMPTY_BUFFER, ctx = EMPTY_BUFFER, key = EMPTY_BUFFER;
+	unsigned long long msg_id;
+
+	PyObject *ret = NULL;
+	if (check_nargs("secretbox_decrypt", nargs, 4, 4) && get_buffer(args[0], &c, 0) && get_msg_id(args[1], &msg_id)
+			&& get_buffer(args[2], &ctx, 0) && get_buffer(args[3], &key, 0)
+			&& check_secretbox_args(&ctx, &key) && check_ciphertext(&c)){
+		ret = PyBytes_FromStringAndSize(NULL, c.len - hydro_secretbox_HEADERBYTES);
+		if (ret != NULL && !secretbox_decrypt_nogil((uint8_t*) PyBytes_AS_STRING(ret), &c, msg_id, ctx.buf, key.buf))
+			Py_CLEAR(ret);
+	}
+
+	PyBuffer_Release(&c);
+	PyBuffer_Release(&ctx);
+	PyBuffer_Release(&key);
+	return ret;
+}
+
+CRYPTO_FASTCALL(crypto_secretbox_decrypt_into, PyObject){
+	Py_buffer out = EMPTY_BUFFER, c = EMPTY_BUFFER, ctx = EMPTY_BUFFER, key = EMPTY_BUFFER;
+	unsigned long long msg_id;
+
+	PyObject *ret = NULL;
+	Py_ssize_t mlen;
+	if (check_nargs("secretbox_decrypt_into", nargs, 5, 5) && get_buffer(args[0], &out, 1) && get_buffer(args[1], &c, 0)
+			&& get_msg_id(args[2], &msg_id) && get_buffer(args[3], &ctx, 0) && get_buffer(args[4], &key, 0)
+			&& check_secretbox_args(&ctx, &key) && check_ciphertext(&c)
+			&& check_output(&out, mlen = c.len - hydro_secretbox_HEADERBYTES, &c)
+			&& secretbox_decrypt_nogil(out.buf, &c, msg_id, ctx.buf, key.buf)){
+		ret = PyInt_FromSsize_t(mlen);
+	}
+
+	PyBuffer_Release(&out);
+	PyBuffer_Release(&c);
+	PyBuffer_Release(&ctx);
+	PyBuffer_Release(&key);
+	return ret;
+}
+
+CRYPTO_FASTCALL(crypto_sign_verify, PyObject){
+	Py_buffer csig = EMPTY_BUFFER, m = EMPTY_BUFFER, ctx = EMPTY_BUFFER, pk = EMPTY_BUFFER;
+
+	PyObject *ret = NULL;
+	if (!check_nargs("sign_verify", nargs, 4, 4) || !get_buffer(args[0], &csig, 0) || !get_buffer(args[1], &m, 0)
+			|| !get_buffer(args[2], &ctx, 0) || !get_buffer(args[3], &pk, 0)){
+		//exception already set
+	}
+	else if (csig.len != hydro_sign_BYTES){
+		PyErr_Format(PyExc_ValueError, "Signature not of correct size: Received %zd bytes", csig.len);
+	}
+	else if (ctx.len != hydro_sign_CONTEXTBYTES){
+		PyErr_Format(PyExc_ValueError, "Context not of correct size: Received %zd bytes", ctx.len);
+	}
+	else if(pk.len != hydro_sign_PUBLICKEYBYTES){
+		PyErr_Format(PyExc_ValueError, "Public key not of correct size: Received %zd bytes", pk.len);
+	}
+	else {
+		int res;
+		Py_BEGIN_ALLOW_THREADS
+		res = hydro_sign_verify(csig.buf, m.buf, m.len, ctx.buf, pk.buf);
+		Py_END_ALLOW_THREADS
+
+		if(res != 0){
+			PyErr_Format(PyExc_ValueError, "Message failed to verify\n");
+		}
+		else {
+			Py_INCREF(Py_None);
+			ret = Py_None;
+		}
+	}
+
+	PyBuffer_Release(&csig);
+	PyBuffer_Release(&m);
+	PyBuffer_Release(&ctx);
+	PyBuffer_Release(&pk);
+	return ret;
+}
+
+/*
+ * Hashing, key derivation and signing, so the bank side can compute what a
+ * card computes (e.g. to generate signed load without hardware). A card
+ * derives its keypair in generate_keys() as
+ *
+ *     seed = hash(pin, CONTEXT, r)
+ *     pk, sk = sign_keygen_deterministic(seed)
+ */
+CRYPTO_FASTCALL(crypto_hash, PyObject){
+	Py_buffer m = EMPTY_BUFFER, ctx = EMPTY_BUFFER, key = EMPTY_BUFFER;
+	Py_ssize_t outlen = hydro_hash_BYTES;
+
+	PyObject* ret = NULL;
+	if (!check_nargs("hash", nargs, 2, 4) || !get_buffer(args[0], &m, 0) || !get_buffer(args[1], &ctx, 0)
+			|| (nargs > 2 && args[2] != Py_None && !get_buffer(args[2], &key, 0))
+			|| (nargs > 3 && (outlen = PyNumber_AsSsize_t(args[3], PyExc_OverflowError)) == -1 && PyErr_Occurred())){
+		//exception already set
+	}
+	else if (ctx.len != hydro_hash_CONTEXTBYTES){
+		PyErr_Format(PyExc_ValueError, "Context not of correct size: Received %zd bytes", ctx.len);
+	}
+	else if (key.obj != NULL && key.len != hydro_hash_KEYBYTES){
+		PyErr_Format(PyExc_ValueError, "Key not of correct size: Received %zd bytes", key.len);
+	}
+	else if (outlen < hydro_hash_BYTES_MIN || outlen > hydro_hash_BYTES_MAX){
+		PyErr_Format(PyExc_ValueError, "Output length must be between %d and %d: Received %zd", hydro_hash_BYTES_MIN, hydro_hash_BYTES_MAX, outlen);
+	}
+	else {
+		ret = PyBytes_FromStringAndSize(NULL, outlen);
+		if (ret != NULL){
+			uint8_t* out = (uint8_t*) PyBytes_AS_STRING(ret);
+			const uint8_t* k = key.obj != NULL ? key.buf : NULL;
+			Py_BEGIN_ALLOW_THREADS
+			hydro_hash_hash(out, outlen, m.buf, m.len, ctx.buf, k);
+			Py_END_ALLOW_THREADS
+		}
+	}
+
+	PyBuffer_Release(&m);
+	PyBuffer_Release(&ctx);
+	PyBuffer_Release(&key);
+	return ret;
+}
+
+CRYPTO_FASTCALL(crypto_sign_keygen_deterministic, PyObject){
+	Py_buffer seed;
+	if (!check_nargs("sign_keygen_deterministic", nargs, 1, 1) || !get_buffer(args[0], &seed, 0))
+		return NULL;
+
+	PyObject* ret = NULL;
+	if (seed.len != hydro_sign_SEEDBYTES){
+		PyErr_Format(PyExc_ValueError, "Seed not of correct size: Received %zd bytes", seed.len);
+	}
+	else {
+		hydro_sign_keypair kp;
+		Py_BEGIN_ALLOW_THREADS
+		hydro_sign_keygen_deterministic(&kp, seed.buf);
+		Py_END_ALLOW_THREADS
+		PyObject* pk = PyBytes_FromStringAndSize((const char*) kp.pk, sizeof kp.pk);
+		PyObject* sk = PyBytes_FromStringAndSize((const char*) kp.sk, sizeof kp.sk);
+		hydro_memzero(&kp, sizeof kp);
+		if (pk != NULL && sk != NULL)
+			ret = PyTuple_Pack(2, pk, sk);
+		Py_XDECREF(pk);
+		Py_XDECREF(sk);
+	}
+
+	PyBuffer_Release(&seed);
+	return ret;
+}
+
+CRYPTO_FASTCALL(crypto_sign_create, PyObject){
+	Py_buffer m = EMPTY_BUFFER, ctx = EMPTY_BUFFER, sk = EMPTY_BUFFER;
+
+	PyObject* ret = NULL;
+	if (!check_nargs("sign_create", nargs, 3, 3) || !get_buffer(args[0], &m, 0) || !get_buffer(args[1], &ctx, 0)
+			|| !get_buffer(args[2], &sk, 0)){
+		//exception already set
+	}
+	else if (ctx.len != hydro_sign_CONTEXTBYTES){
+		PyErr_Format(PyExc_ValueError, "Context not of correct size: Received %zd bytes", ctx.len);
+	}
+	else if (sk.len != hydro_sign_SECRETKEYBYTES){
+		PyErr_Format(PyExc_ValueError, "Secret key not of correct size: Received %zd bytes", sk.len);
+	}
+	else {
+		ret = PyBytes_FromStringAndSize(NULL, hydro_sign_BYTES);
+		if (ret != NULL){
+			uint8_t* csig = (uint8_t*) PyBytes_AS_STRING(ret);
+			//the signature nonce is drawn from libhydrogen's random state
+			Py_BEGIN_ALLOW_THREADS
+			PyThread_acquire_lock(random_lock, WAIT_LOCK);
+			hydro_sign_create(csig, m.buf, m.len, ctx.buf, sk.buf);
+			PyThread_release_lock(random_lock);
+			Py_END_ALLOW_THREADS
+		}
+	}
+
+	PyBuffer_Release(&m);
+	PyBuffer_Release(&ctx);
+	PyBuffer_Release(&sk);
+	return ret;
+}
+
+/*
+ * Batch verification. The items are parsed and copied in one pass with the
+ * GIL held, then verified with it released, optionally spread over a small
+ * pool of worker threads. Workers and the calling thread claim items with an
+ * atomic counter, so a slow item never holds up the rest of the batch.
+ */
+#define VERIFY_POOL_MAX 16
+
+typedef struct {
+	const uint8_t* sig;	/* NULL if the item was malformed */
+	const uint8_t* pk;
+	const uint8_t* m;
 	size_t mlen;
-	uint64_t msg_id;
-	char *ctx;
-	size_t ctx_len;
-	const uint8_t *key; //this shouldn't matter its secret
-	size_t key_len;
-	PyArg_ParseTuple(args, "s#|K|s#|s#", &m, &mlen, &msg_id, &ctx, &ctx_len, &key, &key_len); //only s# accepts null bytes, need to random pointers to store lengths
-	//printf("Parsed \n");
-	//printf("MSG: %s, MSG_ID: %" PRIu64 ", CTX: %s\n", m, msg_id, ctx);
-	/* idk why it parses the message length correctly but not the context length or key length, whatever, ignore those variables*/
-	if(ctx_len != hydro_secretbox_CONTEXTBYTES){
-		PyErr_Format(PyExc_ValueError, "Context not of correct size: Received %lu bytes", ctx_len);
+	int ok;
+} verify_item;
+
+typedef struct {
+	verify_item* items;
+	size_t count;
+	char ctx[hydro_sign_CONTEXTBYTES];
+	size_t next;
+} verify_batch;
+
+static void verify_run(verify_batch* b){
+	size_t i;
+	while ((i = __sync_fetch_and_add(&b->next, 1)) < b->count){
+		verify_item* it = &b->items[i];
+		it->ok = it->sig != NULL && hydro_sign_verify(it->sig, it->m, it->mlen, b->ctx, it->pk) == 0;
+	}
+}
+
+static struct {
+	pthread_mutex_t busy;	/* held by the batch currently using the pool */
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	verify_batch* batch;
+	int nthreads;	/* workers started */
+	int wanted;	/* workers still to join the current batch */
+	int active;	/* workers not yet finished with the current batch */
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void* pool_worker(void* arg){
+	pthread_mutex_lock(&pool.lock);
+	for (;;){
+		while (pool.wanted == 0)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		pool.wanted--;
+		verify_batch* b = pool.batch;
+		pthread_mutex_unlock(&pool.lock);
+
+		verify_run(b);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.active == 0)
+			pthread_cond_signal(&pool.idle);
+	}
+	return NULL;
+}
+
+//worker threads do not survive fork, start the pool over in the child
+static void pool_reset_child(void){
+	pthread_mutex_init(&pool.busy, NULL);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.idle, NULL);
+	pool.nthreads = pool.wanted = pool.active = 0;
+}
+
+/* Verifies a batch on the calling thread plus up to helpers pool workers. Called without the GIL */
+static void verify_parallel(verify_batch* b, int helpers){
+	//another batch has the pool, verify this one on the calling thread alone
+	if (helpers <= 0 || pthread_mutex_trylock(&pool.busy) != 0){
+		verify_run(b);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.nthreads < helpers){
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, pool_worker, NULL) != 0)
+			break;
+		pthread_detach(tid);
+		pool.nthreads++;
+	}
+	if (helpers > pool.nthreads)
+		helpers = pool.nthreads;
+	pool.batch = b;
+	pool.wanted = pool.active = helpers;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	verify_run(b);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.active > 0)
+		pthread_cond_wait(&pool.idle, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+	pthread_mutex_unlock(&pool.busy);
+}
+
+/* Exports the three buffers of a (sig, msg, pk) batch item */
+static int get_verify_item(PyObject* item, Py_buffer* sig, Py_buffer* m, Py_buffer* pk){
+	if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 3){
+		PyErr_SetString(PyExc_TypeError, "items must be (sig, msg, pk) tuples");
+		return 0;
+	}
+	if (get_buffer(PyTuple_GET_ITEM(item, 0), sig, 0)){
+		if (get_buffer(PyTuple_GET_ITEM(item, 1), m, 0)){
+			if (get_buffer(PyTuple_GET_ITEM(item, 2), pk, 0))
+				return 1;
+			PyBuffer_Release(m);
+		}
+		PyBuffer_Release(sig);
+	}
+	return 0;
+}
+
+CRYPTO_FASTCALL(crypto_sign_verify_batch, PyObject){
+	Py_buffer ctx = EMPTY_BUFFER;
+	long threads = 1;
+	if (!check_nargs("sign_verify_batch", nargs, 2, 3))
+		return NULL;
+	if (nargs > 2){
+		threads = PyInt_AsLong(args[2]);
+		if (threads == -1 && PyErr_Occurred())
+			return NULL;
+	}
+	if (!get_buffer(args[1], &ctx, 0))
+		return NULL;
+	PyObject* items_arg = args[0];
+
+	verify_batch b;
+	Py_ssize_t ctxlen = ctx.len;
+	if (ctxlen == hydro_sign_CONTEXTBYTES)
+		memcpy(b.ctx, ctx.buf, sizeof b.ctx);
+	PyBuffer_Release(&ctx);
+	if (ctxlen != hydro_sign_CONTEXTBYTES){
+		PyErr_Format(PyExc_ValueError, "Context not of correct size: Received %zd bytes", ctxlen);
 		return NULL;
 	}
 
-	if(key_len != hydro_secretbox_KEYBYTES){
-		PyErr_Format(PyExc_ValueError, "Key not of correct size: Received %lu bytes", key_len);
+	PyObject* seq = PySequence_Fast(items_arg, "items must be a sequence of (sig, msg, pk)");
+	if (seq == NULL)
 		return NULL;
+	Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+
+	//first pass: validate the items and size one buffer for all of them
+	b.count = count;
+	b.next = 0;
+	b.items = calloc(count > 0 ? count : 1, sizeof(verify_item));
+	if (b.items == NULL){
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+
+	size_t total = 0;
+	Py_ssize_t i;
+	for (i = 0; i < count; i++){
+		Py_buffer sig, m, pk;
+		if (!get_verify_item(PySequence_Fast_GET_ITEM(seq, i), &sig, &m, &pk)){
+			free(b.items);
+			Py_DECREF(seq);
+			return NULL;
+		}
+		//wrong sized signatures and keys fail their item, not the batch
+		if (sig.len == hydro_sign_BYTES && pk.len == hydro_sign_PUBLICKEYBYTES){
+			b.items[i].mlen = m.len;
+			b.items[i].ok = 1;
+			total += hydro_sign_BYTES + hydro_sign_PUBLICKEYBYTES + m.len;
+		}
+		PyBuffer_Release(&sig);
+		PyBuffer_Release(&m);
+		PyBuffer_Release(&pk);
+	}
+
+	/*
+	 * second pass: copy everything into one C-owned buffer. Unlike the single
+	 * calls, holding an export per item for the whole batch would pin
+	 * hundreds of objects, so the batch copies instead
+	 */
+	uint8_t* buf = malloc(total > 0 ? total : 1);
+	if (buf == NULL){
+		free(b.items);
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+	uint8_t* p = buf;
+	for (i = 0; i < count; i++){
+		Py_buffer sig, m, pk;
+		if (!b.items[i].ok)
+			continue;
+		b.items[i].ok = 0;
+		if (!get_verify_item(PySequence_Fast_GET_ITEM(seq, i), &sig, &m, &pk)){
+			free(buf);
+			free(b.items);
+			Py_DECREF(seq);
+			return NULL;
+		}
+		//the item may be a mutable buffer that changed size since the first pass
+		if (sig.len == hydro_sign_BYTES && pk.len == hydro_sign_PUBLICKEYBYTES && (size_t) m.len == b.items[i].mlen){
+			b.items[i].sig = p;
+			memcpy(p, sig.buf, hydro_sign_BYTES);
+			p += hydro_sign_BYTES;
+			b.items[i].pk = p;
+			memcpy(p, pk.buf, hydro_sign_PUBLICKEYBYTES);
+			p += hydro_sign_PUBLICKEYBYTES;
+			b.items[i].m = p;
+			memcpy(p, m.buf, m.len);
+			p += m.len;
+		}
+		PyBuffer_Release(&sig);
+		PyBuffer_Release(&m);
+		PyBuffer_Release(&pk);
 	}
+	Py_DECREF(seq);
 
-	//be careful adding print debug statements, i randomly get segfaults/get unintended functionality
+	if (threads > VERIFY_POOL_MAX)
+		threads = VERIFY_POOL_MAX;
+	if (threads > count)
+		threads = count;
 
+	Py_BEGIN_ALLOW_THREADS
+	verify_parallel(&b, threads - 1);
+	Py_END_ALLOW_THREADS
+	free(buf);
 
-	uint8_t c[hydro_secretbox_HEADERBYTES + mlen];
-	hydro_secretbox_encrypt(c, m, mlen, msg_id, ctx, key);
+	PyObject* ret = PyList_New(count);
+	if (ret != NULL){
+		for (i = 0; i < count; i++){
+			PyObject* ok = b.items[i].ok ? Py_True : Py_False;
+			Py_INCREF(ok);
+			PyList_SET_ITEM(ret, i, ok);
+		}
+	}
+	free(b.items);
+	return ret;
+}
 
-	//dont comment this out it segfaults
-	for (int i = 0; i < hydro_secretbox_HEADERBYTES + mlen; i++){
-		//printf("%02x", c[i]);
+/* Parses an optional backend name (None for the fastest one this CPU supports) */
+static int get_gimli_backend(PyObject* o, gimli_backend* backend){
+	gimli_backend best = gimli_best_backend();
+	if (o == Py_None){
+		*backend = best;
+		return 1;
+	}
+	if (!PyString_Check(o)){
+		PyErr_Format(PyExc_TypeError, "backend must be a string or None, not %.50s", Py_TYPE(o)->tp_name);
+		return 0;
 	}
-	//printf("\n");
+	const char* name = PyString_AsString(o);
+	if (name == NULL)
+		return 0;
 
+	gimli_backend b;
+	for (b = GIMLI_SCALAR; b <= best; b++){
+		if (strcmp(name, gimli_backend_name(b)) == 0){
+			*backend = b;
+			return 1;
+		}
+	}
+	PyErr_Format(PyExc_ValueError, "Gimli backend %s not supported on this CPU", name);
+	return 0;
+}
 
-	PyObject *ret = Py_BuildValue("s#", c, hydro_secretbox_HEADERBYTES + mlen); //s# incase it has null bytes?
+CRYPTO_FASTCALL(crypto_gimli_permute_batch, PyObject){
+	Py_buffer states;
+	gimli_backend backend;
+	if (!check_nargs("gimli_permute_batch", nargs, 1, 2) || !get_gimli_backend(nargs > 1 ? args[1] : Py_None, &backend)
+			|| !get_buffer(args[0], &states, 1))
+		return NULL;
+	if (states.len % GIMLI_BLOCKBYTES != 0){
+		PyErr_Format(PyExc_ValueError, "States not a multiple of %d bytes: Received %zd bytes", GIMLI_BLOCKBYTES, states.len);
+		PyBuffer_Release(&states);
+		return NULL;
+	}
+
+	size_t count = states.len / GIMLI_BLOCKBYTES;
+	Py_BEGIN_ALLOW_THREADS
+	gimli_permute_batch(states.buf, count, backend);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&states);
+	return Py_BuildValue("n", (Py_ssize_t) count);
+}
+
+static PyObject* crypto_gimli_backends(PyObject* self, PyObject* args){
+	gimli_backend best = gimli_best_backend();
+	PyObject* ret = PyList_New(0);
+	gimli_backend b;
+	for (b = GIMLI_SCALAR; ret != NULL && b <= best; b++){
+		PyObject* name = PyString_FromString(gimli_backend_name(b));
+		if (name == NULL || PyList_Append(ret, name) < 0){
+			Py_XDECREF(name);
+			Py_CLEAR(ret);
+			break;
+		}
+		Py_DECREF(name);
+	}
 	return ret;
 }
-static PyObject* crypto_secretbox_decrypt(PyObject* self, PyObject* args){
-	uint8_t* c;
-	size_t clen;
-	uint64_t msg_id;
-	char* ctx;
-	size_t ctx_len;
-	uint8_t *key;
-	size_t key_len;
-	PyArg_ParseTuple(args, "s#Ks#s#", &c, &clen, &msg_id, &ctx, &ctx_len, &key, &key_len);
-	if(ctx_len != hydro_secretbox_CONTEXTBYTES){
-		PyErr_Format(PyExc_ValueError, "Context not of correct size: Received %lu bytes", ctx_len);
+
+/*
+ * The batch calls copy their inputs into one C buffer like sign_verify_batch,
+ * growing it as the items are read. The buffer holds keys and plaintexts, so
+ * it is zeroized whenever it is moved or freed
+ */
+static int grow_batch_buffer(uint8_t** buf, size_t* cap, size_t used, size_t need){
+	if (used + need <= *cap)
+		return 1;
+	size_t new_cap = *cap * 2 > used + need ? *cap * 2 : used + need;
+	uint8_t* grown = malloc(new_cap);
+	if (grown == NULL){
+		PyErr_NoMemory();
+		return 0;
+	}
+	if (*buf != NULL){
+		memcpy(grown, *buf, used);
+		hydro_memzero(*buf, used);
+		free(*buf);
+	}
+	*buf = grown;
+	*cap = new_cap;
+	return 1;
+}
+
+static void free_batch_buffer(uint8_t* buf, size_t used){
+	if (buf != NULL){
+		hydro_memzero(buf, used);
+		free(buf);
+	}
+}
+
+/* Exports the buffers of an (m, msg_id, ctx, key) batch item and checks the context and key */
+static int get_encrypt_item(PyObject* item, Py_buffer* m, unsigned long long* msg_id, Py_buffer* ctx, Py_buffer* key){
+	if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 4){
+		PyErr_SetString(PyExc_TypeError, "items must be (m, msg_id, ctx, key) tuples");
+		return 0;
+	}
+	if (!get_msg_id(PyTuple_GET_ITEM(item, 1), msg_id))
+		return 0;
+	if (get_buffer(PyTuple_GET_ITEM(item, 0), m, 0)){
+		if (get_buffer(PyTuple_GET_ITEM(item, 2), ctx, 0)){
+			if (get_buffer(PyTuple_GET_ITEM(item, 3), key, 0)){
+				if (check_secretbox_args(ctx, key))
+					return 1;
+				PyBuffer_Release(key);
+			}
+			PyBuffer_Release(ctx);
+		}
+		PyBuffer_Release(m);
+	}
+	return 0;
+}
+
+CRYPTO_FASTCALL(crypto_secretbox_encrypt_batch, PyObject){
+	gimli_backend backend;
+	if (!check_nargs("secretbox_encrypt_batch", nargs, 1, 2) || !get_gimli_backend(nargs > 1 ? args[1] : Py_None, &backend))
 		return NULL;
+	PyObject* seq = PySequence_Fast(args[0], "items must be a sequence of (m, msg_id, ctx, key)");
+	if (seq == NULL)
+		return NULL;
+	Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+
+	secretbox_batch_item* items = calloc(count > 0 ? count : 1, sizeof *items);
+	size_t* offsets = calloc(count > 0 ? count : 1, sizeof *offsets);
+	PyObject* ret = PyList_New(count);
+	uint8_t* buf = NULL;
+	size_t used = 0, cap = 0;
+	Py_ssize_t i;
+	if (items == NULL || offsets == NULL){
+		PyErr_NoMemory();
+		goto fail;
 	}
+	if (ret == NULL)
+		goto fail;
 
-	if(key_len != hydro_secretbox_KEYBYTES){
-		PyErr_Format(PyExc_ValueError, "Key not of correct size: Received %lu bytes", key_len);
+	//each item is laid out as m || ctx || key, fixed up once the buffer stops moving
+	for (i = 0; i < count; i++){
+		Py_buffer m, ctx, key;
+		unsigned long long msg_id;
+		if (!get_encrypt_item(PySequence_Fast_GET_ITEM(seq, i), &m, &msg_id, &ctx, &key))
+			goto fail;
+		size_t need = m.len + hydro_secretbox_CONTEXTBYTES + hydro_secretbox_KEYBYTES;
+		PyObject* c = PyBytes_FromStringAndSize(NULL, hydro_secretbox_HEADERBYTES + m.len);
+		if (c == NULL || !grow_batch_buffer(&buf, &cap, used, need)){
+			Py_XDECREF(c);
+			PyBuffer_Release(&m);
+			PyBuffer_Release(&ctx);
+			PyBuffer_Release(&key);
+			goto fail;
+		}
+		PyList_SET_ITEM(ret, i, c);
+		items[i].c = (uint8_t*) PyBytes_AS_STRING(c);
+		items[i].mlen = m.len;
+		items[i].msg_id = msg_id;
+		offsets[i] = used;
+		memcpy(buf + used, m.buf, m.len);
+		memcpy(buf + used + m.len, ctx.buf, hydro_secretbox_CONTEXTBYTES);
+		memcpy(buf + used + m.len + hydro_secretbox_CONTEXTBYTES, key.buf, hydro_secretbox_KEYBYTES);
+		used += need;
+		PyBuffer_Release(&m);
+		PyBuffer_Release(&ctx);
+		PyBuffer_Release(&key);
+	}
+	//the IVs follow the items
+	size_t ivs = used;
+	if (!grow_batch_buffer(&buf, &cap, used, count * SECRETBOX_BATCH_IVBYTES))
+		goto fail;
+	used += count * SECRETBOX_BATCH_IVBYTES;
+	for (i = 0; i < count; i++){
+		items[i].m = buf + offsets[i];
+		items[i].ctx = items[i].m + items[i].mlen;
+		items[i].key = items[i].ctx + hydro_secretbox_CONTEXTBYTES;
+		items[i].iv = buf + ivs + i * SECRETBOX_BATCH_IVBYTES;
+	}
+
+	int res;
+	Py_BEGIN_ALLOW_THREADS
+	//one draw covers every IV, where hydro_secretbox_encrypt draws per message
+	PyThread_acquire_lock(random_lock, WAIT_LOCK);
+	hydro_random_buf(buf + ivs, count * SECRETBOX_BATCH_IVBYTES);
+	PyThread_release_lock(random_lock);
+	res = secretbox_encrypt_batch(items, count, backend);
+	Py_END_ALLOW_THREADS
+	if (res < 0){
+		PyErr_NoMemory();
+		goto fail;
+	}
+
+	Py_DECREF(seq);
+	free_batch_buffer(buf, used);
+	free(offsets);
+	free(items);
+	return ret;
+
+fail:
+	Py_DECREF(seq);
+	Py_XDECREF(ret);
+	free_batch_buffer(buf, used);
+	free(offsets);
+	free(items);
+	return NULL;
+}
+
+CRYPTO_FASTCALL(crypto_hash_batch, PyObject){
+	Py_buffer ctx = EMPTY_BUFFER, key = EMPTY_BUFFER;
+	Py_ssize_t outlen = hydro_hash_BYTES;
+	gimli_backend backend;
+	if (!check_nargs("hash_batch", nargs, 2, 5) || !get_buffer(args[1], &ctx, 0)
+			|| (nargs > 2 && args[2] != Py_None && !get_buffer(args[2], &key, 0))
+			|| (nargs > 3 && (outlen = PyNumber_AsSsize_t(args[3], PyExc_OverflowError)) == -1 && PyErr_Occurred())
+			|| !get_gimli_backend(nargs > 4 ? args[4] : Py_None, &backend)){
+		PyBuffer_Release(&ctx);
+		PyBuffer_Release(&key);
 		return NULL;
 	}
 
-	char m[clen - hydro_secretbox_HEADERBYTES];
-	if (hydro_secretbox_decrypt(m, c, clen, msg_id, ctx, key) != 0){ 
-		PyErr_Format(PyExc_ValueError, "Message forged: %s, did not decrypt successfully?\n", m);
+	//ctx and key are shared by the whole batch, so they are copied once
+	uint8_t ctx_copy[hydro_hash_CONTEXTBYTES], key_copy[hydro_hash_KEYBYTES];
+	int keyed = key.obj != NULL;
+	int ok = 0;
+	if (ctx.len != hydro_hash_CONTEXTBYTES){
+		PyErr_Format(PyExc_ValueError, "Context not of correct size: Received %zd bytes", ctx.len);
+	}
+	else if (keyed && key.len != hydro_hash_KEYBYTES){
+		PyErr_Format(PyExc_ValueError, "Key not of correct size: Received %zd bytes", key.len);
+	}
+	else if (outlen < hydro_hash_BYTES_MIN || outlen > hydro_hash_BYTES_MAX){
+		PyErr_Format(PyExc_ValueError, "Output length must be between %d and %d: Received %zd", hydro_hash_BYTES_MIN, hydro_hash_BYTES_MAX, outlen);
+	}
+	else {
+		memcpy(ctx_copy, ctx.buf, sizeof ctx_copy);
+		if (keyed)
+			memcpy(key_copy, key.buf, sizeof key_copy);
+		ok = 1;
+	}
+	PyBuffer_Release(&ctx);
+	PyBuffer_Release(&key);
+	if (!ok)
+		return NULL;
+
+	PyObject* seq = PySequence_Fast(args[0], "messages must be a sequence");
+	if (seq == NULL){
+		hydro_memzero(key_copy, sizeof key_copy);
 		return NULL;
 	}
-	PyObject *ret = Py_BuildValue("s#", m, clen-hydro_secretbox_HEADERBYTES);
+	Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+
+	hash_batch_item* items = calloc(count > 0 ? count : 1, sizeof *items);
+	size_t* offsets = calloc(count > 0 ? count : 1, sizeof *offsets);
+	PyObject* ret = PyList_New(count);
+	uint8_t* buf = NULL;
+	size_t used = 0, cap = 0;
+	Py_ssize_t i;
+	if (items == NULL || offsets == NULL){
+		PyErr_NoMemory();
+		goto fail;
+	}
+	if (ret == NULL)
+		goto fail;
+
+	for (i = 0; i < count; i++){
+		Py_buffer m;
+		if (!get_buffer(PySequence_Fast_GET_ITEM(seq, i), &m, 0))
+			goto fail;
+		PyObject* out = PyBytes_FromStringAndSize(NULL, outlen);
+		if (out == NULL || !grow_batch_buffer(&buf, &cap, used, m.len)){
+			Py_XDECREF(out);
+			PyBuffer_Release(&m);
+			goto fail;
+		}
+		PyList_SET_ITEM(ret, i, out);
+		items[i].out = (uint8_t*) PyBytes_AS_STRING(out);
+		items[i].mlen = m.len;
+		offsets[i] = used;
+		memcpy(buf + used, m.buf, m.len);
+		used += m.len;
+		PyBuffer_Release(&m);
+	}
+	for (i = 0; i < count; i++)
+		items[i].m = buf + offsets[i];
+
+	int res;
+	Py_BEGIN_ALLOW_THREADS
+	res = hash_batch(items, count, outlen, ctx_copy, keyed ? key_copy : NULL, backend);
+	Py_END_ALLOW_THREADS
+	if (res < 0){
+		PyErr_NoMemory();
+		goto fail;
+	}
+
+	Py_DECREF(seq);
+	free_batch_buffer(buf, used);
+	free(offsets);
+	free(items);
+	hydro_memzero(key_copy, sizeof key_copy);
 	return ret;
+
+fail:
+	Py_DECREF(seq);
+	Py_XDECREF(ret);
+	free_batch_buffer(buf, used);
+	free(offsets);
+	free(items);
+	hydro_memzero(key_copy, sizeof key_copy);
+	return NULL;
 }
 
-static PyObject* crypto_sign_verify(PyObject* self, PyObject* args){
-	uint8_t* csig;
-	size_t siglen;
-	char* m;
-	size_t mlen;
-	char* ctx;
-	size_t ctxlen;
-	uint8_t* pk;
-	size_t pklen;
-	PyArg_ParseTuple(args, "s#|s#|s#|s#", &csig, &siglen, &m, &mlen, &ctx, &ctxlen, &pk, &pklen);
-	if (ctxlen != hydro_sign_CONTEXTBYTES){
-		PyErr_Format(PyExc_ValueError, "Context not of correct size: Received %lu bytes", ctxlen);
+/*
+ * SecretBox holds one validated key and context, so per-request encryption
+ * skips parsing and checking them. The key lives on its own page, locked
+ * out of swap where RLIMIT_MEMLOCK allows and excluded from core dumps, and
+ * is zeroized when the object is freed. A page is used per key because
+ * munlock is not reference counted, so keys cannot share a locked page.
+ */
+typedef struct {
+	PyObject_HEAD
+	uint8_t* key;	/* hydro_secretbox_KEYBYTES at the start of a private page */
+	size_t key_pagelen;
+	char ctx[hydro_secretbox_CONTEXTBYTES];
+	int locked;
+} SecretBox;
+
+static PyObject* SecretBox_new(PyTypeObject* type, PyObject* args, PyObject* kwds){
+	static char* kwlist[] = {"key", "context", NULL};
+	Py_buffer key, ctx;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*s*", kwlist, &key, &ctx))
 		return NULL;
+
+	SecretBox* self = NULL;
+	if (!check_secretbox_args(&ctx, &key))
+		goto done;
+
+	self = (SecretBox*) type->tp_alloc(type, 0);
+	if (self == NULL)
+		goto done;
+
+	self->key_pagelen = sysconf(_SC_PAGESIZE);
+	void* page = mmap(NULL, self->key_pagelen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED){
+		Py_CLEAR(self);
+		PyErr_NoMemory();
+		goto done;
+	}
+#ifdef MADV_DONTDUMP
+	madvise(page, self->key_pagelen, MADV_DONTDUMP);
+#endif
+	self->locked = mlock(page, self->key_pagelen) == 0;
+	self->key = page;
+	memcpy(self->key, key.buf, hydro_secretbox_KEYBYTES);
+	memcpy(self->ctx, ctx.buf, hydro_secretbox_CONTEXTBYTES);
+
+done:
+	PyBuffer_Release(&key);
+	PyBuffer_Release(&ctx);
+	return (PyObject*) self;
+}
+
+static void SecretBox_dealloc(SecretBox* self){
+	if (self->key != NULL){
+		hydro_memzero(self->key, hydro_secretbox_KEYBYTES);
+		if (self->locked)
+			munlock(self->key, self->key_pagelen);
+		munmap(self->key, self->key_pagelen);
 	}
+	Py_TYPE(self)->tp_free((PyObject*) self);
+}
 
-	if(pklen != hydro_sign_PUBLICKEYBYTES){
-		PyErr_Format(PyExc_ValueError, "Public key not of correct size: Received %lu bytes", pklen);
+CRYPTO_FASTCALL(SecretBox_encrypt, SecretBox){
+	Py_buffer m;
+	unsigned long long msg_id = 0;
+	if (!check_nargs("encrypt", nargs, 1, 2) || (nargs > 1 && !get_msg_id(args[1], &msg_id)) || !get_buffer(args[0], &m, 0))
 		return NULL;
 
+	PyObject* ret = PyBytes_FromStringAndSize(NULL, hydro_secretbox_HEADERBYTES + m.len);
+	if (ret != NULL)
+		secretbox_encrypt_nogil((uint8_t*) PyBytes_AS_STRING(ret), &m, msg_id, self->ctx, self->key);
+	PyBuffer_Release(&m);
+	return ret;
+}
+
+CRYPTO_FASTCALL(SecretBox_encrypt_into, SecretBox){
+	Py_buffer out = EMPTY_BUFFER, m = EMPTY_BUFFER;
+	unsigned long long msg_id = 0;
+
+	PyObject* ret = NULL;
+	Py_ssize_t clen;
+	if (check_nargs("encrypt_into", nargs, 2, 3) && (nargs < 3 || get_msg_id(args[2], &msg_id))
+			&& get_buffer(args[0], &out, 1) && get_buffer(args[1], &m, 0)
+			&& check_output(&out, clen = hydro_secretbox_HEADERBYTES + m.len, &m)){
+		secretbox_encrypt_nogil(out.buf, &m, msg_id, self->ctx, self->key);
+		ret = PyInt_FromSsize_t(clen);
 	}
+	PyBuffer_Release(&out);
+	PyBuffer_Release(&m);
+	return ret;
+}
+
+CRYPTO_FASTCALL(SecretBox_decrypt, SecretBox){
+	Py_buffer c;
+	unsigned long long msg_id = 0;
+	if (!check_nargs("decrypt", nargs, 1, 2) || (nargs > 1 && !get_msg_id(args[1], &msg_id)) || !get_buffer(args[0], &c, 0))
+		return NULL;
+
+	PyObject* ret = NULL;
+	if (check_ciphertext(&c)){
+		ret = PyBytes_FromStringAndSize(NULL, c.len - hydro_secretbox_HEADERBYTES);
+		if (ret != NULL && !secretbox_decrypt_nogil((uint8_t*) PyBytes_AS_STRING(ret), &c, msg_id, self->ctx, self->key))
+			Py_CLEAR(ret);
+	}
+	PyBuffer_Release(&c);
+	return ret;
+}
+
+CRYPTO_FASTCALL(SecretBox_decrypt_into, SecretBox){
+	Py_buffer out = EMPTY_BUFFER, c = EMPTY_BUFFER;
+	unsigned long long msg_id = 0;
+
+	PyObject* ret = NULL;
+	Py_ssize_t mlen;
+	if (check_nargs("decrypt_into", nargs, 2, 3) && (nargs < 3 || get_msg_id(args[2], &msg_id))
+			&& get_buffer(args[0], &out, 1) && get_buffer(args[1], &c, 0)
+			&& check_ciphertext(&c) && check_output(&out, mlen = c.len - hydro_secretbox_HEADERBYTES, &c)
+			&& secretbox_decrypt_nogil(out.buf, &c, msg_id, self->ctx, self->key)){
+		ret = PyInt_FromSsize_t(mlen);
+	}
+	PyBuffer_Release(&out);
+	PyBuffer_Release(&c);
+	return ret;
+}
+
+static PyMethodDef SecretBox_methods[] = {
+	{"encrypt", CRYPTO_FUNC(SecretBox_encrypt), CRYPTO_METH_FASTCALL, "encrypt(m, msg_id=0): Encrypts message m"},
+	{"decrypt", CRYPTO_FUNC(SecretBox_decrypt), CRYPTO_METH_FASTCALL, "decrypt(c, msg_id=0): Decrypts ciphertext c, raising ValueError if it was forged"},
+	{"encrypt_into", CRYPTO_FUNC(SecretBox_encrypt_into), CRYPTO_METH_FASTCALL, "encrypt_into(out, m, msg_id=0): Encrypts m into the writable buffer out, returning the number of bytes written"},
+	{"decrypt_into", CRYPTO_FUNC(SecretBox_decrypt_into), CRYPTO_METH_FASTCALL, "decrypt_into(out, c, msg_id=0): Decrypts c into the writable buffer out, returning the number of bytes written"},
+	{NULL}
+};
+
+static PyMemberDef SecretBox_members[] = {
+	{"locked", T_INT, offsetof(SecretBox, locked), READONLY, "Whether the key memory is locked out of swap"},
+	{NULL}
+};
+
+static PyTypeObject SecretBoxType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"crypto.SecretBox",			/* tp_name */
+	sizeof(SecretBox),			/* tp_basicsize */
+	0,					/* tp_itemsize */
+	(destructor) SecretBox_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	"SecretBox(key, context): secretbox encryption with a fixed key and context",	/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	SecretBox_methods,			/* tp_methods */
+	SecretBox_members,			/* tp_members */
+	0,					/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	0,					/* tp_init */
+	0,					/* tp_alloc */
+	SecretBox_new,				/* tp_new */
+};
 
+/*
+ * Verifier holds one card's validated public key and the signing state
+ * after hydro_sign_init(ctx), which is the same for every message. verify()
+ * copies that state, absorbs the message and finishes the check, skipping
+ * argument validation and the context absorption. Decoding the key point
+ * happens inside hydrogen.c's verification core and is not reachable from
+ * the public API, so that part is still paid per call.
+ */
+typedef struct {
+	PyObject_HEAD
+	uint8_t pk[hydro_sign_PUBLICKEYBYTES];
+	hydro_sign_state init;
+} Verifier;
 
-	if(hydro_sign_verify(csig, m, mlen, ctx, pk) != 0){
-		PyErr_Format(PyExc_ValueError, "Message failed to verify\n");
+static PyObject* Verifier_new(PyTypeObject* type, PyObject* args, PyObject* kwds){
+	static char* kwlist[] = {"pk", "context", NULL};
+	Py_buffer pk, ctx;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*s*", kwlist, &pk, &ctx))
 		return NULL;
+
+	Verifier* self = NULL;
+	if (pk.len != hydro_sign_PUBLICKEYBYTES){
+		PyErr_Format(PyExc_ValueError, "Public key not of correct size: Received %zd bytes", pk.len);
+	}
+	else if (ctx.len != hydro_sign_CONTEXTBYTES){
+		PyErr_Format(PyExc_ValueError, "Context not of correct size: Received %zd bytes", ctx.len);
+	}
+	else {
+		self = (Verifier*) type->tp_alloc(type, 0);
+		if (self != NULL){
+			memcpy(self->pk, pk.buf, hydro_sign_PUBLICKEYBYTES);
+			hydro_sign_init(&self->init, ctx.buf);
+		}
 	}
-	
-	Py_INCREF(Py_None);
-	return Py_None;
 
+	PyBuffer_Release(&pk);
+	PyBuffer_Release(&ctx);
+	return (PyObject*) self;
 }
 
+CRYPTO_FASTCALL(Verifier_verify, Verifier){
+	Py_buffer csig, m;
+	if (!check_nargs("verify", nargs, 2, 2) || !get_buffer(args[0], &csig, 0))
+		return NULL;
+	if (!get_buffer(args[1], &m, 0)){
+		PyBuffer_Release(&csig);
+		return NULL;
+	}
+
+	int res = -1;
+	if (csig.len == hydro_sign_BYTES){
+		Py_BEGIN_ALLOW_THREADS
+		hydro_sign_state st = self->init;
+		hydro_sign_update(&st, m.buf, m.len);
+		res = hydro_sign_final_verify(&st, csig.buf, self->pk);
+		Py_END_ALLOW_THREADS
+	}
+
+	PyBuffer_Release(&csig);
+	PyBuffer_Release(&m);
+	return PyBool_FromLong(res == 0);
+}
+
+static PyMethodDef Verifier_methods[] = {
+	{"verify", CRYPTO_FUNC(Verifier_verify), CRYPTO_METH_FASTCALL, "verify(sig, m): Returns True if m verifies with signature sig under this key"},
+	{NULL}
+};
+
+static PyTypeObject VerifierType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"crypto.Verifier",			/* tp_name */
+	sizeof(Verifier),			/* tp_basicsize */
+	0,					/* tp_itemsize */
+	0,					/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	"Verifier(pk, context): signature verification with a fixed public key and context",	/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	Verifier_methods,			/* tp_methods */
+	0,					/* tp_members */
+	0,					/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	0,					/* tp_init */
+	0,					/* tp_alloc */
+	Verifier_new,				/* tp_new */
+};
+
 static char module_docstring[] = "This module provides an interface for several libhydrogen functions";
 static char secretbox_encrypt_docstring[] = "Encrypts a message of length mlen, using a context and secret key, with message counter msg_id";
 static char secretbox_decrypt_docstring[] = "Decrypts ciphertext, using the message id, context, and secret key";
+static char secretbox_encrypt_into_docstring[] = "Encrypts message m into the writable buffer out, returning the number of bytes written";
+static char secretbox_decrypt_into_docstring[] = "Decrypts ciphertext c into the writable buffer out, returning the number of bytes written";
 static char sign_verify_docstring[] = "Checks if message m verifies with signature csig, with context ctx and publike key pk";
+static char sign_verify_batch_docstring[] = "Verifies a sequence of (sig, msg, pk) with context ctx over up to threads threads, returning a list of bools";
+static char hash_docstring[] = "hash(m, ctx, key=None, outlen=32): Hashes m with context ctx and optional 32 byte key";
+static char sign_keygen_deterministic_docstring[] = "Derives the (pk, sk) signing keypair for a 32 byte seed";
+static char sign_create_docstring[] = "Signs message m with context ctx and secret key sk, returning the signature";
+static char gimli_permute_batch_docstring[] = "Applies the Gimli permutation in place to every 48 byte state in the writable buffer, with the named backend or the fastest supported one, returning the number of states";
+static char secretbox_encrypt_batch_docstring[] = "Encrypts a sequence of (m, msg_id, ctx, key) items in lockstep over the batched Gimli permutation, returning the list of ciphertexts. The ciphertexts decrypt with secretbox_decrypt";
+static char hash_batch_docstring[] = "hash_batch(messages, ctx, key=None, outlen=32, backend=None): Hashes every message as hash() would, in lockstep over the batched Gimli permutation, returning the list of digests";
+static char gimli_backends_docstring[] = "Lists the Gimli backends this CPU supports, slowest first";
 static PyMethodDef module_methods[] = {
-	{"secretbox_encrypt", crypto_secretbox_encrypt, METH_VARARGS, secretbox_encrypt_docstring},
-	{"secretbox_decrypt", crypto_secretbox_decrypt, METH_VARARGS, secretbox_decrypt_docstring},
-	{"sign_verify", crypto_sign_verify, METH_VARARGS, sign_verify_docstring}
+	{"secretbox_encrypt", CRYPTO_FUNC(crypto_secretbox_encrypt), CRYPTO_METH_FASTCALL, secretbox_encrypt_docstring},
+	{"secretbox_decrypt", CRYPTO_FUNC(crypto_secretbox_decrypt), CRYPTO_METH_FASTCALL, secretbox_decrypt_docstring},
+	{"secretbox_encrypt_into", CRYPTO_FUNC(crypto_secretbox_encrypt_into), CRYPTO_METH_FASTCALL, secretbox_encrypt_into_docstring},
+	{"secretbox_decrypt_into", CRYPTO_FUNC(crypto_secretbox_decrypt_into), CRYPTO_METH_FASTCALL, secretbox_decrypt_into_docstring},
+	{"sign_verify", CRYPTO_FUNC(crypto_sign_verify), CRYPTO_METH_FASTCALL, sign_verify_docstring},
+	{"hash", CRYPTO_FUNC(crypto_hash), CRYPTO_METH_FASTCALL, hash_docstring},
+	{"sign_keygen_deterministic", CRYPTO_FUNC(crypto_sign_keygen_deterministic), CRYPTO_METH_FASTCALL, sign_keygen_deterministic_docstring},
+	{"sign_create", CRYPTO_FUNC(crypto_sign_create), CRYPTO_METH_FASTCALL, sign_create_docstring},
+	{"sign_verify_batch", CRYPTO_FUNC(crypto_sign_verify_batch), CRYPTO_METH_FASTCALL, sign_verify_batch_docstring},
+	{"gimli_permute_batch", CRYPTO_FUNC(crypto_gimli_permute_batch), CRYPTO_METH_FASTCALL, gimli_permute_batch_docstring},
+	{"secretbox_encrypt_batch", CRYPTO_FUNC(crypto_secretbox_encrypt_batch), CRYPTO_METH_FASTCALL, secretbox_encrypt_batch_docstring},
+	{"hash_batch", CRYPTO_FUNC(crypto_hash_batch), CRYPTO_METH_FASTCALL, hash_batch_docstring},
+	{"gimli_backends", crypto_gimli_backends, METH_NOARGS, gimli_backends_docstring},
+	{NULL}
 };
 
+/*
+ * Module setup, run once per module object. random_lock and the verify pool
+ * stay process globals rather than module state: they guard libhydrogen's
+ * global random state and process-wide threads, which every copy of the
+ * module shares.
+ */
+static int crypto_exec(PyObject* m){
+	if (random_lock == NULL){
+		//seed the random state up front instead of lazily from whichever thread gets there first
+		if (hydro_init() != 0){
+			PyErr_SetString(PyExc_ImportError, "libhydrogen failed to initialize");
+			return -1;
+		}
+
+		random_lock = PyThread_allocate_lock();
+		if (random_lock == NULL){
+			PyErr_NoMemory();
+			return -1;
+		}
+		pthread_atfork(NULL, NULL, pool_reset_child);
+	}
+
+	if (PyType_Ready(&SecretBoxType) < 0 || PyType_Ready(&VerifierType) < 0)
+		return -1;
+
+	Py_INCREF(&SecretBoxType);
+	if (PyModule_AddObject(m, "SecretBox", (PyObject*) &SecretBoxType) < 0){
+		Py_DECREF(&SecretBoxType);
+		return -1;
+	}
+	Py_INCREF(&VerifierType);
+	if (PyModule_AddObject(m, "Verifier", (PyObject*) &VerifierType) < 0){
+		Py_DECREF(&VerifierType);
+		return -1;
+	}
+	return 0;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static PyModuleDef_Slot module_slots[] = {
+	{Py_mod_exec, crypto_exec},
+	{0, NULL}
+};
+
+static struct PyModuleDef crypto_module = {
+	PyModuleDef_HEAD_INIT,
+	"crypto",
+	module_docstring,
+	0,
+	module_methods,
+	module_slots,
+};
+
+PyMODINIT_FUNC PyInit_crypto(void){
+	return PyModuleDef_Init(&crypto_module);
+}
+#else
 PyMODINIT_FUNC initcrypto(void){
 	PyObject *m = Py_InitModule3("crypto", module_methods, module_docstring);
-	if (m == NULL)
-		return;
-	//printf("Init\n");
-
+	if (m != NULL)
+		crypto_exec(m);
 }
+#endif
@@ -0,0 +1,202 @@
+#include <string.h>
+#include "gimli_batch.h"
+
+/*
+ * The permutation is the reference Gimli (and libhydrogen's portable
+ * gimli_core). The SIMD backends run it on several states at once by
+ * transposing them so that vector lane j holds state j: every word of the
+ * state becomes one register and the column swaps become register renames.
+ * They are compiled with per-function target attributes and picked at run
+ * time, so the extension still loads on CPUs without AVX2.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GIMLI_X86 1
+#include <immintrin.h>
+#endif
+
+#define ROTL32(x, b) (uint32_t) (((x) << (b)) | ((x) >> (32 - (b))))
+
+static uint32_t load32_le(const uint8_t* p){
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void store32_le(uint8_t* p, uint32_t x){
+	p[0] = (uint8_t) x;
+	p[1] = (uint8_t) (x >> 8);
+	p[2] = (uint8_t) (x >> 16);
+	p[3] = (uint8_t) (x >> 24);
+}
+
+static void gimli_scalar_1(uint8_t* state){
+	uint32_t s[12];
+	uint32_t x, y, z;
+	int i, round, column;
+
+	for (i = 0; i < 12; i++)
+		s[i] = load32_le(state + 4 * i);
+
+	for (round = 24; round > 0; round--){
+		for (column = 0; column < 4; column++){
+			x = ROTL32(s[column], 24);
+			y = ROTL32(s[4 + column], 9);
+			z = s[8 + column];
+
+			s[8 + column] = x ^ (z << 1) ^ ((y & z) << 2);
+			s[4 + column] = y ^ x ^ ((x | z) << 1);
+			s[column] = z ^ y ^ ((x & y) << 3);
+		}
+		switch (round & 3){
+		case 0:
+			x = s[0]; s[0] = s[1]; s[1] = x;
+			x = s[2]; s[2] = s[3]; s[3] = x;
+			s[0] ^= (0x9e377900 | round);
+			break;
+		case 2:
+			x = s[0]; s[0] = s[2]; s[2] = x;
+			x = s[1]; s[1] = s[3]; s[3] = x;
+			break;
+		}
+	}
+
+	for (i = 0; i < 12; i++)
+		store32_le(state + 4 * i, s[i]);
+}
+
+#ifdef GIMLI_X86
+
+#define SWAP(a, b) do { tmp = (a); (a) = (b); (b) = tmp; } while (0)
+
+__attribute__((target("sse2")))
+static void gimli_sse2_4(uint8_t* states){
+	uint32_t lanes[12][4] __attribute__((aligned(16)));
+	__m128i s[12], x, y, z, tmp;
+	int i, j, round, column;
+
+	for (j = 0; j < 4; j++)
+		for (i = 0; i < 12; i++)
+			lanes[i][j] = load32_le(states + j * GIMLI_BLOCKBYTES + 4 * i);
+	for (i = 0; i < 12; i++)
+		s[i] = _mm_load_si128((const __m128i*) lanes[i]);
+
+	for (round = 24; round > 0; round--){
+		//unrolled so s[] stays in registers instead of being indexed in memory
+#pragma GCC unroll 4
+		for (column = 0; column < 4; column++){
+			x = _mm_or_si128(_mm_slli_epi32(s[column], 24), _mm_srli_epi32(s[column], 8));
+			y = _mm_or_si128(_mm_slli_epi32(s[4 + column], 9), _mm_srli_epi32(s[4 + column], 23));
+			z = s[8 + column];
+
+			s[8 + column] = _mm_xor_si128(_mm_xor_si128(x, _mm_slli_epi32(z, 1)),
+			                              _mm_slli_epi32(_mm_and_si128(y, z), 2));
+			s[4 + column] = _mm_xor_si128(_mm_xor_si128(y, x),
+			                              _mm_slli_epi32(_mm_or_si128(x, z), 1));
+			s[column] = _mm_xor_si128(_mm_xor_si128(z, y),
+			                          _mm_slli_epi32(_mm_and_si128(x, y), 3));
+		}
+		switch (round & 3){
+		case 0:
+			SWAP(s[0], s[1]);
+			SWAP(s[2], s[3]);
+			s[0] = _mm_xor_si128(s[0], _mm_set1_epi32(0x9e377900 | round));
+			break;
+		case 2:
+			SWAP(s[0], s[2]);
+			SWAP(s[1], s[3]);
+			break;
+		}
+	}
+
+	for (i = 0; i < 12; i++)
+		_mm_store_si128((__m128i*) lanes[i], s[i]);
+	for (j = 0; j < 4; j++)
+		for (i = 0; i < 12; i++)
+			store32_le(states + j * GIMLI_BLOCKBYTES + 4 * i, lanes[i][j]);
+}
+
+__attribute__((target("avx2")))
+static void gimli_avx2_8(uint8_t* states){
+	uint32_t lanes[12][8] __attribute__((aligned(32)));
+	__m256i s[12], x, y, z, tmp;
+	int i, j, round, column;
+
+	for (j = 0; j < 8; j++)
+		for (i = 0; i < 12; i++)
+			lanes[i][j] = load32_le(states + j * GIMLI_BLOCKBYTES + 4 * i);
+	for (i = 0; i < 12; i++)
+		s[i] = _mm256_load_si256((const __m256i*) lanes[i]);
+
+	for (round = 24; round > 0; round--){
+		//unrolled so s[] stays in registers instead of being indexed in memory
+#pragma GCC unroll 4
+		for (column = 0; column < 4; column++){
+			x = _mm256_or_si256(_mm256_slli_epi32(s[column], 24), _mm256_srli_epi32(s[column], 8));
+			y = _mm256_or_si256(_mm256_slli_epi32(s[4 + column], 9), _mm256_srli_epi32(s[4 + column], 23));
+			z = s[8 + column];
+
+			s[8 + column] = _mm256_xor_si256(_mm256_xor_si256(x, _mm256_slli_epi32(z, 1)),
+			                                 _mm256_slli_epi32(_mm256_and_si256(y, z), 2));
+			s[4 + column] = _mm256_xor_si256(_mm256_xor_si256(y, x),
+			                                 _mm256_slli_epi32(_mm256_or_si256(x, z), 1));
+			s[column] = _mm256_xor_si256(_mm256_xor_si256(z, y),
+			                             _mm256_slli_epi32(_mm256_and_si256(x, y), 3));
+		}
+		switch (round & 3){
+		case 0:
+			SWAP(s[0], s[1]);
+			SWAP(s[2], s[3]);
+			s[0] = _mm256_xor_si256(s[0], _mm256_set1_epi32(0x9e377900 | round));
+			break;
+		case 2:
+			SWAP(s[0], s[2]);
+			SWAP(s[1], s[3]);
+			break;
+		}
+	}
+
+	for (i = 0; i < 12; i++)
+		_mm256_store_si256((__m256i*) lanes[i], s[i]);
+	for (j = 0; j < 8; j++)
+		for (i = 0; i < 12; i++)
+			store32_le(states + j * GIMLI_BLOCKBYTES + 4 * i, lanes[i][j]);
+}
+
+#endif
+
+gimli_backend gimli_best_backend(void){
+#ifdef GIMLI_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return GIMLI_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return GIMLI_SSE2;
+#endif
+	return GIMLI_SCALAR;
+}
+
+const char* gimli_backend_name(gimli_backend backend){
+	switch (backend){
+	case GIMLI_AVX2:
+		return "avx2";
+	case GIMLI_SSE2:
+		return "sse2";
+	default:
+		return "scalar";
+	}
+}
+
+void gimli_permute_batch(uint8_t* states, size_t count, gimli_backend backend){
+	size_t i = 0;
+
+#ifdef GIMLI_X86
+	if (backend == GIMLI_AVX2)
+		for (; i + 8 <= count; i += 8)
+			gimli_avx2_8(states + i * GIMLI_BLOCKBYTES);
+	if (backend >= GIMLI_SSE2)
+		for (; i + 4 <= count; i += 4)
+			gimli_sse2_4(states + i * GIMLI_BLOCKBYTES);
+#endif
+
+	for (; i < count; i++)
+		gimli_scalar_1(states + i * GIMLI_BLOCKBYTES);
+}
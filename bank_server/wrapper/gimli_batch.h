@@ -0,0 +1,30 @@
+#ifndef GIMLI_BATCH_H
+#define GIMLI_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Multi-buffer Gimli permutation. A batch is count independent 48 byte
+ * Gimli states laid out back to back, each holding 12 little-endian 32-bit
+ * words exactly as libhydrogen's gimli_core_u8 sees them. The SIMD backends
+ * permute 4 (SSE2) or 8 (AVX2) states at once and fall back to the scalar
+ * core for the remainder.
+ */
+#define GIMLI_BLOCKBYTES 48
+
+typedef enum {
+	GIMLI_SCALAR = 0,
+	GIMLI_SSE2 = 1,
+	GIMLI_AVX2 = 2
+} gimli_backend;
+
+/* Best backend the running CPU supports */
+gimli_backend gimli_best_backend(void);
+
+const char* gimli_backend_name(gimli_backend backend);
+
+/* Permutes count states in place with the given backend, which must be supported */
+void gimli_permute_batch(uint8_t* states, size_t count, gimli_backend backend);
+
+#endif
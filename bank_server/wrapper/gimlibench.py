@@ -0,0 +1,97 @@
+import crypto
+import os
+import struct
+import time
+
+#reference Gimli test vector: state word i starts as i^3 + i*0x9e3779b9
+state = struct.pack("<12I", *[(i * i * i + i * 0x9e3779b9) & 0xffffffff for i in range(12)])
+expected = struct.pack("<12I", 0xba11c85a, 0x91bad119, 0x380ce880, 0xd24c2c68,
+                       0x3eceffea, 0x277a921c, 0x4f73a0bd, 0xda5a9cd8,
+                       0x84b673f0, 0x34e52ff7, 0x9e2bef49, 0xf41bb8d6)
+
+backends = crypto.gimli_backends()
+print "gimli backends:", ", ".join(backends)
+
+#every backend must match the vector, including in the scalar tail after a full SIMD block
+for name in backends:
+    buf = bytearray(state * 11)
+    crypto.gimli_permute_batch(buf, name)
+    assert str(buf) == expected * 11, name
+
+#and agree with scalar on random states
+data = os.urandom(48 * 37)
+want = bytearray(data)
+crypto.gimli_permute_batch(want, "scalar")
+for name in backends:
+    buf = bytearray(data)
+    crypto.gimli_permute_batch(buf, name)
+    assert buf == want, name
+print "gimli backends agree with the test vector"
+
+#the batched secretbox and hash must match the single calls byte for byte
+ctx = "batchctx"
+messages = [os.urandom(n) for n in range(0, 100)] + [os.urandom(n % 40) for n in range(300)]
+keys = [os.urandom(32) for _ in messages]
+for name in backends:
+    for key in (None, os.urandom(32)):
+        for outlen in (16, 32, 33, 64, 100):
+            digests = crypto.hash_batch(messages, ctx, key, outlen, name)
+            assert digests == [crypto.hash(m, ctx, key, outlen) for m in messages], name
+
+    items = [(m, i, ctx, k) for i, (m, k) in enumerate(zip(messages, keys))]
+    for (m, i, _, k), c in zip(items, crypto.secretbox_encrypt_batch(items, name)):
+        assert crypto.secretbox_decrypt(c, i, ctx, k) == m, name
+        forged = bytearray(c)
+        forged[-1] ^= 1
+        try:
+            crypto.secretbox_decrypt(bytes(forged), i, ctx, k)
+            assert False, name
+        except ValueError:
+            pass
+print "batched secretbox and hash agree with the single calls"
+
+def bench_gimli(states=4096, seconds=1.0):
+    buf = bytearray(os.urandom(48 * states))
+    base = None
+    print "gimli_permute_batch throughput (batches of %d states)" % states
+    for name in backends:
+        runs = 0
+        start = time.time()
+        while time.time() - start < seconds:
+            crypto.gimli_permute_batch(buf, name)
+            runs += 1
+        rate = runs * states / (time.time() - start)
+        base = base or rate
+        print "  %6s: %11.0f permutations/sec (%.2fx)" % (name, rate, rate / base)
+
+bench_gimli()
+
+def bench_batch(batch=512, size=64, seconds=1.0):
+    """Compares a loop of single calls with the batched calls on every backend"""
+    key = os.urandom(32)
+    messages = [os.urandom(size) for _ in range(batch)]
+    items = [(m, i, ctx, key) for i, m in enumerate(messages)]
+    cases = [
+        ("secretbox", lambda: [crypto.secretbox_encrypt(m, i, c, k) for m, i, c, k in items],
+            lambda name: crypto.secretbox_encrypt_batch(items, name)),
+        ("hash", lambda: [crypto.hash(m, ctx, key) for m in messages],
+            lambda name: crypto.hash_batch(messages, ctx, key, 32, name)),
+    ]
+
+    def rate(fn):
+        runs = 0
+        start = time.time()
+        while time.time() - start < seconds:
+            fn()
+            runs += 1
+        return runs * batch / (time.time() - start)
+
+    print "batched throughput (batches of %d %d byte messages)" % (batch, size)
+    for label, single, batched in cases:
+        base = rate(single)
+        print "  %9s %6s: %11.0f ops/sec" % (label, "single", base)
+        for name in backends:
+            r = rate(lambda: batched(name))
+            print "  %9s %6s: %11.0f ops/sec (%.2fx)" % (label, name, r, r / base)
+
+bench_batch()
@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <string.h>
+#include "./libhydrogen/hydrogen.h"
+#include "hydro_batch.h"
+
+/*
+ * The steps below follow hydro_secretbox_encrypt_iv (impl/secretbox.h) and
+ * hydro_hash_init/update/final (impl/hash.h) one for one. libhydrogen keeps
+ * its sponge helpers static, so the constants and the padding are repeated
+ * here. Every lane of a run absorbs the same number of blocks, so each
+ * gimli_core_u8 call of the scalar code becomes one gimli_permute_batch call
+ * over all the lanes.
+ */
+#define RATE 16
+
+#define TAG_HEADER 0x01
+#define TAG_PAYLOAD 0x02
+#define TAG_FINAL 0x08
+#define TAG_FINAL0 0xf8
+#define TAG_KEY0 0xfe
+#define TAG_KEY 0xff
+
+#define DOMAIN_AEAD 0x0
+#define DOMAIN_XOF 0xf
+
+#define SIVBYTES 20
+#define MACBYTES 16
+
+typedef struct {
+	uint8_t* states;
+	size_t count;
+	gimli_backend backend;
+} lanes;
+
+static uint8_t* lane(const lanes* l, size_t k){
+	return l->states + k * GIMLI_BLOCKBYTES;
+}
+
+/* gimli_core_u8 on every lane */
+static void permute(const lanes* l, uint8_t tag){
+	size_t k;
+	for (k = 0; k < l->count; k++)
+		lane(l, k)[GIMLI_BLOCKBYTES - 1] ^= tag;
+	gimli_permute_batch(l->states, l->count, l->backend);
+}
+
+static void mem_xor(uint8_t* dst, const uint8_t* src, size_t len){
+	size_t i;
+	for (i = 0; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+static void pad(uint8_t* buf, size_t pos, uint8_t domain){
+	buf[pos] ^= (domain << 1) | 1;
+	buf[RATE - 1] ^= 0x80;
+}
+
+/*******************************************************************************
+ * secretbox
+ */
+
+static void secretbox_setup(const lanes* l, secretbox_batch_item** items, int siv, uint8_t key_tag){
+	static const uint8_t prefix[] = {6, 's', 'b', 'x', '2', '5', '6', 8};
+	size_t k;
+	int i;
+
+	for (k = 0; k < l->count; k++){
+		uint8_t* buf = lane(l, k);
+		memset(buf, 0, GIMLI_BLOCKBYTES);
+		memcpy(buf, prefix, sizeof prefix);
+		memcpy(buf + sizeof prefix, items[k]->ctx, hydro_secretbox_CONTEXTBYTES);
+	}
+	permute(l, TAG_HEADER);
+
+	for (k = 0; k < l->count; k++)
+		mem_xor(lane(l, k), items[k]->key, RATE);
+	permute(l, key_tag);
+	for (k = 0; k < l->count; k++)
+		mem_xor(lane(l, k), items[k]->key + RATE, RATE);
+	permute(l, key_tag);
+
+	//the second pass is keyed with the SIV the first pass left at the start of c
+	for (k = 0; k < l->count; k++){
+		uint8_t* buf = lane(l, k);
+		buf[0] ^= SECRETBOX_BATCH_IVBYTES;
+		mem_xor(buf + 1, siv ? items[k]->c : items[k]->iv, RATE - 1);
+	}
+	permute(l, TAG_HEADER);
+	for (k = 0; k < l->count; k++){
+		uint8_t* buf = lane(l, k);
+		uint8_t msg_id_le[8];
+		for (i = 0; i < 8; i++)
+			msg_id_le[i] = (uint8_t) (items[k]->msg_id >> (8 * i));
+		mem_xor(buf, (siv ? items[k]->c : items[k]->iv) + RATE - 1, SECRETBOX_BATCH_IVBYTES - (RATE - 1));
+		mem_xor(buf + SECRETBOX_BATCH_IVBYTES - RATE, msg_id_le, 8);
+	}
+	permute(l, TAG_HEADER);
+}
+
+static void secretbox_finalize(const lanes* l, secretbox_batch_item** items, uint8_t tag){
+	size_t k;
+	for (k = 0; k < l->count; k++)
+		mem_xor(lane(l, k) + RATE, items[k]->key, hydro_secretbox_KEYBYTES);
+	permute(l, tag);
+	for (k = 0; k < l->count; k++)
+		mem_xor(lane(l, k) + RATE, items[k]->key, hydro_secretbox_KEYBYTES);
+	permute(l, tag);
+}
+
+/* Encrypts a run of items that all have length mlen */
+static void secretbox_encrypt_run(const lanes* l, secretbox_batch_item** items, size_t mlen){
+	size_t blocks = mlen / RATE;
+	size_t leftover = mlen % RATE;
+	size_t i, k;
+
+	//first pass: the SIV is a MAC of the message under the random IV
+	secretbox_setup(l, items, 0, TAG_KEY0);
+	for (i = 0; i < blocks; i++){
+		for (k = 0; k < l->count; k++)
+			mem_xor(lane(l, k), items[k]->m + i * RATE, RATE);
+		permute(l, TAG_PAYLOAD);
+	}
+	for (k = 0; k < l->count; k++){
+		mem_xor(lane(l, k), items[k]->m + blocks * RATE, leftover);
+		pad(lane(l, k), leftover, DOMAIN_XOF);
+	}
+	permute(l, TAG_PAYLOAD);
+	secretbox_finalize(l, items, TAG_FINAL0);
+	for (k = 0; k < l->count; k++)
+		memcpy(items[k]->c, lane(l, k) + RATE, SIVBYTES);
+
+	//second pass: encrypt under the SIV, then squeeze the MAC
+	secretbox_setup(l, items, 1, TAG_KEY);
+	for (i = 0; i <= blocks; i++){
+		size_t len = i < blocks ? RATE : leftover;
+		for (k = 0; k < l->count; k++){
+			uint8_t* buf = lane(l, k);
+			uint8_t* ct = items[k]->c + hydro_secretbox_HEADERBYTES + i * RATE;
+			const uint8_t* m = items[k]->m + i * RATE;
+			size_t j;
+			for (j = 0; j < len; j++)
+				ct[j] = m[j] ^ buf[j];
+			memcpy(buf, ct, len);
+			if (i == blocks)
+				pad(buf, leftover, DOMAIN_AEAD);
+		}
+		permute(l, TAG_PAYLOAD);
+	}
+	secretbox_finalize(l, items, TAG_FINAL);
+	for (k = 0; k < l->count; k++)
+		memcpy(items[k]->c + SIVBYTES, lane(l, k) + RATE, MACBYTES);
+}
+
+static int secretbox_cmp(const void* a, const void* b){
+	size_t x = (*(secretbox_batch_item* const*) a)->mlen;
+	size_t y = (*(secretbox_batch_item* const*) b)->mlen;
+	return (x > y) - (x < y);
+}
+
+int secretbox_encrypt_batch(secretbox_batch_item* items, size_t count, gimli_backend backend){
+	secretbox_batch_item** order = malloc((count > 0 ? count : 1) * sizeof *order);
+	uint8_t* states = malloc((count > 0 ? count : 1) * GIMLI_BLOCKBYTES);
+	size_t i, run;
+
+	if (order == NULL || states == NULL){
+		free(order);
+		free(states);
+		return -1;
+	}
+	for (i = 0; i < count; i++)
+		order[i] = &items[i];
+	qsort(order, count, sizeof *order, secretbox_cmp);
+
+	for (i = 0; i < count; i += run){
+		lanes l;
+		for (run = 1; i + run < count && order[i + run]->mlen == order[i]->mlen; run++)
+			;
+		l.states = states;
+		l.count = run;
+		l.backend = backend;
+		secretbox_encrypt_run(&l, order + i, order[i]->mlen);
+	}
+
+	//the states held keyed sponge state
+	hydro_memzero(states, (count > 0 ? count : 1) * GIMLI_BLOCKBYTES);
+	free(states);
+	free(order);
+	return 0;
+}
+
+/*******************************************************************************
+ * hash
+ */
+
+/*
+ * hydro_hash_update on every lane: from m[k] if it is set, else from shared.
+ * A block is permuted only once more input arrives for it, as in libhydrogen
+ */
+static void hash_absorb(const lanes* l, hash_batch_item** items, const uint8_t* shared, size_t len, size_t* off){
+	size_t pos = 0;
+	size_t k;
+
+	while (pos < len){
+		size_t ps;
+		if (*off == RATE){
+			permute(l, 0);
+			*off = 0;
+		}
+		ps = len - pos;
+		if (ps > RATE - *off)
+			ps = RATE - *off;
+		for (k = 0; k < l->count; k++)
+			mem_xor(lane(l, k) + *off, (shared != NULL ? shared : items[k]->m) + pos, ps);
+		*off += ps;
+		pos += ps;
+	}
+}
+
+/* Hashes a run of items that all have length mlen */
+static void hash_run(const lanes* l, hash_batch_item** items, size_t mlen, size_t outlen,
+                     const uint8_t* ctx, const uint8_t* key){
+	uint8_t block[64] = {4, 'k', 'm', 'a', 'c', 8};
+	uint8_t lc[4];
+	size_t off = 0;
+	size_t p, i, k;
+
+	//hydro_hash_init: pad(str_enc("kmac") || str_enc(context)) || pad(str_enc(k))
+	memcpy(block + 6, ctx, hydro_hash_CONTEXTBYTES);
+	if (key != NULL){
+		block[RATE] = (uint8_t) hydro_hash_KEYBYTES;
+		memcpy(block + RATE + 1, key, hydro_hash_KEYBYTES);
+		p = (RATE + 1 + hydro_hash_KEYBYTES + (RATE - 1)) & ~(size_t) (RATE - 1);
+	}
+	else {
+		p = (RATE + 1 + (RATE - 1)) & ~(size_t) (RATE - 1);
+	}
+	memset(l->states, 0, l->count * GIMLI_BLOCKBYTES);
+	hash_absorb(l, items, block, p, &off);
+	hydro_memzero(block, sizeof block);
+
+	//the message
+	hash_absorb(l, items, NULL, mlen, &off);
+
+	//hydro_hash_final: right_enc(outlen) || 0x00, pad, squeeze
+	lc[1] = (uint8_t) outlen;
+	lc[2] = (uint8_t) (outlen >> 8);
+	lc[3] = 0;
+	lc[0] = (uint8_t) (1 + (lc[2] != 0));
+	hash_absorb(l, items, lc, 1 + lc[0] + 1, &off);
+	for (k = 0; k < l->count; k++)
+		pad(lane(l, k), off, DOMAIN_XOF);
+	for (i = 0; i < outlen; i += RATE){
+		size_t len = outlen - i < RATE ? outlen - i : RATE;
+		permute(l, 0);
+		for (k = 0; k < l->count; k++)
+			memcpy(items[k]->out + i, lane(l, k), len);
+	}
+}
+
+static int hash_cmp(const void* a, const void* b){
+	size_t x = (*(hash_batch_item* const*) a)->mlen;
+	size_t y = (*(hash_batch_item* const*) b)->mlen;
+	return (x > y) - (x < y);
+}
+
+int hash_batch(hash_batch_item* items, size_t count, size_t outlen,
+               const uint8_t* ctx, const uint8_t* key, gimli_backend backend){
+	hash_batch_item** order = malloc((count > 0 ? count : 1) * sizeof *order);
+	uint8_t* states = malloc((count > 0 ? count : 1) * GIMLI_BLOCKBYTES);
+	size_t i, run;
+
+	if (order == NULL || states == NULL){
+		free(order);
+		free(states);
+		return -1;
+	}
+	for (i = 0; i < count; i++)
+		order[i] = &items[i];
+	qsort(order, count, sizeof *order, hash_cmp);
+
+	for (i = 0; i < count; i += run){
+		lanes l;
+		for (run = 1; i + run < count && order[i + run]->mlen == order[i]->mlen; run++)
+			;
+		l.states = states;
+		l.count = run;
+		l.backend = backend;
+		hash_run(&l, order + i, order[i]->mlen, outlen, ctx, key);
+	}
+
+	hydro_memzero(states, (count > 0 ? count : 1) * GIMLI_BLOCKBYTES);
+	free(states);
+	free(order);
+	return 0;
+}
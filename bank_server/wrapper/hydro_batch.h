@@ -0,0 +1,48 @@
+#ifndef HYDRO_BATCH_H
+#define HYDRO_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "gimli_batch.h"
+
+/*
+ * libhydrogen's secretbox encryption and keyed hash run on many independent
+ * inputs at once over the multi-buffer Gimli permutation. The output is
+ * byte for byte what hydro_secretbox_encrypt and hydro_hash_hash produce
+ * for the same inputs (and, for the secretbox, the same IV), so the HSMs
+ * decrypt batched ciphertexts with their unmodified libhydrogen.
+ */
+#define SECRETBOX_BATCH_IVBYTES 20
+
+typedef struct {
+	const uint8_t* m;
+	size_t mlen;
+	uint64_t msg_id;
+	const uint8_t* ctx;	/* hydro_secretbox_CONTEXTBYTES */
+	const uint8_t* key;	/* hydro_secretbox_KEYBYTES */
+	const uint8_t* iv;	/* SECRETBOX_BATCH_IVBYTES of fresh randomness */
+	uint8_t* c;	/* mlen + hydro_secretbox_HEADERBYTES, not overlapping m */
+} secretbox_batch_item;
+
+typedef struct {
+	const uint8_t* m;
+	size_t mlen;
+	uint8_t* out;	/* outlen bytes */
+} hash_batch_item;
+
+/*
+ * Encrypts every item. Items may differ in length, key and context; each
+ * run of equal lengths is permuted together. Returns 0, or -1 if out of
+ * memory
+ */
+int secretbox_encrypt_batch(secretbox_batch_item* items, size_t count, gimli_backend backend);
+
+/*
+ * Hashes every item with one context, optional key (NULL for none) and
+ * output length between hydro_hash_BYTES_MIN and hydro_hash_BYTES_MAX.
+ * Returns 0, or -1 if out of memory
+ */
+int hash_batch(hash_batch_item* items, size_t count, size_t outlen,
+               const uint8_t* ctx, const uint8_t* key, gimli_backend backend);
+
+#endif
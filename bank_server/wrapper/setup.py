@@ -1,5 +1,5 @@
 from distutils.core import setup, Extension
 
 setup(
-        ext_modules=[Extension("crypto", ["libhydrogen/hydrogen.c", "cryptowrapper.c"])]
+        ext_modules=[Extension("crypto", ["libhydrogen/hydrogen.c", "cryptowrapper.c", "gimli_batch.c", "hydro_batch.c"])]
     )
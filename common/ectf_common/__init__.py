@@ -0,0 +1,5 @@
+"""Code shared by the atm_backend and bank_server
+
+The two run in separate images, so this package is installed into both
+(see their Dockerfiles) instead of being copied into each.
+"""
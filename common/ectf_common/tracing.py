@@ -0,0 +1,255 @@
+"""Transaction tracing
+
+Spans are written as Chrome/Perfetto trace events to a rotating file, one
+event per line inside a JSON array. Open the file in chrome://tracing or
+ui.perfetto.dev. Files from the atm_backend and bank_server can be loaded
+together: every span carries the trace_id of the transaction it belongs to,
+and a flow arrow links each bank RPC to the span that served it.
+
+Tracing stays off until configure() is called with enabled set. Until then
+span() hands back a shared no-op object, so instrumented code only pays for
+a function call and a with statement.
+
+The trace context (trace_id:span_id) crosses the RPC boundary in the
+X-Trace-Context HTTP header, or in the binary protocol's request body, so
+RPC signatures do not change. current_context() gives the context to send
+and set_remote_context() adopts a received one; the transport and request
+handler glue lives in each package's own tracing module.
+"""
+
+import os
+import json
+import time
+import logging
+import threading
+import functools
+from binascii import hexlify
+from logging import handlers
+
+TRACE_HEADER = 'X-Trace-Context'
+
+_writer = None
+_local = threading.local()
+
+
+class TraceFileHandler(handlers.RotatingFileHandler):
+    """
+    RotatingFileHandler that opens every file with the '[' that starts a
+    trace-event array (the closing ']' is optional for trace viewers) and
+    repeats the process metadata so each rotated file stands on its own
+
+    Args:
+        filename (str): Trace file path
+        max_bytes (int): Size at which the file is rotated
+        backup_count (int): Number of rotated files to keep
+        preamble (list of str): Events written at the top of every file
+    """
+
+    def __init__(self, filename, max_bytes, backup_count, preamble):
+        self.preamble = preamble
+        handlers.RotatingFileHandler.__init__(self, filename,
+                                              maxBytes=max_bytes,
+                                              backupCount=backup_count)
+
+    def _open(self):
+        empty = (not os.path.exists(self.baseFilename)
+                 or os.path.getsize(self.baseFilename) == 0)
+        stream = handlers.RotatingFileHandler._open(self)
+        if empty:
+            stream.write('[\n')
+            for event in self.preamble:
+                stream.write(event + ',\n')
+            stream.flush()
+        return stream
+
+
+class _TraceWriter(object):
+    """Serializes finished events to the trace log"""
+
+    def __init__(self, filename, max_bytes, backup_count, process_name):
+        self.pid = os.getpid()
+        meta = json.dumps({'name': 'process_name', 'ph': 'M', 'pid': self.pid,
+                           'args': {'name': process_name}})
+        self.log = logging.getLogger('tracing.%s' % process_name)
+        self.log.propagate = False
+        self.log.setLevel(logging.INFO)
+        fh = TraceFileHandler(filename, max_bytes, backup_count, [meta])
+        fh.setFormatter(logging.Formatter('%(message)s,'))
+        self.log.addHandler(fh)
+
+    def emit(self, event):
+        event['pid'] = self.pid
+        event['tid'] = threading.current_thread().ident
+        self.log.info(json.dumps(event))
+
+
+class _NoopSpan(object):
+    """Stands in for Span while tracing is disabled"""
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        return False
+
+    def set(self, **args):
+        pass
+
+_NOOP = _NoopSpan()
+
+
+def _now_us():
+    return int(time.time() * 1000000)
+
+
+def _new_id():
+    return hexlify(os.urandom(8))
+
+
+class Span(object):
+    """
+    A timed section of a transaction, recorded as a complete ('X') event
+
+    Args:
+        name (str): Event name shown in the viewer
+        args (dict or None): Extra values attached to the event
+        flow_out (bool): Start a flow arrow at this span, used for outbound
+            RPCs so the viewer links them to the remote span that served them
+    """
+
+    def __init__(self, name, args=None, flow_out=False):
+        self.name = name
+        self.args = args or {}
+        self.flow_out = flow_out
+
+    def set(self, **args):
+        """Attaches values discovered while the span is open"""
+        self.args.update(args)
+
+    def __enter__(self):
+        self.parent = getattr(_local, 'span', None)
+        self.flow_in = None
+        if self.parent is not None:
+            self.trace_id = self.parent.trace_id
+            parent_id = self.parent.span_id
+        else:
+            remote = getattr(_local, 'remote', None)
+            if remote is not None:
+                self.trace_id, parent_id = remote
+                self.flow_in = parent_id
+            else:
+                self.trace_id, parent_id = _new_id(), None
+        self.span_id = _new_id()
+        self.args['trace_id'] = self.trace_id
+        self.args['span_id'] = self.span_id
+        self.args['parent_id'] = parent_id
+        _local.span = self
+        self.start = _now_us()
+        return self
+
+    def __exit__(self, exc_type, exc, tb):
+        end = _now_us()
+        _local.span = self.parent
+        writer = _writer
+        if writer is None:
+            return False
+        if exc_type is not None:
+            self.args['error'] = exc_type.__name__
+        writer.emit({'name': self.name, 'cat': 'span', 'ph': 'X',
+                     'ts': self.start, 'dur': end - self.start,
+                     'args': self.args})
+        if self.flow_in is not None:
+            writer.emit({'name': 'rpc', 'cat': 'rpc', 'ph': 'f', 'bp': 'e',
+                         'id': self.flow_in, 'ts': self.start})
+        if self.flow_out:
+            writer.emit({'name': 'rpc', 'cat': 'rpc', 'ph': 's',
+                         'id': self.span_id, 'ts': self.start})
+        return False
+
+
+def configure(config, process_name, base_path):
+    """
+    Enables tracing from the tracing section of config.yaml
+
+    Args:
+        config (dict or None): tracing section with enabled, path, name,
+            max_bytes and backup_count keys
+        process_name (str): Name shown for this process in the viewer
+        base_path (str): Directory the configured path is relative to
+    """
+    global _writer
+    if not config or not config.get('enabled'):
+        _writer = None
+        return
+    trace_path = base_path + config['path']
+    filename = '%s/%s.json' % (trace_path, config['name'])
+    _writer = _TraceWriter(filename, int(config['max_bytes']),
+                           int(config['backup_count']), process_name)
+    logging.info('Tracing transactions to %s' % filename)
+
+
+def enabled():
+    return _writer is not None
+
+
+def span(name, flow_out=False, **args):
+    """
+    Opens a span for use in a with statement
+
+    Args:
+        name (str): Event name shown in the viewer
+        flow_out (bool, optional): Mark the span as an outbound RPC
+        **args: Extra values attached to the event
+
+    Returns:
+        Span, or a shared no-op span when tracing is disabled
+    """
+    if _writer is None:
+        return _NOOP
+    return Span(name, args, flow_out)
+
+
+def traced(name, flow_out=False):
+    """
+    Decorator that records every call of the wrapped function as a span
+
+    Args:
+        name (str): Event name shown in the viewer
+        flow_out (bool, optional): Mark the span as an outbound RPC
+    """
+    def decorator(func):
+        @functools.wraps(func)
+        def wrapper(*args, **kwargs):
+            if _writer is None:
+                return func(*args, **kwargs)
+            with Span(name, None, flow_out):
+                return func(*args, **kwargs)
+        return wrapper
+    return decorator
+
+
+def current_context():
+    """
+    Returns:
+        str: trace_id:span_id of the innermost open span, or None
+    """
+    current = getattr(_local, 'span', None)
+    if current is None:
+        return None
+    return '%s:%s' % (current.trace_id, current.span_id)
+
+
+def set_remote_context(header):
+    """
+    Adopts the trace context an RPC caller sent, so spans opened while
+    serving the request join the caller's transaction
+
+    Args:
+        header (str or None): Value of the X-Trace-Context header
+    """
+    _local.span = None
+    _local.remote = None
+    if header:
+        trace_id, _, span_id = header.partition(':')
+        if trace_id and span_id:
+            _local.remote = (trace_id, span_id)
@@ -0,0 +1,10 @@
+from setuptools import setup
+
+setup(
+    name='ectf_common',
+    version='1.0.0',
+    description='Code shared by the atm_backend and bank_server',
+    url='',
+    python_requires='<3',
+    packages=['ectf_common'],
+)